@@ -0,0 +1,211 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "calib.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Maximum length of a line in the calibration file. */
+#define CALIB_LINE_SIZE		256
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+static double clamp(double val, double min, double max)
+{
+	if (val < min)
+		return min;
+	if (val > max)
+		return max;
+	return val;
+}
+
+/**
+ * Parses the calibration file and stores the values in cal.
+ * Syntax, one statement per line, '#' starts a comment:
+ *   gamma <g> | gamma <r> <g> <b>
+ *   brightness <b>
+ *   gain <r> <g> <b>
+ *   panel <index> gain <r> <g> <b>
+ */
+static int calib_parse(struct calib *cal, const char *path)
+{
+	char line[CALIB_LINE_SIZE];
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		double v[3];
+		unsigned int panel;
+		char *comment;
+		int n;
+
+		lineno++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		// skip empty lines
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if ((n = sscanf(line, " gamma %lf %lf %lf", &v[0], &v[1], &v[2])) == 1 || n == 3)
+		{
+			for (int c = 0; c < CALIB_CHANNELS; c++)
+				cal->gamma[c] = (n == 1) ? v[0] : v[c];
+		}
+		else if (sscanf(line, " brightness %lf", &v[0]) == 1)
+		{
+			cal->brightness = clamp(v[0], 0.0, 1.0);
+		}
+		else if (sscanf(line, " gain %lf %lf %lf", &v[0], &v[1], &v[2]) == 3)
+		{
+			for (unsigned int p = 0; p < cal->panels; p++)
+				for (int c = 0; c < CALIB_CHANNELS; c++)
+					cal->gain[p * CALIB_CHANNELS + c] = clamp(v[c], 0.0, 1.0);
+		}
+		else if (sscanf(line, " panel %u gain %lf %lf %lf", &panel, &v[0], &v[1], &v[2]) == 4)
+		{
+			if (panel >= cal->panels)
+			{
+				printf("%s:%d: panel %u does not exist\n", path, lineno, panel);
+				continue;
+			}
+
+			for (int c = 0; c < CALIB_CHANNELS; c++)
+				cal->gain[panel * CALIB_CHANNELS + c] = clamp(v[c], 0.0, 1.0);
+		}
+		else
+		{
+			printf("%s:%d: syntax error\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Fills all lookup tables from the calibration parameters.
+ */
+static void calib_build(struct calib *cal)
+{
+	unsigned int entries = 1u << cal->depth;
+	double max = entries - 1;
+
+	for (unsigned int p = 0; p < cal->panels; p++)
+	{
+		for (int c = 0; c < CALIB_CHANNELS; c++)
+		{
+			uint8_t *lut = (uint8_t*)calib_lut(cal, p, c);
+			uint16_t *lut16 = (uint16_t*)calib_lut16(cal, p, c);
+			double scale = 255 * cal->brightness * cal->gain[p * CALIB_CHANNELS + c];
+
+			for (unsigned int i = 0; i < entries; i++)
+			{
+				double val = clamp(scale * pow(i / max, cal->gamma[c]), 0, 255);
+
+				lut[i] = (uint8_t) round(val);
+				lut16[i] = (uint16_t) round(val * (1 << CALIB_FRAC_BITS));
+			}
+		}
+
+		// the tables can be skipped if they would not change anything
+		cal->identity[p] = (cal->depth == CALIB_DEPTH_SD);
+		for (int c = 0; c < CALIB_CHANNELS && cal->identity[p]; c++)
+			for (unsigned int i = 0; i < entries && cal->identity[p]; i++)
+				cal->identity[p] = (calib_lut(cal, p, c)[i] == i);
+	}
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+struct calib *calib_load(const char *path, unsigned int panels, unsigned int depth, double gamma)
+{
+	struct calib *cal;
+
+	if (depth != CALIB_DEPTH_SD && depth != CALIB_DEPTH_HD)
+	{
+		printf("calib: unsupported input depth %u\n", depth);
+		return NULL;
+	}
+
+	cal = calloc(1, sizeof(struct calib));
+	if (cal == NULL)
+		return NULL;
+
+	cal->panels = panels;
+	cal->depth = depth;
+	cal->brightness = 1.0;
+	cal->gain = malloc(panels * CALIB_CHANNELS * sizeof(double));
+	cal->lut = malloc((panels * CALIB_CHANNELS) << depth);
+	cal->lut16 = malloc(((panels * CALIB_CHANNELS) << depth) * sizeof(uint16_t));
+	cal->identity = calloc(panels, sizeof(bool));
+	if (cal->gain == NULL || cal->lut == NULL || cal->lut16 == NULL || cal->identity == NULL)
+		goto err;
+
+	for (int c = 0; c < CALIB_CHANNELS; c++)
+		cal->gamma[c] = gamma;
+	for (unsigned int i = 0; i < panels * CALIB_CHANNELS; i++)
+		cal->gain[i] = 1.0;
+
+	if (path != NULL && calib_parse(cal, path) < 0)
+		goto err;
+
+	calib_build(cal);
+
+	return cal;
+
+err:
+	calib_free(cal);
+	return NULL;
+}
+
+void calib_free(struct calib *cal)
+{
+	if (cal == NULL)
+		return;
+
+	free(cal->gain);
+	free(cal->lut);
+	free(cal->lut16);
+	free(cal->identity);
+	free(cal);
+}
@@ -0,0 +1,123 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CALIB_H_
+#define _CALIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Color channels of a calibration table. */
+#define CALIB_RED			0
+#define CALIB_GREEN			1
+#define CALIB_BLUE			2
+#define CALIB_CHANNELS		3
+
+/** Supported input depths in bits per channel. */
+#define CALIB_DEPTH_SD		8
+#define CALIB_DEPTH_HD		12
+
+/** Fractional bits of the high precision tables. */
+#define CALIB_FRAC_BITS		8
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Precomputed color calibration of a wall. For every panel and channel
+ * a lookup table maps an input value to the value sent to the panel.
+ * Gamma, global brightness and the white-balance gains of the panel are
+ * all folded into that single table.
+ */
+struct calib
+{
+	/** Number of panels a table set exists for. */
+	unsigned int panels;
+
+	/** Input depth in bits, every table has (1 << depth) entries. */
+	unsigned int depth;
+
+	/** Gamma exponent per channel. */
+	double gamma[CALIB_CHANNELS];
+
+	/** Global brightness factor (0.0 - 1.0). */
+	double brightness;
+
+	/** White-balance gains, panels * CALIB_CHANNELS. */
+	double *gain;
+
+	/** Lookup tables, panels * CALIB_CHANNELS * (1 << depth). */
+	uint8_t *lut;
+
+	/** Same tables with CALIB_FRAC_BITS fractional bits for dithering. */
+	uint16_t *lut16;
+
+	/** Per panel: all tables map every value onto itself. */
+	bool *identity;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Builds the calibration tables for a wall.
+ * @param path calibration file, NULL for the defaults
+ * @param panels number of panels of the wall
+ * @param depth input depth in bits per channel
+ * @param gamma default gamma if the file does not specify one
+ * @return the calibration or NULL on error
+ */
+struct calib *calib_load(const char *path, unsigned int panels, unsigned int depth, double gamma);
+
+/**
+ * Releases all memory of a calibration.
+ * @param cal calibration to free, may be NULL
+ */
+void calib_free(struct calib *cal);
+
+/**
+ * Returns the lookup table for a channel of a panel.
+ * @param cal calibration
+ * @param panel index of the panel
+ * @param channel CALIB_RED, CALIB_GREEN or CALIB_BLUE
+ */
+static inline const uint8_t *calib_lut(const struct calib *cal, unsigned int panel, unsigned int channel)
+{
+	return cal->lut + ((panel * CALIB_CHANNELS + channel) << cal->depth);
+}
+
+/**
+ * Returns the high precision lookup table for a channel of a panel.
+ * @param cal calibration
+ * @param panel index of the panel
+ * @param channel CALIB_RED, CALIB_GREEN or CALIB_BLUE
+ */
+static inline const uint16_t *calib_lut16(const struct calib *cal, unsigned int panel, unsigned int channel)
+{
+	return cal->lut16 + ((panel * CALIB_CHANNELS + channel) << cal->depth);
+}
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/ether.h>
+
+#include "compose.h"
+#include "utils.h"
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Fingerprints a rectangular region of the framebuffer.
+ */
+static uint64_t fb_region_hash(const uint8_t *fb, uint32_t line_length, uint32_t bpp,
+	uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (uint32_t row = y; row < y + h; row++)
+		hash = hash_bytes(hash, fb + row * line_length + x * bpp, w * bpp);
+
+	return hash;
+}
+
+/**
+ * Checks whether the kernel saw any of h lines starting at y being written.
+ */
+static bool fb_lines_dirty(const struct ledfb_dirty *dirty, uint32_t y, uint32_t h)
+{
+	if (y + h <= dirty->y1 || y >= dirty->y2)
+		return false;
+
+	for (uint32_t b = y / dirty->band; b <= (y + h - 1) / dirty->band && b < LEDFB_DIRTY_BITS; b++)
+		if (dirty->rows[b / 32] & (1u << (b % 32)))
+			return true;
+
+	return false;
+}
+
+/**
+ * Accounts a sent packet to the counters of its panel.
+ */
+static void compose_account(struct compose *c, unsigned int panel, size_t len, int status)
+{
+	struct metrics_panel *counters = &c->metrics->panels[panel];
+
+	if (status < 0)
+	{
+		metrics_add(&counters->errors, 1);
+		return;
+	}
+
+	metrics_add(&counters->packets, 1);
+	metrics_add(&counters->bytes, len);
+}
+
+/**
+ * Stops the recording after a write error, called with the record lock held.
+ */
+static void compose_record_failed(struct compose *c)
+{
+	printf("record: cannot write the frame, recording stopped\n");
+	record_close(c->record);
+	c->record = NULL;
+}
+
+/**
+ * Appends the packets of the current batch of a shard to the recording.
+ * The recording stops at the first write error.
+ */
+static void compose_record(struct compose *c, const struct compose_shard *shard,
+	const struct tx *tx, unsigned int count)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&c->record_lock);
+	for (unsigned int i = 0; c->record != NULL && i < count && ret == 0; i++)
+		ret = record_packet(c->record, c->layout->chunks[shard->batch_chunks[shard->batch[i]]].panel,
+			tx->packets[i] + ETH_HLEN, tx->lens[i] - ETH_HLEN);
+
+	if (ret < 0)
+		compose_record_failed(c);
+	pthread_mutex_unlock(&c->record_lock);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  pipeline stages
+// ----------------------------------------------------------------------------------
+
+/**
+ * Composes the payload of all chunks of a panel whose source
+ * region changed or whose keepalive is due.
+ */
+static void compose_panel(void *priv, struct pipeline_frame *frame, unsigned int panel)
+{
+	struct compose *c = priv;
+	const struct compose_frame *info = frame->priv;
+	bool swap = c->layout->panels[panel].swap_rb;
+
+	// lookup tables are indexed by the framebuffer byte order
+	const uint8_t *const lut[3] =
+	{
+		calib_lut(c->cal, panel, CALIB_BLUE),
+		calib_lut(c->cal, panel, CALIB_GREEN),
+		calib_lut(c->cal, panel, CALIB_RED),
+	};
+
+	for (unsigned int i = c->panel_chunks[panel]; i < c->panel_chunks[panel + 1]; i++)
+	{
+		const struct layout_chunk *chunk = &c->layout->chunks[i];
+		struct compose_chunk *state = &c->chunks[i];
+		uint64_t sent = __atomic_load_n(&state->sent, __ATOMIC_RELAXED);
+		uint8_t *packet = frame->payload + i * c->slot_size;
+		int packet_pos = 0;
+
+		frame->lens[i] = 0;
+
+		// skip chunks whose source region did not change, unless the
+		// keepalive interval is due or their dither has not settled yet
+		bool due = (c->keepalive == 0) || (sent == 0) || state->moving ||
+			(frame->start - sent >= c->keepalive);
+
+		// lines the kernel did not see being written need no fingerprint
+		if (!due && info->events == FB_EVENTS_DIRTY &&
+			!fb_lines_dirty(&info->dirty, info->yoffset + chunk->y, chunk->height))
+			continue;
+
+		uint64_t hash = fb_region_hash(frame->snapshot, c->line_length, c->bpp,
+			chunk->x, chunk->y, chunk->width, chunk->height);
+		if (!due && hash == state->hash)
+			continue;
+
+		// opcode and chunk
+		packet[packet_pos++] = PP_OP_STORE_FRAME;
+		packet[packet_pos++] = (uint8_t)chunk->id;
+
+		// convert the pixels in wire order
+		if (c->dither)
+		{
+			const uint16_t *const lut16[3] =
+			{
+				calib_lut16(c->cal, panel, CALIB_BLUE),
+				calib_lut16(c->cal, panel, CALIB_GREEN),
+				calib_lut16(c->cal, panel, CALIB_RED),
+			};
+
+			packet_pos += encode_chunk_dither(c->encoder, packet + packet_pos, frame->snapshot,
+				c->layout, chunk, c->bpp, swap ? ENCODE_SWAP : 0, lut16, c->cal->depth,
+				c->residuals + chunk->gather * ENCODE_BPP, &state->moving);
+		}
+		else if (c->known_format)
+		{
+			unsigned int flags = (swap ? ENCODE_SWAP : 0) |
+				(c->cal->identity[panel] ? 0 : ENCODE_LUT);
+			packet_pos += encode_chunk(c->encoder, packet + packet_pos, frame->snapshot,
+				c->layout, chunk, c->bpp, flags, lut);
+		}
+		else
+		{
+			const uint32_t *gather = c->layout->gather + chunk->gather;
+			int c0 = swap ? 2 : 0, c2 = 2 - c0;
+
+			for (unsigned int p = 0; p < chunk->pixels; p++)
+			{
+				const uint8_t *fb_base = frame->snapshot + gather[p];
+				packet[packet_pos++] = lut[c0][fb_base[c0]];
+				packet[packet_pos++] = lut[1][fb_base[1]];
+				packet[packet_pos++] = lut[c2][fb_base[c2]];
+			}
+		}
+
+		frame->lens[i] = packet_pos;
+		state->hash = hash;
+		__atomic_store_n(&state->sent, frame->start, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Packs the composed chunks of the panels of a shard into packets and
+ * sends them at once, failed chunks are retried with the next frame.
+ * Panels with a multi chunk firmware get as many chunks per packet as
+ * the mtu allows, all others one chunk per packet.
+ */
+static void send_frame(void *priv, struct pipeline_frame *frame, unsigned int s)
+{
+	struct compose *c = priv;
+	struct compose_shard *shard = &c->shards[s];
+	struct tx *tx = &c->tx[s];
+	unsigned int entries = 0;
+
+	shard->begin = clock_us();
+
+	for (unsigned int n = 0; n < shard->panel_count; n++)
+	{
+		unsigned int p = shard->panels[n];
+		const struct layout_panel *panel = &c->layout->panels[p];
+		uint8_t *packet = NULL;
+		size_t packet_pos = 0;
+
+		for (unsigned int i = c->panel_chunks[p]; i < c->panel_chunks[p + 1]; i++)
+		{
+			const uint8_t *payload = frame->payload + i * c->slot_size;
+			size_t pixel_bytes;
+
+			if (frame->lens[i] == 0)
+				continue;
+			pixel_bytes = frame->lens[i] - PP_HEADER_SIZE;
+
+			// close the packet if the chunk does not fit anymore
+			if (packet != NULL && (!panel->multi_chunk || packet[1] == UINT8_MAX ||
+				packet_pos + PP_DESC_SIZE + pixel_bytes > tx->payload_size))
+			{
+				tx_commit(tx, packet_pos);
+				packet = NULL;
+			}
+
+			if (packet == NULL)
+			{
+				packet = tx_packet(tx, panel->mac);
+				if (packet == NULL)
+				{
+					__atomic_store_n(&c->chunks[i].sent, 0, __ATOMIC_RELAXED);
+					continue;
+				}
+
+				shard->batch[tx->count - 1] = entries;
+				packet_pos = 0;
+				if (panel->multi_chunk)
+				{
+					packet[packet_pos++] = PP_OP_STORE_CHUNKS;
+					packet[packet_pos++] = 0;
+				}
+			}
+			shard->batch_chunks[entries++] = i;
+
+			if (!panel->multi_chunk)
+			{
+				memcpy(packet, payload, frame->lens[i]);
+				packet_pos = frame->lens[i];
+				continue;
+			}
+
+			// chunk descriptor followed by the pixels
+			packet[1]++;
+			packet[packet_pos++] = payload[1];
+			packet[packet_pos++] = (uint8_t)((pixel_bytes / PANEL_BPP) >> 8);
+			packet[packet_pos++] = (uint8_t)(pixel_bytes / PANEL_BPP);
+			memcpy(packet + packet_pos, payload + PP_HEADER_SIZE, pixel_bytes);
+			packet_pos += pixel_bytes;
+		}
+
+		if (packet != NULL)
+			tx_commit(tx, packet_pos);
+	}
+
+	int count = tx->count;
+	shard->batch[count] = entries;
+	if (c->record != NULL)
+		compose_record(c, shard, tx, count);
+	tx_flush(tx);
+	for (int i = 0; i < count; i++)
+	{
+		if (c->metrics != NULL)
+			compose_account(c, c->layout->chunks[shard->batch_chunks[shard->batch[i]]].panel,
+				tx->lens[i], tx->status[i]);
+
+		if (tx->status[i] >= 0)
+			continue;
+
+		for (unsigned int e = shard->batch[i]; e < shard->batch[i + 1]; e++)
+		{
+			const struct layout_chunk *chunk = &c->layout->chunks[shard->batch_chunks[e]];
+
+			printf("sendto: panel %u chunk %u: %s\n",
+				chunk->panel, chunk->id, strerror(-tx->status[i]));
+			__atomic_store_n(&c->chunks[shard->batch_chunks[e]].sent, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	// an asynchronous backend only learns about failed packets of the
+	// previous batch, it is not known which, resend all panels of the shard
+	if (tx->packets_dropped != shard->dropped)
+	{
+		shard->dropped = tx->packets_dropped;
+		for (unsigned int n = 0; n < shard->panel_count; n++)
+		{
+			unsigned int p = shard->panels[n];
+
+			for (unsigned int i = c->panel_chunks[p]; i < c->panel_chunks[p + 1]; i++)
+				__atomic_store_n(&c->chunks[i].sent, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Finishes a frame once every shard sent its panels: commits it to the
+ * recording and updates the frame counters.
+ */
+static void sent_frame(void *priv, struct pipeline_frame *frame)
+{
+	struct compose *c = priv;
+
+	if (c->record != NULL)
+	{
+		pthread_mutex_lock(&c->record_lock);
+		if (c->record != NULL && record_commit(c->record, frame->start) < 0)
+			compose_record_failed(c);
+		pthread_mutex_unlock(&c->record_lock);
+	}
+
+	if (c->metrics != NULL)
+	{
+		uint64_t end = clock_us();
+		uint64_t begin = end;
+
+		for (unsigned int s = 0; s < c->shard_count; s++)
+			if (c->shards[s].begin < begin)
+				begin = c->shards[s].begin;
+
+		metrics_observe(c->metrics, METRICS_SEND, end - begin);
+		metrics_observe(c->metrics, METRICS_LATENCY, end - frame->start);
+		metrics_add(&c->metrics->frames_sent, 1);
+		if (end - frame->start > c->metrics->period_us)
+			metrics_add(&c->metrics->frames_late, 1);
+	}
+}
+
+const struct pipeline_ops compose_pipeline_ops =
+{
+	.compose = compose_panel,
+	.send = send_frame,
+	.sent = sent_frame,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+int compose_init(struct compose *c)
+{
+	const struct layout *layout = c->layout;
+
+	if (c->shard_count == 0)
+		c->shard_count = 1;
+
+	pthread_mutex_init(&c->record_lock, NULL);
+
+	c->chunks = calloc(layout->chunk_count, sizeof(struct compose_chunk));
+	c->panel_chunks = calloc(layout->panel_count + 1, sizeof(unsigned int));
+	c->shards = calloc(c->shard_count, sizeof(struct compose_shard));
+	if (c->chunks == NULL || c->panel_chunks == NULL || c->shards == NULL)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	for (unsigned int s = 0; s < c->shard_count; s++)
+	{
+		struct compose_shard *shard = &c->shards[s];
+
+		shard->panels = calloc(layout->panel_count, sizeof(unsigned int));
+		shard->batch = calloc(layout->chunk_count + 1, sizeof(unsigned int));
+		shard->batch_chunks = calloc(layout->chunk_count, sizeof(unsigned int));
+		if (shard->panels == NULL || shard->batch == NULL || shard->batch_chunks == NULL)
+		{
+			perror("malloc");
+			goto err;
+		}
+	}
+
+	// every port is served by its own shard
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		unsigned int port = layout->panels[p].port;
+
+		if (port >= c->shard_count)
+		{
+			printf("panel %u is on port %u, but there are only %u interfaces\n",
+				p, port, c->shard_count);
+			goto err;
+		}
+		c->shards[port].panels[c->shards[port].panel_count++] = p;
+	}
+
+	if (c->dither)
+	{
+		c->residuals = malloc(layout->gather_count * ENCODE_BPP);
+		if (c->residuals == NULL)
+		{
+			perror("malloc");
+			goto err;
+		}
+		encode_dither_seed(c->residuals, layout->gather_count * ENCODE_BPP);
+	}
+
+	// the chunks of a panel follow each other in the layout
+	for (unsigned int i = 0; i < layout->chunk_count; i++)
+		c->panel_chunks[layout->chunks[i].panel + 1] = i + 1;
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+		if (c->panel_chunks[p + 1] < c->panel_chunks[p])
+			c->panel_chunks[p + 1] = c->panel_chunks[p];
+
+	// every chunk has to fit into a packet of its port on its own
+	c->slot_size = 0;
+	for (unsigned int i = 0; i < layout->chunk_count; i++)
+	{
+		const struct layout_chunk *chunk = &layout->chunks[i];
+		const struct layout_panel *panel = &layout->panels[chunk->panel];
+		size_t size = chunk->pixels * PANEL_BPP + (panel->multi_chunk ?
+			PP_MULTI_HEADER_SIZE + PP_DESC_SIZE : PP_HEADER_SIZE);
+
+		if (size > c->tx[panel->port].payload_size)
+		{
+			printf("chunks of panel %u do not fit into the mtu (%zu > %zu bytes)\n",
+				chunk->panel, size, c->tx[panel->port].payload_size);
+			goto err;
+		}
+
+		if (PP_HEADER_SIZE + chunk->pixels * PANEL_BPP > c->slot_size)
+			c->slot_size = PP_HEADER_SIZE + chunk->pixels * PANEL_BPP;
+	}
+
+	return 0;
+
+err:
+	compose_free(c);
+	return -1;
+}
+
+void compose_free(struct compose *c)
+{
+	for (unsigned int s = 0; c->shards != NULL && s < c->shard_count; s++)
+	{
+		free(c->shards[s].panels);
+		free(c->shards[s].batch);
+		free(c->shards[s].batch_chunks);
+	}
+
+	free(c->chunks);
+	free(c->panel_chunks);
+	free(c->residuals);
+	free(c->shards);
+	c->chunks = NULL;
+	c->panel_chunks = NULL;
+	c->residuals = NULL;
+	c->shards = NULL;
+}
+
+void compose_invalidate(struct compose *c)
+{
+	for (unsigned int i = 0; i < c->layout->chunk_count; i++)
+		__atomic_store_n(&c->chunks[i].sent, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,200 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _COMPOSE_H_
+#define _COMPOSE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "calib.h"
+#include "encode.h"
+#include "layout.h"
+#include "ledfb.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "record.h"
+#include "tx.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Bytes per pixel sent to a panel. */
+#define PANEL_BPP			3
+
+/** Pixel protocol opcodes. */
+#define PP_OP_STORE_FRAME	0x29
+#define PP_OP_STORE_CHUNKS	0x2A
+
+/** Pixel protocol header: opcode (1) + segment (1). */
+#define PP_HEADER_SIZE		2
+
+/** Multi chunk header: opcode (1) + number of chunks (1). */
+#define PP_MULTI_HEADER_SIZE	2
+
+/** Descriptor preceding each chunk: segment (1) + pixels (2, big endian). */
+#define PP_DESC_SIZE		3
+
+/** How the framebuffer notifies us about new content. */
+#define FB_EVENTS_NONE		0
+#define FB_EVENTS_FLIP		1
+#define FB_EVENTS_DIRTY		2
+#define FB_EVENTS_QUEUE		3
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * What the capture stage learned about a frame, the priv data of
+ * every pipeline frame.
+ */
+struct compose_frame
+{
+	/** FB_EVENTS_* the frame was captured with. */
+	int events;
+
+	/** First line of the front buffer in the virtual framebuffer. */
+	uint32_t yoffset;
+
+	/** Lines written since the last frame, if events is FB_EVENTS_DIRTY. */
+	struct ledfb_dirty dirty;
+};
+
+/**
+ * Transmit state of a chunk.
+ */
+struct compose_chunk
+{
+	/** Fingerprint of the source region the chunk was last composed from. */
+	uint64_t hash;
+
+	/**
+	 * Time in microseconds the chunk was last composed, 0 forces a resend.
+	 * Written by the workers and reset by the sender if a send failed.
+	 */
+	uint64_t sent;
+
+	/** The dithered output of the chunk changes even on a still source. */
+	bool moving;
+};
+
+/**
+ * Panels transmitted by one sender thread through one transmitter.
+ */
+struct compose_shard
+{
+	/** Panels on the port of the shard, in layout order. */
+	unsigned int *panels;
+	unsigned int panel_count;
+
+	/**
+	 * The chunks of each packet in the current batch: packet i carries
+	 * batch_chunks[batch[i]] up to batch_chunks[batch[i + 1]].
+	 */
+	unsigned int *batch;
+	unsigned int *batch_chunks;
+
+	/** Time in microseconds the shard started sending the current frame. */
+	uint64_t begin;
+
+	/** Packets of the transmitter known to be dropped after their flush. */
+	uint64_t dropped;
+};
+
+/**
+ * Everything the compose and send stages work with. The caller fills in
+ * the configuration, compose_init() allocates the state.
+ */
+struct compose
+{
+	struct layout *layout;
+	struct calib *cal;
+	const struct encode_ops *encoder;
+
+	/** Transmitter of every port, the panels of port n are sent by tx[n]. */
+	struct tx *tx;
+	unsigned int shard_count;
+	uint32_t line_length;
+	uint32_t bpp;
+	uint64_t keepalive;
+
+	/** The pixels have one of the formats the encoder converts. */
+	bool known_format;
+
+	/** Gamma is applied at high precision and dithered down to 8 bits. */
+	bool dither;
+
+	/** Counters the send stage updates, NULL if none are collected. */
+	struct metrics_page *metrics;
+
+	/** Recording every sent frame is appended to, NULL if not recording. */
+	struct record *record;
+	pthread_mutex_t record_lock;
+
+	/** Distance of the composed chunks in a frame's payload. */
+	unsigned int slot_size;
+
+	/** First chunk of every panel, panel_count + 1 entries. */
+	unsigned int *panel_chunks;
+
+	/** Transmit state of every chunk of the layout. */
+	struct compose_chunk *chunks;
+
+	/** Dither state of every channel of every pixel, gather_count * 3. */
+	uint8_t *residuals;
+
+	/** Send state of every port, shard_count entries. */
+	struct compose_shard *shards;
+};
+
+/** Stage callbacks for a pipeline whose context is a struct compose. */
+extern const struct pipeline_ops compose_pipeline_ops;
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Allocates the state of the stages, assigns the panels to the shard of
+ * their port and checks that every chunk fits into a packet of the
+ * transmitter of its port. A shard_count of 0 is treated as 1.
+ * @param c configured compose context
+ * @return 0 on success, -1 on error
+ */
+int compose_init(struct compose *c);
+
+/**
+ * Releases the state allocated by compose_init(). Safe to call on a
+ * zeroed context.
+ * @param c compose context
+ */
+void compose_free(struct compose *c);
+
+/**
+ * Forces all chunks to be sent with the next frame.
+ * @param c compose context
+ */
+void compose_invalidate(struct compose *c);
+
+#endif
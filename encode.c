@@ -0,0 +1,385 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "encode.h"
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/** All kernels built for this architecture, fastest first. */
+static const struct encode_ops *encoders[] =
+{
+#if defined(__x86_64__) || defined(__i386__)
+	&encode_avx2_ops,
+	&encode_ssse3_ops,
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	&encode_neon_ops,
+#endif
+	&encode_scalar_ops,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  pixel access
+// ----------------------------------------------------------------------------------
+
+/**
+ * Reads an aligned pixel of 2 or 4 bytes, the framebuffer is little endian.
+ */
+static inline uint16_t load16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * Expands a RGB565 pixel to 8 bits per channel, in framebuffer byte order.
+ * The upper bits are repeated so full intensity stays 255.
+ */
+static inline void rgb565_expand(uint8_t ch[3], uint16_t v)
+{
+	unsigned int b = v & 0x1F, g = (v >> 5) & 0x3F, r = v >> 11;
+
+	ch[0] = (uint8_t)(b << 3 | b >> 2);
+	ch[1] = (uint8_t)(g << 2 | g >> 4);
+	ch[2] = (uint8_t)(r << 3 | r >> 2);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  scalar reference kernel
+// ----------------------------------------------------------------------------------
+
+/**
+ * Divides a product of two bytes by 255, rounded.
+ */
+static inline unsigned int div255(unsigned int v)
+{
+	v += 128;
+	return (v + (v >> 8)) >> 8;
+}
+
+static bool scalar_init(void)
+{
+	return true;
+}
+
+static void scalar_span(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	int step = (flags & ENCODE_REVERSE) ? -ENCODE_BPP : ENCODE_BPP;
+	int c0 = (flags & ENCODE_SWAP) ? 2 : 0;
+	int c2 = 2 - c0;
+
+	if (flags & ENCODE_LUT)
+	{
+		const uint8_t *lut0 = lut[c0], *lut1 = lut[1], *lut2 = lut[c2];
+
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			dst[0] = lut0[src[c0]];
+			dst[1] = lut1[src[1]];
+			dst[2] = lut2[src[c2]];
+		}
+	}
+	else if (step > 0 && c0 == 0)
+	{
+		memcpy(dst, src, n * ENCODE_BPP);
+	}
+	else
+	{
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			dst[0] = src[c0];
+			dst[1] = src[1];
+			dst[2] = src[c2];
+		}
+	}
+}
+
+static void scalar_span32(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	int step = (flags & ENCODE_REVERSE) ? -ENCODE_BPP_XRGB8888 : ENCODE_BPP_XRGB8888;
+	int c0 = (flags & ENCODE_SWAP) ? 2 : 0;
+	int c2 = 2 - c0;
+	unsigned int s0 = c0 * 8, s2 = c2 * 8;
+
+	if (flags & ENCODE_LUT)
+	{
+		const uint8_t *lut0 = lut[c0], *lut1 = lut[1], *lut2 = lut[c2];
+
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			uint32_t px = load32(src);
+			dst[0] = lut0[(px >> s0) & 0xFF];
+			dst[1] = lut1[(px >> 8) & 0xFF];
+			dst[2] = lut2[(px >> s2) & 0xFF];
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			uint32_t px = load32(src);
+			dst[0] = (uint8_t)(px >> s0);
+			dst[1] = (uint8_t)(px >> 8);
+			dst[2] = (uint8_t)(px >> s2);
+		}
+	}
+}
+
+static void scalar_dither(uint8_t *dst, const uint16_t *src, uint8_t *residual, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		unsigned int val = src[i] + residual[i];
+
+		dst[i] = (uint8_t)(val >> ENCODE_FRAC_BITS);
+		residual[i] = (uint8_t)val;
+	}
+}
+
+static void scalar_blend(uint8_t *dst, const uint8_t *src, unsigned int n, unsigned int opacity, bool alpha)
+{
+	for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP_XRGB8888, src += ENCODE_BPP_XRGB8888)
+	{
+		unsigned int a = alpha ? div255(src[3] * opacity) : opacity;
+
+		for (unsigned int c = 0; c < ENCODE_BPP_XRGB8888; c++)
+			dst[c] = div255(src[c] * a + dst[c] * (255 - a));
+	}
+}
+
+const struct encode_ops encode_scalar_ops =
+{
+	.name = "scalar",
+	.init = scalar_init,
+	.span = scalar_span,
+	.span32 = scalar_span32,
+	.dither = scalar_dither,
+	.blend = scalar_blend,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Converts n RGB565 pixels, the same for every kernel as there is little
+ * to vectorize once the channels are spread over the bits of a word.
+ */
+static void encode_span16(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	int step = (flags & ENCODE_REVERSE) ? -ENCODE_BPP_RGB565 : ENCODE_BPP_RGB565;
+	int c0 = (flags & ENCODE_SWAP) ? 2 : 0;
+	int c2 = 2 - c0;
+
+	for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+	{
+		uint8_t ch[3];
+
+		rgb565_expand(ch, load16(src));
+		if (flags & ENCODE_LUT)
+		{
+			dst[0] = lut[c0][ch[c0]];
+			dst[1] = lut[1][ch[1]];
+			dst[2] = lut[c2][ch[c2]];
+		}
+		else
+		{
+			dst[0] = ch[c0];
+			dst[1] = ch[1];
+			dst[2] = ch[c2];
+		}
+	}
+}
+
+/**
+ * Looks up n pixels in the high precision tables.
+ * @return all fractional bits of the values or'ed together
+ */
+static unsigned int encode_lookup16(uint16_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int bpp, unsigned int flags, const uint16_t *const lut[3], unsigned int depth)
+{
+	int step = (flags & ENCODE_REVERSE) ? -(int)bpp : (int)bpp;
+	int c0 = (flags & ENCODE_SWAP) ? 2 : 0;
+	int c2 = 2 - c0;
+	const uint16_t *lut0 = lut[c0], *lut1 = lut[1], *lut2 = lut[c2];
+	unsigned int frac = 0;
+
+	if (bpp == ENCODE_BPP_RGB16)
+	{
+		// little endian 16 bit channels
+		unsigned int shift = 16 - depth;
+
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			dst[0] = lut0[load16(src + 2 * c0) >> shift];
+			dst[1] = lut1[load16(src + 2) >> shift];
+			dst[2] = lut2[load16(src + 2 * c2) >> shift];
+			frac |= dst[0] | dst[1] | dst[2];
+		}
+	}
+	else if (bpp == ENCODE_BPP_RGB565)
+	{
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			uint8_t ch[3];
+
+			rgb565_expand(ch, load16(src));
+			dst[0] = lut0[ch[c0]];
+			dst[1] = lut1[ch[1]];
+			dst[2] = lut2[ch[c2]];
+			frac |= dst[0] | dst[1] | dst[2];
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP, src += step)
+		{
+			dst[0] = lut0[src[c0]];
+			dst[1] = lut1[src[1]];
+			dst[2] = lut2[src[c2]];
+			frac |= dst[0] | dst[1] | dst[2];
+		}
+	}
+
+	return frac & ((1u << ENCODE_FRAC_BITS) - 1);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+const struct encode_ops *encode_select(const char *name)
+{
+	for (size_t i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++)
+	{
+		if (name != NULL && strcmp(encoders[i]->name, name) != 0)
+			continue;
+
+		if (encoders[i]->init())
+			return encoders[i];
+
+		if (name != NULL)
+		{
+			printf("encode: the cpu does not support %s\n", name);
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+size_t encode_chunk(const struct encode_ops *ops, uint8_t *dst, const uint8_t *fb,
+	const struct layout *layout, const struct layout_chunk *chunk, unsigned int bpp,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	const struct layout_span *span = layout->spans + chunk->span;
+	uint8_t *pos = dst;
+
+	for (unsigned int s = 0; s < chunk->span_count; s++, span++)
+	{
+		unsigned int span_flags = flags;
+
+		if (span->flags & LAYOUT_SPAN_REVERSE)
+			span_flags |= ENCODE_REVERSE;
+
+		// single pixels of rotated panels are not worth an indirect call
+		if (bpp == ENCODE_BPP_RGB565)
+			encode_span16(pos, fb + span->offset, span->pixels, span_flags, lut);
+		else if (bpp == ENCODE_BPP_XRGB8888 && span->pixels == 1)
+			scalar_span32(pos, fb + span->offset, 1, span_flags, lut);
+		else if (bpp == ENCODE_BPP_XRGB8888)
+			ops->span32(pos, fb + span->offset, span->pixels, span_flags, lut);
+		else if (span->pixels == 1)
+			scalar_span(pos, fb + span->offset, 1, span_flags, lut);
+		else
+			ops->span(pos, fb + span->offset, span->pixels, span_flags, lut);
+
+		pos += span->pixels * ENCODE_BPP;
+	}
+
+	return pos - dst;
+}
+
+size_t encode_chunk_dither(const struct encode_ops *ops, uint8_t *dst, const uint8_t *fb,
+	const struct layout *layout, const struct layout_chunk *chunk, unsigned int bpp,
+	unsigned int flags, const uint16_t *const lut[3], unsigned int depth,
+	uint8_t *residual, bool *moving)
+{
+	const struct layout_span *span = layout->spans + chunk->span;
+	uint16_t scratch[ENCODE_SCRATCH_SIZE];
+	unsigned int frac = 0;
+	size_t pos = 0;
+
+	for (unsigned int s = 0; s < chunk->span_count; s++, span++)
+	{
+		unsigned int span_flags = flags;
+		int step = bpp;
+
+		if (span->flags & LAYOUT_SPAN_REVERSE)
+		{
+			span_flags |= ENCODE_REVERSE;
+			step = -(int)bpp;
+		}
+
+		// the table lookup is scalar, the dithering vectorized
+		for (unsigned int done = 0; done < span->pixels; )
+		{
+			unsigned int n = span->pixels - done;
+
+			if (n > ENCODE_SCRATCH_SIZE / ENCODE_BPP)
+				n = ENCODE_SCRATCH_SIZE / ENCODE_BPP;
+
+			frac |= encode_lookup16(scratch, fb + span->offset + (ptrdiff_t)done * step, n,
+				bpp, span_flags, lut, depth);
+			ops->dither(dst + pos, scratch, residual + pos, n * ENCODE_BPP);
+
+			pos += n * ENCODE_BPP;
+			done += n;
+		}
+	}
+
+	*moving = (frac != 0);
+	return pos;
+}
+
+void encode_dither_seed(uint8_t *residual, unsigned int n)
+{
+	// additive recurrence with 1 / plastic number, a low discrepancy sequence
+	for (unsigned int i = 0; i < n; i++)
+		residual[i] = (uint8_t)(i * 193);
+}
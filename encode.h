@@ -0,0 +1,179 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ENCODE_H_
+#define _ENCODE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "layout.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Bytes per pixel of the packet and of packed 24bpp sources. */
+#define ENCODE_BPP			3
+
+/** Bytes per pixel of the other source formats. */
+#define ENCODE_BPP_RGB565	2
+#define ENCODE_BPP_XRGB8888	4
+#define ENCODE_BPP_RGB16	6
+
+/** The source pixels are read right to left. */
+#define ENCODE_REVERSE		0x01
+
+/** The first and third channel change places on the wire. */
+#define ENCODE_SWAP			0x02
+
+/** The channels are mapped through the lookup tables. */
+#define ENCODE_LUT			0x04
+
+/** Fractional bits of the high precision values being dithered. */
+#define ENCODE_FRAC_BITS	8
+
+/** Values converted at once before they are dithered. */
+#define ENCODE_SCRATCH_SIZE	1536
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * A pixel conversion kernel. It turns runs of packed 24bpp or 32bpp
+ * framebuffer pixels into packet payload.
+ */
+struct encode_ops
+{
+	/** Name of the kernel as selected on the command line. */
+	const char *name;
+
+	/** Prepares the kernel, returns false if the cpu lacks support. */
+	bool (*init)(void);
+
+	/**
+	 * Converts n pixels. Byte k of a wire pixel is taken from channel
+	 * c = k (c = 2 - k with ENCODE_SWAP) of the source pixel and mapped
+	 * through lut[c] if ENCODE_LUT is set.
+	 * @param dst packet payload, n * ENCODE_BPP bytes
+	 * @param src first source pixel in wire order
+	 * @param n number of pixels
+	 * @param flags ENCODE_* flags
+	 * @param lut 8 bit lookup table of every source channel
+	 */
+	void (*span)(uint8_t *dst, const uint8_t *src, unsigned int n,
+		unsigned int flags, const uint8_t *const lut[3]);
+
+	/**
+	 * Same as span for XRGB8888 sources, the fourth byte of a pixel is ignored.
+	 * @param src first source pixel in wire order, 4 byte aligned
+	 */
+	void (*span32)(uint8_t *dst, const uint8_t *src, unsigned int n,
+		unsigned int flags, const uint8_t *const lut[3]);
+
+	/**
+	 * Dithers high precision values down to 8 bits. The fraction of a
+	 * value is carried over to the same value of the next frame, so
+	 * over time the panel shows the exact average.
+	 * @param dst 8 bit output, n bytes
+	 * @param src values with ENCODE_FRAC_BITS fractional bits, at most 0xFF00
+	 * @param residual fractions of the previous frame, updated in place
+	 * @param n number of values
+	 */
+	void (*dither)(uint8_t *dst, const uint16_t *src, uint8_t *residual, unsigned int n);
+
+	/**
+	 * Blends XRGB8888 pixels over others, every byte becomes
+	 * (src * a + dst * (255 - a)) / 255 rounded, the same for every kernel.
+	 * @param dst pixels blended over, n * ENCODE_BPP_XRGB8888 bytes
+	 * @param src pixels to blend
+	 * @param n number of pixels
+	 * @param opacity a of every pixel, 0 ... 255
+	 * @param alpha a is scaled by the fourth byte of the source pixel
+	 */
+	void (*blend)(uint8_t *dst, const uint8_t *src, unsigned int n, unsigned int opacity, bool alpha);
+};
+
+extern const struct encode_ops encode_scalar_ops;
+extern const struct encode_ops encode_ssse3_ops;
+extern const struct encode_ops encode_avx2_ops;
+extern const struct encode_ops encode_neon_ops;
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Selects a conversion kernel.
+ * @param name name of the kernel, NULL for the fastest one the cpu supports
+ * @return the kernel or NULL if it is unknown or not supported
+ */
+const struct encode_ops *encode_select(const char *name);
+
+/**
+ * Converts all pixels of a chunk into packet payload.
+ * @param ops conversion kernel
+ * @param dst packet payload, chunk->pixels * ENCODE_BPP bytes
+ * @param fb first byte of the framebuffer page
+ * @param layout compiled layout
+ * @param chunk chunk to convert
+ * @param bpp bytes per source pixel: ENCODE_BPP_RGB565, ENCODE_BPP or ENCODE_BPP_XRGB8888
+ * @param flags ENCODE_SWAP and ENCODE_LUT
+ * @param lut 8 bit lookup table of every source channel
+ * @return number of bytes written
+ */
+size_t encode_chunk(const struct encode_ops *ops, uint8_t *dst, const uint8_t *fb,
+	const struct layout *layout, const struct layout_chunk *chunk, unsigned int bpp,
+	unsigned int flags, const uint8_t *const lut[3]);
+
+/**
+ * Converts all pixels of a chunk through high precision lookup tables and
+ * dithers them. 16 bit channels index the lookup tables with their upper
+ * depth bits, RGB565 channels are expanded to 8 bits first.
+ * @param ops kernel to dither with
+ * @param dst packet payload, chunk->pixels * ENCODE_BPP bytes
+ * @param fb first byte of the framebuffer page
+ * @param layout compiled layout
+ * @param chunk chunk to convert
+ * @param bpp bytes per source pixel, one of the ENCODE_BPP_* formats
+ * @param flags ENCODE_SWAP
+ * @param lut high precision lookup table of every source channel
+ * @param depth bits the lookup tables are indexed with
+ * @param residual dither state of the chunk, chunk->pixels * ENCODE_BPP bytes
+ * @param moving returns whether any value had a fraction, i.e. the
+ *        output changes from frame to frame even if the source does not
+ * @return number of bytes written
+ */
+size_t encode_chunk_dither(const struct encode_ops *ops, uint8_t *dst, const uint8_t *fb,
+	const struct layout *layout, const struct layout_chunk *chunk, unsigned int bpp,
+	unsigned int flags, const uint16_t *const lut[3], unsigned int depth,
+	uint8_t *residual, bool *moving);
+
+/**
+ * Seeds the dither state of a chunk, neighbouring values start with well
+ * distributed fractions so they do not toggle in the same frame.
+ * @param residual dither state, n bytes
+ * @param n number of values
+ */
+void encode_dither_seed(uint8_t *residual, unsigned int n);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "encode.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Pixels converted by one deinterleaving load. */
+#define BLOCK_PIXELS		16
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Reverses the order of the 16 bytes of a vector.
+ */
+static inline uint8x16_t neon_reverse(uint8x16_t v)
+{
+	v = vrev64q_u8(v);
+	return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+
+#if defined(__aarch64__)
+/**
+ * Looks up 16 bytes in a 256 entry table held in 16 vectors. Each tbl
+ * covers 64 entries and yields zero for indices outside of them.
+ */
+static inline uint8x16_t neon_lookup(const uint8x16x4_t t[4], uint8x16_t idx)
+{
+	const uint8x16_t quarter = vdupq_n_u8(64);
+	uint8x16_t res = vqtbl4q_u8(t[0], idx);
+
+	idx = vsubq_u8(idx, quarter);
+	res = vorrq_u8(res, vqtbl4q_u8(t[1], idx));
+	idx = vsubq_u8(idx, quarter);
+	res = vorrq_u8(res, vqtbl4q_u8(t[2], idx));
+	idx = vsubq_u8(idx, quarter);
+	return vorrq_u8(res, vqtbl4q_u8(t[3], idx));
+}
+#endif
+
+/**
+ * Divides 16 bit products of two bytes by 255, rounded.
+ */
+static inline uint8x8_t neon_div255(uint16x8_t v)
+{
+	return vrshrn_n_u16(vrsraq_n_u16(v, v, 8), 8);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  neon kernel
+// ----------------------------------------------------------------------------------
+
+static bool neon_init(void)
+{
+#if defined(__aarch64__)
+	return true;
+#else
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+/**
+ * Converts pixels with the scalar kernel of the source format.
+ */
+static inline void neon_scalar(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3], unsigned int bpp)
+{
+	if (bpp == ENCODE_BPP_XRGB8888)
+		encode_scalar_ops.span32(dst, src, n, flags, lut);
+	else
+		encode_scalar_ops.span(dst, src, n, flags, lut);
+}
+
+/**
+ * Converts n packed 24bpp or XRGB8888 pixels, the deinterleaving load
+ * drops the fourth byte of the latter.
+ */
+static inline void neon_convert(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3], unsigned int bpp)
+{
+	bool reverse = (flags & ENCODE_REVERSE) != 0;
+	unsigned int i = 0;
+
+#if defined(__aarch64__)
+	uint8x16x4_t tables[3][4];
+
+	if (flags & ENCODE_LUT)
+		for (int c = 0; c < 3; c++)
+			for (int q = 0; q < 4; q++)
+				tables[c][q] = vld1q_u8_x4(lut[c] + q * 64);
+#else
+	// armv7 has no table lookup wide enough for 256 entries
+	if (flags & ENCODE_LUT)
+	{
+		neon_scalar(dst, src, n, flags, lut, bpp);
+		return;
+	}
+#endif
+
+	for (; i + BLOCK_PIXELS <= n; i += BLOCK_PIXELS)
+	{
+		const uint8_t *block = reverse ? src - (i + BLOCK_PIXELS - 1) * bpp : src + i * bpp;
+		uint8x16x3_t px;
+		uint8x16x3_t out;
+
+		if (bpp == ENCODE_BPP_XRGB8888)
+		{
+			uint8x16x4_t px4 = vld4q_u8(block);
+			px.val[0] = px4.val[0];
+			px.val[1] = px4.val[1];
+			px.val[2] = px4.val[2];
+		}
+		else
+		{
+			px = vld3q_u8(block);
+		}
+
+		for (int c = 0; c < 3; c++)
+		{
+			if (reverse)
+				px.val[c] = neon_reverse(px.val[c]);
+#if defined(__aarch64__)
+			if (flags & ENCODE_LUT)
+				px.val[c] = neon_lookup(tables[c], px.val[c]);
+#endif
+		}
+
+		out.val[0] = px.val[(flags & ENCODE_SWAP) ? 2 : 0];
+		out.val[1] = px.val[1];
+		out.val[2] = px.val[(flags & ENCODE_SWAP) ? 0 : 2];
+		vst3q_u8(dst + i * ENCODE_BPP, out);
+	}
+
+	if (i < n)
+		neon_scalar(dst + i * ENCODE_BPP, reverse ? src - i * bpp : src + i * bpp,
+			n - i, flags, lut, bpp);
+}
+
+static void neon_span(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	neon_convert(dst, src, n, flags, lut, ENCODE_BPP);
+}
+
+static void neon_span32(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	neon_convert(dst, src, n, flags, lut, ENCODE_BPP_XRGB8888);
+}
+
+static void neon_dither(uint8_t *dst, const uint16_t *src, uint8_t *residual, unsigned int n)
+{
+	unsigned int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t res = vld1q_u8(residual + i);
+		uint16x8_t lo = vaddw_u8(vld1q_u16(src + i), vget_low_u8(res));
+		uint16x8_t hi = vaddw_u8(vld1q_u16(src + i + 8), vget_high_u8(res));
+
+		vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, ENCODE_FRAC_BITS), vshrn_n_u16(hi, ENCODE_FRAC_BITS)));
+		vst1q_u8(residual + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+
+	encode_scalar_ops.dither(dst + i, src + i, residual + i, n - i);
+}
+
+static void neon_blend(uint8_t *dst, const uint8_t *src, unsigned int n, unsigned int opacity, bool alpha)
+{
+	const uint8x8_t op = vdup_n_u8(opacity);
+	unsigned int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		uint8x8x4_t s = vld4_u8(src + i * ENCODE_BPP_XRGB8888);
+		uint8x8x4_t d = vld4_u8(dst + i * ENCODE_BPP_XRGB8888);
+		uint8x8_t a = alpha ? neon_div255(vmull_u8(s.val[3], op)) : op;
+		uint8x8_t inv = vmvn_u8(a);
+
+		for (int c = 0; c < ENCODE_BPP_XRGB8888; c++)
+			d.val[c] = neon_div255(vmlal_u8(vmull_u8(s.val[c], a), d.val[c], inv));
+		vst4_u8(dst + i * ENCODE_BPP_XRGB8888, d);
+	}
+
+	encode_scalar_ops.blend(dst + i * ENCODE_BPP_XRGB8888, src + i * ENCODE_BPP_XRGB8888, n - i, opacity, alpha);
+}
+
+const struct encode_ops encode_neon_ops =
+{
+	.name = "neon",
+	.init = neon_init,
+	.span = neon_span,
+	.span32 = neon_span32,
+	.dither = neon_dither,
+	.blend = neon_blend,
+};
+
+#endif
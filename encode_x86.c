@@ -0,0 +1,467 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "encode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <string.h>
+#include <immintrin.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Pixels converted by one block of three 16 byte vectors. */
+#define BLOCK_PIXELS		16
+
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/**
+ * Shuffle controls of a block for ENCODE_REVERSE | ENCODE_SWAP.
+ * Output vector o is the union of pshufb(input vector i, masks[flags][o][i]).
+ */
+static uint8_t masks[4][3][3][16] __attribute__((aligned(16)));
+
+/**
+ * Shuffle controls for ENCODE_REVERSE | ENCODE_SWAP that turn 4 XRGB8888
+ * pixels into the lower 12 bytes of a vector.
+ */
+static uint8_t masks32[4][16] __attribute__((aligned(16)));
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Computes the shuffle controls of all flag combinations.
+ */
+static void x86_build_masks(void)
+{
+	for (unsigned int flags = 0; flags < 4; flags++)
+	{
+		memset(masks[flags], 0x80, sizeof(masks[flags]));
+
+		for (unsigned int b = 0; b < BLOCK_PIXELS * ENCODE_BPP; b++)
+		{
+			unsigned int pixel = b / ENCODE_BPP, channel = b % ENCODE_BPP;
+			unsigned int src;
+
+			if (flags & ENCODE_REVERSE)
+				pixel = BLOCK_PIXELS - 1 - pixel;
+			if (flags & ENCODE_SWAP)
+				channel = 2 - channel;
+
+			src = pixel * ENCODE_BPP + channel;
+			masks[flags][b / 16][src / 16][b % 16] = src % 16;
+		}
+
+		memset(masks32[flags], 0x80, sizeof(masks32[flags]));
+
+		for (unsigned int b = 0; b < 4 * ENCODE_BPP; b++)
+		{
+			unsigned int pixel = b / ENCODE_BPP, channel = b % ENCODE_BPP;
+
+			if (flags & ENCODE_REVERSE)
+				pixel = 3 - pixel;
+			if (flags & ENCODE_SWAP)
+				channel = 2 - channel;
+
+			masks32[flags][b] = pixel * ENCODE_BPP_XRGB8888 + channel;
+		}
+	}
+}
+
+/**
+ * Returns the first byte of the block starting at wire pixel i.
+ */
+static inline const uint8_t *x86_block_src(const uint8_t *src, unsigned int i,
+	unsigned int flags, unsigned int bpp)
+{
+	if (flags & ENCODE_REVERSE)
+		return src - (i + BLOCK_PIXELS - 1) * bpp;
+	return src + i * bpp;
+}
+
+/**
+ * Reorders the 48 bytes of a block of 16 pixels.
+ */
+__attribute__((target("ssse3")))
+static inline void ssse3_block(uint8_t *dst, const uint8_t *src, const uint8_t m[3][3][16])
+{
+	__m128i in[3];
+
+	for (int i = 0; i < 3; i++)
+		in[i] = _mm_loadu_si128((const __m128i*)(src + i * 16));
+
+	for (int o = 0; o < 3; o++)
+	{
+		__m128i out = _mm_shuffle_epi8(in[0], _mm_load_si128((const __m128i*)m[o][0]));
+		out = _mm_or_si128(out, _mm_shuffle_epi8(in[1], _mm_load_si128((const __m128i*)m[o][1])));
+		out = _mm_or_si128(out, _mm_shuffle_epi8(in[2], _mm_load_si128((const __m128i*)m[o][2])));
+		_mm_storeu_si128((__m128i*)(dst + o * 16), out);
+	}
+}
+
+/**
+ * Reorders two blocks of 16 pixels at once, one per 128 bit lane.
+ */
+__attribute__((target("avx2")))
+static inline void avx2_block2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+	const uint8_t m[3][3][16])
+{
+	__m256i in[3];
+
+	for (int i = 0; i < 3; i++)
+		in[i] = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src0 + i * 16))),
+			_mm_loadu_si128((const __m128i*)(src1 + i * 16)), 1);
+
+	for (int o = 0; o < 3; o++)
+	{
+		__m256i out = _mm256_shuffle_epi8(in[0], _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)m[o][0])));
+		out = _mm256_or_si256(out, _mm256_shuffle_epi8(in[1], _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)m[o][1]))));
+		out = _mm256_or_si256(out, _mm256_shuffle_epi8(in[2], _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)m[o][2]))));
+		_mm_storeu_si128((__m128i*)(dst + o * 16), _mm256_castsi256_si128(out));
+		_mm_storeu_si128((__m128i*)(dst + BLOCK_PIXELS * ENCODE_BPP + o * 16), _mm256_extracti128_si256(out, 1));
+	}
+}
+
+/**
+ * Converts a block of 16 XRGB8888 pixels. Every vector of 4 pixels is
+ * shuffled into 12 bytes and the pieces are merged into three vectors.
+ */
+__attribute__((target("ssse3")))
+static inline void ssse3_block32(uint8_t *dst, const uint8_t *src, unsigned int flags)
+{
+	const __m128i m = _mm_load_si128((const __m128i*)masks32[flags & 3]);
+	__m128i v[4];
+
+	for (int i = 0; i < 4; i++)
+	{
+		int q = (flags & ENCODE_REVERSE) ? 3 - i : i;
+		v[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + q * 16)), m);
+	}
+
+	_mm_storeu_si128((__m128i*)(dst + 0), _mm_or_si128(v[0], _mm_slli_si128(v[1], 12)));
+	_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_srli_si128(v[1], 4), _mm_slli_si128(v[2], 8)));
+	_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_srli_si128(v[2], 8), _mm_slli_si128(v[3], 4)));
+}
+
+/**
+ * Converts two blocks of 16 XRGB8888 pixels at once, one per 128 bit lane.
+ */
+__attribute__((target("avx2")))
+static inline void avx2_block32x2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+	unsigned int flags)
+{
+	const __m256i m = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)masks32[flags & 3]));
+	__m256i v[4], out;
+
+	for (int i = 0; i < 4; i++)
+	{
+		int q = (flags & ENCODE_REVERSE) ? 3 - i : i;
+		v[i] = _mm256_shuffle_epi8(_mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src0 + q * 16))),
+			_mm_loadu_si128((const __m128i*)(src1 + q * 16)), 1), m);
+	}
+
+	out = _mm256_or_si256(v[0], _mm256_slli_si256(v[1], 12));
+	_mm_storeu_si128((__m128i*)(dst + 0), _mm256_castsi256_si128(out));
+	_mm_storeu_si128((__m128i*)(dst + BLOCK_PIXELS * ENCODE_BPP + 0), _mm256_extracti128_si256(out, 1));
+	out = _mm256_or_si256(_mm256_srli_si256(v[1], 4), _mm256_slli_si256(v[2], 8));
+	_mm_storeu_si128((__m128i*)(dst + 16), _mm256_castsi256_si128(out));
+	_mm_storeu_si128((__m128i*)(dst + BLOCK_PIXELS * ENCODE_BPP + 16), _mm256_extracti128_si256(out, 1));
+	out = _mm256_or_si256(_mm256_srli_si256(v[2], 8), _mm256_slli_si256(v[3], 4));
+	_mm_storeu_si128((__m128i*)(dst + 32), _mm256_castsi256_si128(out));
+	_mm_storeu_si128((__m128i*)(dst + BLOCK_PIXELS * ENCODE_BPP + 32), _mm256_extracti128_si256(out, 1));
+}
+
+/**
+ * Divides 16 bit products of two bytes by 255, rounded.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_div255(__m128i v)
+{
+	v = _mm_add_epi16(v, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_div255(__m256i v)
+{
+	v = _mm256_add_epi16(v, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  ssse3 kernel
+// ----------------------------------------------------------------------------------
+
+static bool ssse3_init(void)
+{
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("ssse3"))
+		return false;
+
+	x86_build_masks();
+	return true;
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_span(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	unsigned int i = 0;
+
+	// there is no byte table lookup on x86 that beats scalar loads,
+	// the plain copy needs no shuffling at all
+	if ((flags & ENCODE_LUT) || !(flags & (ENCODE_REVERSE | ENCODE_SWAP)))
+	{
+		encode_scalar_ops.span(dst, src, n, flags, lut);
+		return;
+	}
+
+	for (; i + BLOCK_PIXELS <= n; i += BLOCK_PIXELS)
+		ssse3_block(dst + i * ENCODE_BPP, x86_block_src(src, i, flags, ENCODE_BPP), masks[flags & 3]);
+
+	if (i < n)
+		encode_scalar_ops.span(dst + i * ENCODE_BPP, (flags & ENCODE_REVERSE) ?
+			src - i * ENCODE_BPP : src + i * ENCODE_BPP, n - i, flags, lut);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_span32(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	unsigned int i = 0;
+
+	if (flags & ENCODE_LUT)
+	{
+		encode_scalar_ops.span32(dst, src, n, flags, lut);
+		return;
+	}
+
+	for (; i + BLOCK_PIXELS <= n; i += BLOCK_PIXELS)
+		ssse3_block32(dst + i * ENCODE_BPP, x86_block_src(src, i, flags, ENCODE_BPP_XRGB8888), flags);
+
+	if (i < n)
+		encode_scalar_ops.span32(dst + i * ENCODE_BPP, (flags & ENCODE_REVERSE) ?
+			src - i * ENCODE_BPP_XRGB8888 : src + i * ENCODE_BPP_XRGB8888, n - i, flags, lut);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_dither(uint8_t *dst, const uint16_t *src, uint8_t *residual, unsigned int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i frac = _mm_set1_epi16((1 << ENCODE_FRAC_BITS) - 1);
+	unsigned int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i res = _mm_loadu_si128((const __m128i*)(residual + i));
+		__m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(src + i)), _mm_unpacklo_epi8(res, zero));
+		__m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(src + i + 8)), _mm_unpackhi_epi8(res, zero));
+
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(
+			_mm_srli_epi16(lo, ENCODE_FRAC_BITS), _mm_srli_epi16(hi, ENCODE_FRAC_BITS)));
+		_mm_storeu_si128((__m128i*)(residual + i), _mm_packus_epi16(
+			_mm_and_si128(lo, frac), _mm_and_si128(hi, frac)));
+	}
+
+	encode_scalar_ops.dither(dst + i, src + i, residual + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_blend(uint8_t *dst, const uint8_t *src, unsigned int n, unsigned int opacity, bool alpha)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i op = _mm_set1_epi16(opacity);
+
+	// spread the alpha of the two pixels of a half over their channels
+	const __m128i alpha_lo = _mm_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+	const __m128i alpha_hi = _mm_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1);
+	unsigned int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i * ENCODE_BPP_XRGB8888));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i * ENCODE_BPP_XRGB8888));
+		__m128i a_lo = op, a_hi = op;
+
+		if (alpha)
+		{
+			a_lo = ssse3_div255(_mm_mullo_epi16(_mm_shuffle_epi8(s, alpha_lo), op));
+			a_hi = ssse3_div255(_mm_mullo_epi16(_mm_shuffle_epi8(s, alpha_hi), op));
+		}
+
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, a_lo)));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, a_hi)));
+
+		_mm_storeu_si128((__m128i*)(dst + i * ENCODE_BPP_XRGB8888),
+			_mm_packus_epi16(ssse3_div255(lo), ssse3_div255(hi)));
+	}
+
+	encode_scalar_ops.blend(dst + i * ENCODE_BPP_XRGB8888, src + i * ENCODE_BPP_XRGB8888, n - i, opacity, alpha);
+}
+
+const struct encode_ops encode_ssse3_ops =
+{
+	.name = "ssse3",
+	.init = ssse3_init,
+	.span = ssse3_span,
+	.span32 = ssse3_span32,
+	.dither = ssse3_dither,
+	.blend = ssse3_blend,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  avx2 kernel
+// ----------------------------------------------------------------------------------
+
+static bool avx2_init(void)
+{
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2"))
+		return false;
+
+	x86_build_masks();
+	return true;
+}
+
+__attribute__((target("avx2")))
+static void avx2_span(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	unsigned int i = 0;
+
+	if ((flags & ENCODE_LUT) || !(flags & (ENCODE_REVERSE | ENCODE_SWAP)))
+	{
+		encode_scalar_ops.span(dst, src, n, flags, lut);
+		return;
+	}
+
+	for (; i + 2 * BLOCK_PIXELS <= n; i += 2 * BLOCK_PIXELS)
+		avx2_block2(dst + i * ENCODE_BPP, x86_block_src(src, i, flags, ENCODE_BPP),
+			x86_block_src(src, i + BLOCK_PIXELS, flags, ENCODE_BPP), masks[flags & 3]);
+
+	ssse3_span(dst + i * ENCODE_BPP, (flags & ENCODE_REVERSE) ?
+		src - i * ENCODE_BPP : src + i * ENCODE_BPP, n - i, flags, lut);
+}
+
+__attribute__((target("avx2")))
+static void avx2_span32(uint8_t *dst, const uint8_t *src, unsigned int n,
+	unsigned int flags, const uint8_t *const lut[3])
+{
+	unsigned int i = 0;
+
+	if (flags & ENCODE_LUT)
+	{
+		encode_scalar_ops.span32(dst, src, n, flags, lut);
+		return;
+	}
+
+	for (; i + 2 * BLOCK_PIXELS <= n; i += 2 * BLOCK_PIXELS)
+		avx2_block32x2(dst + i * ENCODE_BPP, x86_block_src(src, i, flags, ENCODE_BPP_XRGB8888),
+			x86_block_src(src, i + BLOCK_PIXELS, flags, ENCODE_BPP_XRGB8888), flags);
+
+	ssse3_span32(dst + i * ENCODE_BPP, (flags & ENCODE_REVERSE) ?
+		src - i * ENCODE_BPP_XRGB8888 : src + i * ENCODE_BPP_XRGB8888, n - i, flags, lut);
+}
+
+__attribute__((target("avx2")))
+static void avx2_dither(uint8_t *dst, const uint16_t *src, uint8_t *residual, unsigned int n)
+{
+	const __m256i frac = _mm256_set1_epi16((1 << ENCODE_FRAC_BITS) - 1);
+	unsigned int i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i lo = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(src + i)),
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(residual + i))));
+		__m256i hi = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(src + i + 16)),
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(residual + i + 16))));
+
+		// packing works per lane, the permute restores the order
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_srli_epi16(lo, ENCODE_FRAC_BITS), _mm256_srli_epi16(hi, ENCODE_FRAC_BITS)), 0xD8));
+		_mm256_storeu_si256((__m256i*)(residual + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_and_si256(lo, frac), _mm256_and_si256(hi, frac)), 0xD8));
+	}
+
+	ssse3_dither(dst + i, src + i, residual + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_blend(uint8_t *dst, const uint8_t *src, unsigned int n, unsigned int opacity, bool alpha)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i full = _mm256_set1_epi16(255);
+	const __m256i op = _mm256_set1_epi16(opacity);
+
+	// unpacking and shuffling work per lane, so do the masks
+	const __m256i alpha_lo = _mm256_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1,
+		3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+	const __m256i alpha_hi = _mm256_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1,
+		11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1);
+	unsigned int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i * ENCODE_BPP_XRGB8888));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * ENCODE_BPP_XRGB8888));
+		__m256i a_lo = op, a_hi = op;
+
+		if (alpha)
+		{
+			a_lo = avx2_div255(_mm256_mullo_epi16(_mm256_shuffle_epi8(s, alpha_lo), op));
+			a_hi = avx2_div255(_mm256_mullo_epi16(_mm256_shuffle_epi8(s, alpha_hi), op));
+		}
+
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), a_lo),
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, a_lo)));
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), a_hi),
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, a_hi)));
+
+		_mm256_storeu_si256((__m256i*)(dst + i * ENCODE_BPP_XRGB8888),
+			_mm256_packus_epi16(avx2_div255(lo), avx2_div255(hi)));
+	}
+
+	ssse3_blend(dst + i * ENCODE_BPP_XRGB8888, src + i * ENCODE_BPP_XRGB8888, n - i, opacity, alpha);
+}
+
+const struct encode_ops encode_avx2_ops =
+{
+	.name = "avx2",
+	.init = avx2_init,
+	.span = avx2_span,
+	.span32 = avx2_span32,
+	.dither = avx2_dither,
+	.blend = avx2_blend,
+};
+
+#endif
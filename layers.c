@@ -0,0 +1,510 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fb.h>
+
+#include "layers.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Visible spans of a line at most, every opaque layer splits one. */
+#define LAYERS_SPANS		(LAYERS_MAX + 1)
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Expands packed 24bpp pixels to XRGB8888.
+ */
+static void layers_expand(uint8_t *dst, const uint8_t *src, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++, dst += ENCODE_BPP_XRGB8888, src += ENCODE_BPP)
+	{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = 0xFF;
+	}
+}
+
+/**
+ * Cuts what the opaque layers from index first on hide out of the
+ * pixels x0 ... x1 - 1 of a line.
+ * @return number of visible spans, each given by its first and end pixel
+ */
+static unsigned int layers_visible(const struct layers *l, unsigned int first, uint32_t y,
+	uint32_t x0, uint32_t x1, uint32_t spans[LAYERS_SPANS][2])
+{
+	unsigned int count = 1;
+
+	spans[0][0] = x0;
+	spans[0][1] = x1;
+
+	for (unsigned int i = first; i < l->count && count > 0; i++)
+	{
+		const struct layer *layer = &l->layers[i];
+		uint32_t hide0 = layer->x, hide1 = layer->x + layer->width;
+		uint32_t kept[LAYERS_SPANS][2];
+		unsigned int n = 0;
+
+		if (!layer->opaque || !layer->ready || y < layer->y || y >= layer->y + layer->height)
+			continue;
+
+		for (unsigned int s = 0; s < count; s++)
+		{
+			if (spans[s][1] <= hide0 || spans[s][0] >= hide1)
+			{
+				kept[n][0] = spans[s][0];
+				kept[n++][1] = spans[s][1];
+				continue;
+			}
+
+			if (spans[s][0] < hide0)
+			{
+				kept[n][0] = spans[s][0];
+				kept[n++][1] = hide0;
+			}
+			if (spans[s][1] > hide1)
+			{
+				kept[n][0] = hide1;
+				kept[n++][1] = spans[s][1];
+			}
+		}
+
+		memcpy(spans, kept, n * sizeof(kept[0]));
+		count = n;
+	}
+
+	return count;
+}
+
+/**
+ * Skips whitespace and comments of a PPM header.
+ */
+static void ppm_skip(FILE *file)
+{
+	int c;
+
+	while ((c = fgetc(file)) != EOF)
+	{
+		if (c == '#')
+		{
+			while ((c = fgetc(file)) != EOF && c != '\n')
+				;
+		}
+		else if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+		{
+			ungetc(c, file);
+			return;
+		}
+	}
+}
+
+/**
+ * Loads a binary PPM image with 8 bits per channel.
+ */
+static int layers_load_image(struct layer *layer)
+{
+	FILE *file = fopen(layer->source, "rb");
+	unsigned int width = 0, height = 0, maxval = 0;
+	uint8_t *line = NULL;
+	int ret = -1;
+
+	if (file == NULL)
+	{
+		perror(layer->source);
+		return -1;
+	}
+
+	if (fgetc(file) != 'P' || fgetc(file) != '6')
+		goto err;
+	ppm_skip(file);
+	if (fscanf(file, "%u", &width) != 1)
+		goto err;
+	ppm_skip(file);
+	if (fscanf(file, "%u", &height) != 1)
+		goto err;
+	ppm_skip(file);
+	if (fscanf(file, "%u", &maxval) != 1 || maxval != 255 || fgetc(file) == EOF)
+		goto err;
+	if (width == 0 || height == 0 || width > 65535 || height > 65535)
+		goto err;
+
+	layer->pixels = malloc((size_t)width * height * ENCODE_BPP_XRGB8888);
+	line = malloc((size_t)width * ENCODE_BPP);
+	if (layer->pixels == NULL || line == NULL)
+		goto err;
+
+	// the image is stored R, G, B, the frames B, G, R like the framebuffer
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint8_t *dst = layer->pixels + (size_t)y * width * ENCODE_BPP_XRGB8888;
+
+		if (fread(line, ENCODE_BPP, width, file) != width)
+			goto err;
+		for (unsigned int x = 0; x < width; x++, dst += ENCODE_BPP_XRGB8888)
+		{
+			dst[0] = line[x * ENCODE_BPP + 2];
+			dst[1] = line[x * ENCODE_BPP + 1];
+			dst[2] = line[x * ENCODE_BPP];
+			dst[3] = 0xFF;
+		}
+	}
+
+	layer->width = width;
+	layer->height = height;
+	layer->pitch = width * ENCODE_BPP_XRGB8888;
+	layer->ready = true;
+	ret = 0;
+
+err:
+	if (ret < 0)
+		printf("layers: %s is no binary 8 bit PPM image\n", layer->source);
+	free(line);
+	fclose(file);
+	return ret;
+}
+
+/**
+ * Maps a framebuffer of B, G, R byte order.
+ */
+static int layers_open_fb(struct layer *layer)
+{
+	struct fb_var_screeninfo vinfo;
+	struct fb_fix_screeninfo finfo;
+
+	layer->fd = open(layer->source, O_RDONLY);
+	if (layer->fd < 0)
+	{
+		perror(layer->source);
+		return -1;
+	}
+
+	if (ioctl(layer->fd, FBIOGET_VSCREENINFO, &vinfo) < 0 ||
+		ioctl(layer->fd, FBIOGET_FSCREENINFO, &finfo) < 0)
+	{
+		perror("FBIOGET_SCREENINFO");
+		return -1;
+	}
+
+	if ((vinfo.bits_per_pixel != 24 && vinfo.bits_per_pixel != 32) ||
+		vinfo.blue.offset != 0 || vinfo.green.offset != 8 || vinfo.red.offset != 16)
+	{
+		printf("layers: %s is neither 24 nor 32bpp B, G, R\n", layer->source);
+		return -1;
+	}
+
+	layer->bpp = vinfo.bits_per_pixel / 8;
+	layer->line_length = finfo.line_length;
+	layer->yres = vinfo.yres;
+	layer->width = vinfo.xres;
+	layer->height = vinfo.yres;
+	if (layer->alpha && layer->bpp != ENCODE_BPP_XRGB8888)
+	{
+		printf("layers: %s has no alpha channel\n", layer->source);
+		return -1;
+	}
+
+	layer->map_size = finfo.smem_len;
+	layer->map = mmap(NULL, layer->map_size, PROT_READ, MAP_SHARED, layer->fd, 0);
+	if (layer->map == MAP_FAILED)
+	{
+		layer->map = NULL;
+		perror("mmap");
+		return -1;
+	}
+
+	layer->ready = true;
+	return 0;
+}
+
+/**
+ * Parses the description of a layer and opens its source.
+ */
+static int layers_open_layer(struct layers *l, struct layer *layer, const char *spec)
+{
+	const char *at = strrchr(spec, '@');
+	uint32_t size_w = 0, size_h = 0;
+	double opacity = 1.0;
+	char *end, *opts = NULL, *opt, *save = NULL;
+	int ret = -1;
+
+	layer->source = at ? strndup(spec, at - spec) : strdup(spec);
+	if (layer->source == NULL)
+		return -1;
+
+	// position and options after the last @
+	if (at != NULL)
+	{
+		opts = strdup(at + 1);
+		if (opts == NULL)
+			return -1;
+
+		layer->x = strtoul(opts, &end, 10);
+		if (*end != ',')
+			goto invalid;
+		layer->y = strtoul(end + 1, &end, 10);
+		if (*end != '\0' && *end != ',')
+			goto invalid;
+
+		for (opt = strtok_r(end, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save))
+		{
+			if (strncmp(opt, "size=", 5) == 0)
+			{
+				size_w = strtoul(opt + 5, &end, 10);
+				if (*end != 'x')
+					goto invalid;
+				size_h = strtoul(end + 1, &end, 10);
+				if (*end != '\0' || size_w == 0 || size_h == 0)
+					goto invalid;
+			}
+			else if (strncmp(opt, "opacity=", 8) == 0)
+			{
+				opacity = strtod(opt + 8, &end);
+				if (*end != '\0' || opacity < 0 || opacity > 1)
+					goto invalid;
+			}
+			else if (strcmp(opt, "alpha") == 0)
+				layer->alpha = true;
+			else
+				goto invalid;
+		}
+	}
+
+	if (layer->x >= l->width || layer->y >= l->height)
+	{
+		printf("layers: %s lies outside of the frame\n", layer->source);
+		goto err;
+	}
+	layer->opacity = (unsigned int)(opacity * 255 + 0.5);
+
+	// rings span the rest of the frame unless sized, the other sources
+	// have a size of their own
+	if (strncmp(layer->source, "shm:", 4) == 0)
+	{
+		layer->type = LAYER_SHM;
+		layer->width = size_w ? size_w : l->width - layer->x;
+		layer->height = size_h ? size_h : l->height - layer->y;
+		if (ledshm_serve(&layer->shm, layer->source + 4, layer->width, layer->height, LEDSHM_SLOTS) < 0)
+			goto err;
+		layer->pixels = calloc((size_t)layer->width * layer->height, ENCODE_BPP_XRGB8888);
+		if (layer->pixels == NULL)
+			goto err;
+		layer->pitch = layer->width * ENCODE_BPP_XRGB8888;
+	}
+	else if (strlen(layer->source) > 4 && strcmp(layer->source + strlen(layer->source) - 4, ".ppm") == 0)
+	{
+		layer->type = LAYER_IMAGE;
+		if (layer->alpha)
+		{
+			printf("layers: %s has no alpha channel\n", layer->source);
+			goto err;
+		}
+		if (layers_load_image(layer) < 0)
+			goto err;
+	}
+	else
+	{
+		layer->type = LAYER_FB;
+		if (layers_open_fb(layer) < 0)
+			goto err;
+		if (layer->bpp == ENCODE_BPP)
+		{
+			layer->pixels = malloc((size_t)layer->width * layer->height * ENCODE_BPP_XRGB8888);
+			if (layer->pixels == NULL)
+				goto err;
+			layer->pitch = layer->width * ENCODE_BPP_XRGB8888;
+		}
+	}
+
+	// a size crops the source, the frame crops everything
+	if (size_w && size_w < layer->width)
+		layer->width = size_w;
+	if (size_h && size_h < layer->height)
+		layer->height = size_h;
+	if (layer->width > l->width - layer->x)
+		layer->width = l->width - layer->x;
+	if (layer->height > l->height - layer->y)
+		layer->height = l->height - layer->y;
+	layer->opaque = !layer->alpha && layer->opacity == 255;
+
+	ret = 0;
+	goto err;
+
+invalid:
+	printf("layers: invalid layer: %s\n", spec);
+err:
+	free(opts);
+	return ret;
+}
+
+/**
+ * Returns the latest pixels of a layer and the bytes per line, NULL if
+ * there is nothing to draw.
+ */
+static const uint8_t *layers_update(struct layer *layer, size_t *stride)
+{
+	*stride = layer->pitch;
+
+	if (layer->type == LAYER_SHM)
+	{
+		// the ring is read whenever a frame was published meanwhile,
+		// a frame still overwritten is taken next time
+		if (ledshm_wait(&layer->shm, 0) > 0 && ledshm_read(&layer->shm, layer->pixels) == 0)
+			layer->ready = true;
+	}
+	else if (layer->type == LAYER_FB)
+	{
+		struct fb_var_screeninfo cur;
+		const uint8_t *front = layer->map;
+
+		// framebuffers are sampled on the page they are panned to
+		if (ioctl(layer->fd, FBIOGET_VSCREENINFO, &cur) == 0 &&
+			(size_t)(cur.yoffset + layer->yres) * layer->line_length <= layer->map_size)
+			front += (size_t)cur.yoffset * layer->line_length;
+
+		if (layer->bpp == ENCODE_BPP_XRGB8888)
+		{
+			*stride = layer->line_length;
+			return front;
+		}
+
+		for (uint32_t y = 0; y < layer->height; y++)
+			layers_expand(layer->pixels + y * *stride, front + (size_t)y * layer->line_length, layer->width);
+	}
+
+	return layer->ready ? layer->pixels : NULL;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+int layers_open(struct layers *l, char *const *specs, unsigned int count,
+	uint32_t width, uint32_t height, const struct encode_ops *ops)
+{
+	memset(l, 0, sizeof(struct layers));
+	l->width = width;
+	l->height = height;
+	l->ops = ops;
+
+	if (count > LAYERS_MAX)
+	{
+		printf("layers: at most %d layers\n", LAYERS_MAX);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		struct layer *layer = &l->layers[l->count++];
+
+		layer->fd = -1;
+		layer->shm = (struct ledshm_server)LEDSHM_SERVER_INIT;
+		if (layers_open_layer(l, layer, specs[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void layers_base(const struct layers *l, uint8_t *dst, const uint8_t *src,
+	unsigned int bpp, uint32_t line_length)
+{
+	size_t stride = (size_t)l->width * ENCODE_BPP_XRGB8888;
+	uint32_t spans[LAYERS_SPANS][2];
+
+	for (uint32_t y = 0; y < l->height; y++, dst += stride, src += line_length)
+	{
+		unsigned int count = layers_visible(l, 0, y, 0, l->width, spans);
+
+		for (unsigned int s = 0; s < count; s++)
+		{
+			if (bpp == ENCODE_BPP_XRGB8888)
+				memcpy(dst + spans[s][0] * ENCODE_BPP_XRGB8888, src + spans[s][0] * ENCODE_BPP_XRGB8888,
+					(spans[s][1] - spans[s][0]) * ENCODE_BPP_XRGB8888);
+			else
+				layers_expand(dst + spans[s][0] * ENCODE_BPP_XRGB8888, src + spans[s][0] * ENCODE_BPP,
+					spans[s][1] - spans[s][0]);
+		}
+	}
+}
+
+void layers_draw(struct layers *l, uint8_t *dst)
+{
+	size_t stride = (size_t)l->width * ENCODE_BPP_XRGB8888;
+	uint32_t spans[LAYERS_SPANS][2];
+
+	for (unsigned int i = 0; i < l->count; i++)
+	{
+		struct layer *layer = &l->layers[i];
+		size_t src_stride;
+		const uint8_t *src = layers_update(layer, &src_stride);
+
+		if (src == NULL || layer->opacity == 0)
+			continue;
+
+		// only what the opaque layers above leave visible is drawn
+		for (uint32_t row = 0; row < layer->height; row++)
+		{
+			uint32_t y = layer->y + row;
+			unsigned int count = layers_visible(l, i + 1, y, layer->x, layer->x + layer->width, spans);
+
+			for (unsigned int s = 0; s < count; s++)
+			{
+				uint8_t *d = dst + y * stride + spans[s][0] * ENCODE_BPP_XRGB8888;
+				const uint8_t *p = src + row * src_stride + (spans[s][0] - layer->x) * ENCODE_BPP_XRGB8888;
+				unsigned int n = spans[s][1] - spans[s][0];
+
+				if (layer->opaque)
+					memcpy(d, p, n * ENCODE_BPP_XRGB8888);
+				else
+					l->ops->blend(d, p, n, layer->opacity, layer->alpha);
+			}
+		}
+	}
+}
+
+void layers_close(struct layers *l)
+{
+	for (unsigned int i = 0; i < l->count; i++)
+	{
+		struct layer *layer = &l->layers[i];
+
+		ledshm_shutdown(&layer->shm);
+		if (layer->map != NULL)
+			munmap(layer->map, layer->map_size);
+		if (layer->fd > -1)
+			close(layer->fd);
+		free(layer->pixels);
+		free(layer->source);
+	}
+
+	l->count = 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LAYERS_H_
+#define _LAYERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "encode.h"
+#include "ledshm.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Layers drawn over the framebuffer at most. */
+#define LAYERS_MAX			8
+
+/** Sources of a layer. */
+#define LAYER_FB			0
+#define LAYER_SHM			1
+#define LAYER_IMAGE			2
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * A source drawn over the framebuffer.
+ */
+struct layer
+{
+	/** LAYER_*, the source as given on the command line. */
+	int type;
+	char *source;
+
+	/** Position on the wall and size in pixels, clipped to the wall. */
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+
+	/** Opacity 0 ... 255, the fourth byte of a source pixel is its alpha. */
+	unsigned int opacity;
+	bool alpha;
+
+	/** Hides everything below, no alpha and full opacity. */
+	bool opaque;
+
+	/** Something to draw, a ring stays hidden until its first frame. */
+	bool ready;
+
+	/** Framebuffer of the layer, its mapping and format. */
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	uint32_t line_length;
+	uint32_t bpp;
+	uint32_t yres;
+
+	/** Ring of the layer. */
+	struct ledshm_server shm;
+
+	/**
+	 * XRGB8888 pixels of an image, a ring or a 24bpp framebuffer and
+	 * their bytes per line, the width of the source before cropping.
+	 */
+	uint8_t *pixels;
+	uint32_t pitch;
+};
+
+/**
+ * All layers in z-order, the first one is drawn right above the
+ * framebuffer. Frames are composed as XRGB8888.
+ */
+struct layers
+{
+	struct layer layers[LAYERS_MAX];
+	unsigned int count;
+
+	/** Size of a frame in pixels, width * ENCODE_BPP_XRGB8888 bytes per line. */
+	uint32_t width;
+	uint32_t height;
+
+	/** Kernel blending the translucent layers. */
+	const struct encode_ops *ops;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Opens the sources of all layers. A layer is given as
+ * source[@x,y][,size=WxH][,opacity=0..1][,alpha], the source is a
+ * framebuffer device, shm:socket for a ring of frames or a binary PPM image.
+ * @param l layers to initialize
+ * @param specs layer descriptions, bottom first
+ * @param count number of layers, at most LAYERS_MAX
+ * @param width width of a frame in pixels
+ * @param height height of a frame in pixels
+ * @param ops kernel to blend with
+ * @return 0 on success, -1 on error
+ */
+int layers_open(struct layers *l, char *const *specs, unsigned int count,
+	uint32_t width, uint32_t height, const struct encode_ops *ops);
+
+/**
+ * Copies the framebuffer into a frame, except for what the opaque layers hide.
+ * @param l layers
+ * @param dst frame
+ * @param src front page of the framebuffer
+ * @param bpp bytes per pixel of the framebuffer, ENCODE_BPP or ENCODE_BPP_XRGB8888
+ * @param line_length bytes per line of the framebuffer
+ */
+void layers_base(const struct layers *l, uint8_t *dst, const uint8_t *src,
+	unsigned int bpp, uint32_t line_length);
+
+/**
+ * Takes the latest content of every layer and draws the layers over a frame.
+ * @param l layers
+ * @param dst frame
+ */
+void layers_draw(struct layers *l, uint8_t *dst);
+
+/**
+ * Closes all sources. Safe to call on a zeroed struct.
+ * @param l layers
+ */
+void layers_close(struct layers *l);
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Maximum length of a line in the layout file. */
+#define LAYOUT_LINE_SIZE	256
+
+/** Geometry of the panels if nothing else is specified. */
+#define PANEL_SIZE_X		128
+#define PANEL_SIZE_Y		32
+#define CHUNK_SIZE_X		64
+#define CHUNK_SIZE_Y		8
+
+/** Geometry of the panels if nothing else is specified. */
+static const struct layout_panel default_panel =
+{
+	.width = PANEL_SIZE_X,
+	.height = PANEL_SIZE_Y,
+	.chunk_width = CHUNK_SIZE_X,
+	.chunk_height = CHUNK_SIZE_Y,
+	.chunk_order = LAYOUT_ORDER_COLUMNS,
+};
+
+/** All mac adresses of the default wall, stacked vertically. */
+static const uint8_t default_addrs[][6] =
+{
+	{0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD0},
+	{0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD1},
+	{0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD2},
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+static struct layout_panel *layout_add_panel(struct layout *layout, const struct layout_panel *defaults)
+{
+	struct layout_panel *panels;
+
+	panels = realloc(layout->panels, (layout->panel_count + 1) * sizeof(struct layout_panel));
+	if (panels == NULL)
+		return NULL;
+
+	layout->panels = panels;
+	panels[layout->panel_count] = *defaults;
+
+	return &panels[layout->panel_count++];
+}
+
+/**
+ * Parses the options following the position of a panel.
+ */
+static int layout_parse_panel_options(struct layout_panel *panel, char *options)
+{
+	char *save = NULL;
+
+	for (char *tok = strtok_r(options, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save))
+	{
+		if (strcmp(tok, "rotate") == 0)
+		{
+			tok = strtok_r(NULL, " \t\r\n", &save);
+			if (tok == NULL)
+				return -1;
+			panel->rotate = atoi(tok);
+			if (panel->rotate != 0 && panel->rotate != 90 && panel->rotate != 180 && panel->rotate != 270)
+				return -1;
+		}
+		else if (strcmp(tok, "mirror-x") == 0)
+			panel->mirror_x = true;
+		else if (strcmp(tok, "mirror-y") == 0)
+			panel->mirror_y = true;
+		else if (strcmp(tok, "serpentine") == 0)
+			panel->serpentine = true;
+		else if (strcmp(tok, "swap-rb") == 0)
+			panel->swap_rb = true;
+		else if (strcmp(tok, "multi-chunk") == 0)
+			panel->multi_chunk = true;
+		else if (strcmp(tok, "port") == 0)
+		{
+			tok = strtok_r(NULL, " \t\r\n", &save);
+			if (tok == NULL || atoi(tok) < 0)
+				return -1;
+			panel->port = atoi(tok);
+		}
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parses the layout file. Syntax, one statement per line, '#' starts a comment:
+ *   panel-size <width> <height>
+ *   chunk-size <width> <height>
+ *   chunk-order columns|rows
+ *   panel <mac> <x> <y> [rotate <deg>] [mirror-x] [mirror-y] [serpentine] [swap-rb] [multi-chunk] [port <n>]
+ * The geometry statements apply to all panels following them.
+ */
+static int layout_parse(struct layout *layout, const char *path, struct layout_panel *defaults)
+{
+	char line[LAYOUT_LINE_SIZE];
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		struct layout_panel *panel;
+		unsigned int mac[6];
+		char order[16];
+		int a, b, n = 0;
+		char *comment;
+
+		lineno++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		// skip empty lines
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (sscanf(line, " panel-size %d %d", &a, &b) == 2 && a > 0 && b > 0)
+		{
+			defaults->width = a;
+			defaults->height = b;
+		}
+		else if (sscanf(line, " chunk-size %d %d", &a, &b) == 2 && a > 0 && b > 0)
+		{
+			defaults->chunk_width = a;
+			defaults->chunk_height = b;
+		}
+		else if (sscanf(line, " chunk-order %15s", order) == 1 &&
+			(strcmp(order, "columns") == 0 || strcmp(order, "rows") == 0))
+		{
+			defaults->chunk_order = (strcmp(order, "rows") == 0) ? LAYOUT_ORDER_ROWS : LAYOUT_ORDER_COLUMNS;
+		}
+		else if (sscanf(line, " panel %x:%x:%x:%x:%x:%x %d %d %n",
+			&mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &a, &b, &n) == 8 && n > 0)
+		{
+			panel = layout_add_panel(layout, defaults);
+			if (panel == NULL)
+			{
+				fclose(f);
+				return -1;
+			}
+
+			for (int i = 0; i < 6; i++)
+				panel->mac[i] = (uint8_t)mac[i];
+			panel->x = a;
+			panel->y = b;
+
+			if (layout_parse_panel_options(panel, line + n) < 0)
+			{
+				printf("%s:%d: invalid panel option\n", path, lineno);
+				fclose(f);
+				return -1;
+			}
+		}
+		else
+		{
+			printf("%s:%d: syntax error\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Maps a pixel of a panel to its position on the wall.
+ * @param panel the panel
+ * @param u horizontal position on the panel, as sent on the wire
+ * @param v vertical position on the panel, as sent on the wire
+ * @param x returns the horizontal position in the framebuffer
+ * @param y returns the vertical position in the framebuffer
+ */
+static void layout_map_pixel(const struct layout_panel *panel, int u, int v, int *x, int *y)
+{
+	int w = panel->width;
+	int h = panel->height;
+
+	if (panel->mirror_x)
+		u = w - 1 - u;
+	if (panel->mirror_y)
+		v = h - 1 - v;
+
+	switch (panel->rotate)
+	{
+		case 90:
+			*x = h - 1 - v;
+			*y = u;
+			break;
+		case 180:
+			*x = w - 1 - u;
+			*y = h - 1 - v;
+			break;
+		case 270:
+			*x = v;
+			*y = w - 1 - u;
+			break;
+		default:
+			*x = u;
+			*y = v;
+			break;
+	}
+
+	*x += panel->x;
+	*y += panel->y;
+}
+
+/**
+ * Merges the gather table of a chunk into spans of pixels that follow
+ * each other in the framebuffer, either left to right or right to left.
+ * @return the number of spans written
+ */
+static unsigned int layout_build_spans(struct layout_span *spans, const uint32_t *gather,
+	unsigned int pixels, uint32_t bpp)
+{
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < pixels; i += spans[count++].pixels)
+	{
+		struct layout_span *span = &spans[count];
+		uint32_t step = bpp;
+
+		span->offset = gather[i];
+		span->pixels = 1;
+		span->flags = 0;
+
+		// the direction is given by the second pixel
+		if (i + 1 < pixels && gather[i + 1] == gather[i] - bpp)
+		{
+			span->flags = LAYOUT_SPAN_REVERSE;
+			step = -bpp;
+		}
+
+		while (i + span->pixels < pixels && span->pixels < UINT16_MAX &&
+			gather[i + span->pixels] == gather[i + span->pixels - 1] + step)
+			span->pixels++;
+	}
+
+	return count;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+struct layout *layout_load(const char *path)
+{
+	struct layout_panel defaults = default_panel;
+	struct layout *layout;
+
+	layout = calloc(1, sizeof(struct layout));
+	if (layout == NULL)
+		return NULL;
+
+	if (path != NULL)
+	{
+		if (layout_parse(layout, path, &defaults) < 0)
+			goto err;
+	}
+	else
+	{
+		for (size_t p = 0; p < sizeof(default_addrs) / sizeof(default_addrs[0]); p++)
+		{
+			struct layout_panel *panel = layout_add_panel(layout, &defaults);
+			if (panel == NULL)
+				goto err;
+
+			memcpy(panel->mac, default_addrs[p], 6);
+			panel->y = p * PANEL_SIZE_Y;
+		}
+	}
+
+	if (layout->panel_count == 0)
+	{
+		printf("layout: no panels defined\n");
+		goto err;
+	}
+
+	return layout;
+
+err:
+	layout_free(layout);
+	return NULL;
+}
+
+struct layout *layout_grid(unsigned int cols, unsigned int rows, bool multi_chunk)
+{
+	struct layout *layout;
+
+	// the last two bytes of the mac address are the row and the column
+	if (cols == 0 || rows == 0 || cols > UINT8_MAX + 1 || rows > UINT8_MAX + 1)
+	{
+		printf("layout: invalid grid %ux%u\n", cols, rows);
+		return NULL;
+	}
+
+	layout = calloc(1, sizeof(struct layout));
+	if (layout == NULL)
+		return NULL;
+
+	for (unsigned int y = 0; y < rows; y++)
+	{
+		for (unsigned int x = 0; x < cols; x++)
+		{
+			struct layout_panel *panel = layout_add_panel(layout, &default_panel);
+			if (panel == NULL)
+			{
+				layout_free(layout);
+				return NULL;
+			}
+
+			memcpy(panel->mac, default_addrs[0], 4);
+			panel->mac[4] = (uint8_t)y;
+			panel->mac[5] = (uint8_t)x;
+			panel->x = x * PANEL_SIZE_X;
+			panel->y = y * PANEL_SIZE_Y;
+			panel->multi_chunk = multi_chunk;
+		}
+	}
+
+	return layout;
+}
+
+void layout_size(const struct layout *layout, uint32_t *xres, uint32_t *yres)
+{
+	*xres = 0;
+	*yres = 0;
+
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		const struct layout_panel *panel = &layout->panels[p];
+		bool turned = (panel->rotate == 90 || panel->rotate == 270);
+		uint32_t w = turned ? panel->height : panel->width;
+		uint32_t h = turned ? panel->width : panel->height;
+
+		if (panel->x + w > *xres)
+			*xres = panel->x + w;
+		if (panel->y + h > *yres)
+			*yres = panel->y + h;
+	}
+}
+
+int layout_compile(struct layout *layout, uint32_t xres, uint32_t yres,
+	uint32_t line_length, uint32_t bpp, bool flip_x, bool flip_y)
+{
+	unsigned int chunk_count = 0, gather_count = 0;
+	struct layout_chunk *chunk;
+	uint32_t *gather;
+
+	// size the tables
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		const struct layout_panel *panel = &layout->panels[p];
+
+		if (panel->width % panel->chunk_width || panel->height % panel->chunk_height)
+		{
+			printf("layout: panel %u is not a multiple of its chunk size\n", p);
+			return -1;
+		}
+		if ((panel->width / panel->chunk_width) * (panel->height / panel->chunk_height) > LAYOUT_MAX_PANEL_CHUNKS)
+		{
+			printf("layout: panel %u has more than %d chunks\n", p, LAYOUT_MAX_PANEL_CHUNKS);
+			return -1;
+		}
+
+		chunk_count += (panel->width / panel->chunk_width) * (panel->height / panel->chunk_height);
+		gather_count += panel->width * panel->height;
+	}
+
+	free(layout->chunks);
+	free(layout->gather);
+	free(layout->spans);
+	layout->chunks = calloc(chunk_count, sizeof(struct layout_chunk));
+	layout->gather = malloc(gather_count * sizeof(uint32_t));
+	layout->spans = malloc(gather_count * sizeof(struct layout_span));
+	layout->chunk_count = chunk_count;
+	layout->gather_count = gather_count;
+	layout->span_count = 0;
+	if (layout->chunks == NULL || layout->gather == NULL || layout->spans == NULL)
+		return -1;
+
+	chunk = layout->chunks;
+	gather = layout->gather;
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		const struct layout_panel *panel = &layout->panels[p];
+		int cols = panel->width / panel->chunk_width;
+		int rows = panel->height / panel->chunk_height;
+
+		for (int id = 0; id < cols * rows; id++, chunk++)
+		{
+			int col = (panel->chunk_order == LAYOUT_ORDER_ROWS) ? id % cols : id / rows;
+			int row = (panel->chunk_order == LAYOUT_ORDER_ROWS) ? id / cols : id % rows;
+			uint32_t x1 = UINT32_MAX, y1 = UINT32_MAX, x2 = 0, y2 = 0;
+
+			chunk->panel = p;
+			chunk->id = id;
+			chunk->pixels = panel->chunk_width * panel->chunk_height;
+			chunk->gather = gather - layout->gather;
+
+			// resolve every pixel in wire order
+			for (int cy = 0; cy < panel->chunk_height; cy++)
+			{
+				for (int cx = 0; cx < panel->chunk_width; cx++)
+				{
+					int u = col * panel->chunk_width;
+					int v = row * panel->chunk_height + cy;
+					int x, y;
+
+					u += (panel->serpentine && (cy & 1)) ? panel->chunk_width - 1 - cx : cx;
+					layout_map_pixel(panel, u, v, &x, &y);
+
+					if (x < 0 || y < 0 || (uint32_t)x >= xres || (uint32_t)y >= yres)
+					{
+						printf("layout: panel %u lies outside of the %ux%u framebuffer\n", p, xres, yres);
+						return -1;
+					}
+
+					if (flip_x)
+						x = xres - x - 1;
+					if (flip_y)
+						y = yres - y - 1;
+
+					*gather++ = (uint32_t)y * line_length + (uint32_t)x * bpp;
+
+					x1 = ((uint32_t)x < x1) ? (uint32_t)x : x1;
+					y1 = ((uint32_t)y < y1) ? (uint32_t)y : y1;
+					x2 = ((uint32_t)x > x2) ? (uint32_t)x : x2;
+					y2 = ((uint32_t)y > y2) ? (uint32_t)y : y2;
+				}
+			}
+
+			chunk->x = x1;
+			chunk->y = y1;
+			chunk->width = x2 - x1 + 1;
+			chunk->height = y2 - y1 + 1;
+
+			chunk->span = layout->span_count;
+			chunk->span_count = layout_build_spans(layout->spans + chunk->span,
+				layout->gather + chunk->gather, chunk->pixels, bpp);
+			layout->span_count += chunk->span_count;
+		}
+	}
+
+	return 0;
+}
+
+void layout_free(struct layout *layout)
+{
+	if (layout == NULL)
+		return;
+
+	free(layout->panels);
+	free(layout->chunks);
+	free(layout->gather);
+	free(layout->spans);
+	free(layout);
+}
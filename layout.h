@@ -0,0 +1,193 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Numbering of the chunks of a panel. */
+#define LAYOUT_ORDER_COLUMNS	0
+#define LAYOUT_ORDER_ROWS		1
+
+/** Chunks of a panel at most, the chunk id is a single byte on the wire. */
+#define LAYOUT_MAX_PANEL_CHUNKS	256
+
+/** The pixels of a span are read right to left. */
+#define LAYOUT_SPAN_REVERSE		0x01
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * A single led panel of the wall.
+ */
+struct layout_panel
+{
+	/** Mac address of the panel. */
+	uint8_t mac[6];
+
+	/** Position of the top left corner in the framebuffer. */
+	int x;
+	int y;
+
+	/** Native panel size in pixels, before rotation. */
+	int width;
+	int height;
+
+	/** Size of a chunk in pixels and the numbering of the chunks. */
+	int chunk_width;
+	int chunk_height;
+	int chunk_order;
+
+	/** Clockwise rotation in degrees (0, 90, 180 or 270). */
+	int rotate;
+
+	/** Mirroring, applied before the rotation. */
+	bool mirror_x;
+	bool mirror_y;
+
+	/** Odd lines of a chunk are wired right to left. */
+	bool serpentine;
+
+	/** The panel expects red first instead of the framebuffer byte order. */
+	bool swap_rb;
+
+	/** The firmware accepts several chunks per packet. */
+	bool multi_chunk;
+
+	/** Interface the panel is connected to, an index into the interface list. */
+	unsigned int port;
+};
+
+/**
+ * A run of pixels of a chunk lying next to each other in the
+ * framebuffer, so they can be converted as a whole.
+ */
+struct layout_span
+{
+	/** Source byte offset of the first pixel in wire order. */
+	uint32_t offset;
+
+	/** Number of pixels and LAYOUT_SPAN_* flags. */
+	uint16_t pixels;
+	uint16_t flags;
+};
+
+/**
+ * A chunk of a panel, sent as one packet.
+ */
+struct layout_chunk
+{
+	/** Index of the panel and number of the chunk on the wire. */
+	unsigned int panel;
+	unsigned int id;
+
+	/** Number of pixels and their first entry in the gather table. */
+	unsigned int pixels;
+	unsigned int gather;
+
+	/** Number of spans and the first one in the span table. */
+	unsigned int span_count;
+	unsigned int span;
+
+	/** Bounding box of the source pixels in the framebuffer. */
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/**
+ * Panel layout of a wall. Compiling it for a framebuffer geometry
+ * resolves every pixel of every chunk into a source byte offset.
+ */
+struct layout
+{
+	unsigned int panel_count;
+	struct layout_panel *panels;
+
+	unsigned int chunk_count;
+	struct layout_chunk *chunks;
+
+	/** Source byte offset of every pixel of every chunk. */
+	uint32_t *gather;
+	unsigned int gather_count;
+
+	/** The gather table merged into runs of adjacent pixels. */
+	struct layout_span *spans;
+	unsigned int span_count;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Reads the panels of a wall from a layout file.
+ * @param path layout file, NULL for the built-in default wall
+ * @return the layout or NULL on error
+ */
+struct layout *layout_load(const char *path);
+
+/**
+ * Builds a wall of equal panels with the default geometry, for benchmarks.
+ * @param cols number of panels side by side, at most 256
+ * @param rows number of panels on top of each other, at most 256
+ * @param multi_chunk the panels accept several chunks per packet
+ * @return the layout or NULL on error
+ */
+struct layout *layout_grid(unsigned int cols, unsigned int rows, bool multi_chunk);
+
+/**
+ * Returns the size of the smallest framebuffer holding all panels.
+ * @param layout layout of the wall
+ * @param xres returns the width in pixels
+ * @param yres returns the height in pixels
+ */
+void layout_size(const struct layout *layout, uint32_t *xres, uint32_t *yres);
+
+/**
+ * Resolves all chunks of the layout into the gather and span tables.
+ * @param layout layout to compile
+ * @param xres visible width of the framebuffer
+ * @param yres visible height of the framebuffer
+ * @param line_length length of a framebuffer line in bytes
+ * @param bpp bytes per framebuffer pixel
+ * @param flip_x mirror the whole wall horizontally
+ * @param flip_y mirror the whole wall vertically
+ * @return 0 on success, -1 if a panel lies outside of the framebuffer
+ */
+int layout_compile(struct layout *layout, uint32_t xres, uint32_t yres,
+	uint32_t line_length, uint32_t bpp, bool flip_x, bool flip_y);
+
+/**
+ * Releases all memory of a layout.
+ * @param layout layout to free, may be NULL
+ */
+void layout_free(struct layout *layout);
+
+#endif
@@ -20,23 +20,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <linux/fb.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/mman.h>
-#include <net/if.h>
-#include <arpa/inet.h>
-#include <netinet/ether.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/time.h>
-#include <sys/socket.h>
-#include <linux/if_packet.h>
-#include <math.h>
-#include <malloc.h>
+#include <getopt.h>
 #include <stdlib.h>
 
+#include "tx.h"
+
 // ----------------------------------------------------------------------------------
 //  constants
 // ----------------------------------------------------------------------------------
@@ -44,18 +37,6 @@
 /** Frame cycle time in milliseconds. */
 #define FRAME_CYCLE_TIME	25
 
-/** Maximum packet size in bytes. */
-#define PACKET_SIZE			2000
-
-/** Ethertype of the packet. */
-#define PACKET_ETHERTYPE	0x0801
-
-/** LED matrix panel dimensions. */
-#define PANEL_SIZE_X		128
-#define PANEL_SIZE_Y		32
-#define PANEL_BPP			3
-#define PANEL_CHUNKS		8
-
 /** All mac adresses of the led panels. */
 static uint8_t panel_addrs[][6] = 
 {
@@ -65,11 +46,14 @@ static uint8_t panel_addrs[][6] =
 /** Definition of the panel matrix. */
 #define PANEL_COUNT			(sizeof(panel_addrs) / sizeof(panel_addrs[0]))
 
-/** Pixel protocol opcodes. */
-#define PP_OP_STORE_FRAME	0x29
-
-/** Gamma correction value. */
-#define GAMMA               1.5
+// ----------------------------------------------------------------------------------
+//  options
+// ----------------------------------------------------------------------------------
+static struct option long_options[] =
+{
+        {"tx", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+};
 
 // ----------------------------------------------------------------------------------
 //  local variables
@@ -78,9 +62,6 @@ static uint8_t panel_addrs[][6] =
 /** The user requested the application to shutdown. */
 static int closereq = 0;
 
-/** The buffer containing the ethernet frame to send. */
-static uint8_t packet_buffer[PACKET_SIZE];
-
 
 // ----------------------------------------------------------------------------------
 //  local helper functions
@@ -94,39 +75,6 @@ static uint64_t clock_us(void)
 	return (time.tv_sec * 1000 * 1000) + time.tv_usec;
 }
 
-static int eth_prepare_packet(struct sockaddr *source_hwaddr)
-{
-	struct ether_header *eh = (struct ether_header *)packet_buffer;
-
-	// ethernet header
-	eh->ether_shost[0] = ((uint8_t*)&source_hwaddr->sa_data)[0];
-	eh->ether_shost[1] = ((uint8_t*)&source_hwaddr->sa_data)[1];
-	eh->ether_shost[2] = ((uint8_t*)&source_hwaddr->sa_data)[2];
-	eh->ether_shost[3] = ((uint8_t*)&source_hwaddr->sa_data)[3];
-	eh->ether_shost[4] = ((uint8_t*)&source_hwaddr->sa_data)[4];
-	eh->ether_shost[5] = ((uint8_t*)&source_hwaddr->sa_data)[5];
-	eh->ether_type = htons(PACKET_ETHERTYPE);
-
-	return sizeof(struct ether_header);
-}
-
-static int eth_send_packet(int fd, uint8_t dst[6], int ifindex, int len)
-{
-	struct ether_header *eh = (struct ether_header *)packet_buffer;
-	struct sockaddr_ll addr;
-
-	// set the destination mac address
-	memcpy(eh->ether_dhost, dst, 6);
-
-	// prepare the socketaddr
-	addr.sll_ifindex = ifindex;
-	addr.sll_halen = ETH_ALEN;
-	memcpy(addr.sll_addr, dst, 6);
-
-	return sendto(fd, packet_buffer, len, 0,
-		(struct sockaddr*)&addr, sizeof(struct sockaddr_ll));
-}
-
 
 // ----------------------------------------------------------------------------------
 //  signal handlers
@@ -145,78 +93,76 @@ static void sigint_handler(int signal)
 
 int main(int argc, char *argv[])
 {
-	int sock = -1;
-	int ifindex, mtu, payload_offset, errorcode = -1;
-	struct ifreq iface;
-	struct sockaddr hwaddr;
-	struct sigaction signal_handler;
+	const struct tx_ops *tx_ops = &tx_mmsg_ops;
+	struct tx tx = {0};
+	int ch, errorcode = -1;
+	tx.fd = -1;
 
-	// make sure all cmd args are present
-	if (argc < 3)
-	{
-		printf("usage: ./ledctrl iface opcode <....>\n");
-		goto err;
-	}
-
-	// Open RAW socket to send on
-	if ((sock = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
-	    perror("socket");
-	    goto err;
-	}
+    // loop over all of the options
+    while ((ch = getopt_long(argc, argv, "t:", long_options, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 't':
+                tx_ops = tx_find(optarg);
+                if (tx_ops == NULL)
+                {
+                    printf("unknown tx backend: %s\n", optarg);
+                    goto err;
+                }
+                break;
+        }
+    }
 
-	// Get the index of the interface to send on
-	memset(&iface, 0, sizeof(struct ifreq));
-	strncpy(iface.ifr_name, argv[1], IFNAMSIZ - 1);
-	if (ioctl(sock, SIOCGIFINDEX, &iface) < 0)
+	// make sure all cmd args are present
+	if (argc - optind < 2)
 	{
-		perror("SIOCGIFINDEX");
+		printf("usage: ./ledctrl [-t sendto|mmsg|ring|uring|veth|pcap|unix|null] iface opcode <....>\n");
 		goto err;
 	}
-	ifindex = iface.ifr_ifindex;
 
-	// Get the MAC address of the interface to send on
-	if (ioctl(sock, SIOCGIFHWADDR, &iface) < 0)
-	{
-		perror("SIOCGIFHWADDR");
+	// the payload has to fit into a single packet
+	if (tx_open(&tx, tx_ops, argv[optind], PANEL_COUNT) < 0)
 		goto err;
-	}
-	hwaddr = iface.ifr_hwaddr;
-
-	// get the mtu of the sending interface
-	if (ioctl(sock, SIOCGIFMTU, &iface) < 0)
+	if ((size_t)(argc - optind - 1) > tx.payload_size)
 	{
-		perror("SIOCGIFMTU");
+		printf("payload exceeds the mtu of %d bytes\n", tx.mtu);
 		goto err;
 	}
-	mtu = iface.ifr_mtu;
-
-	// setup the ethernet packet
-	payload_offset = eth_prepare_packet(&hwaddr);
-	uint8_t *packet = packet_buffer + payload_offset;
 
-    for (int p = 0; p < PANEL_COUNT; p++)
+    for (unsigned int p = 0; p < PANEL_COUNT; p++)
     {
+        uint8_t *packet = tx_packet(&tx, panel_addrs[p]);
         int packet_pos = 0;
-        
-        // opcode and chunk
-        packet[packet_pos++] = strtol(argv[2], NULL, 16);;
-        
-        for (int i = 0; i < argc - 3; i++)
-            packet[packet_pos++] = strtol(argv[3 + i], NULL, 16);
 
-        int sz = payload_offset + packet_pos;
-        if (eth_send_packet(sock, panel_addrs[p], ifindex, sz) < 0)
+        if (packet == NULL)
         {
-            perror("sendto");
+            printf("no transmit buffer for panel %u\n", p);
+            goto err;
         }
-}
+
+        // opcode and chunk
+        packet[packet_pos++] = strtol(argv[optind + 1], NULL, 16);
+        
+        for (int i = 0; i < argc - optind - 2; i++)
+            packet[packet_pos++] = strtol(argv[optind + 2 + i], NULL, 16);
+
+        tx_commit(&tx, packet_pos);
+    }
+
+    if (tx_flush(&tx) > 0)
+    {
+        for (unsigned int p = 0; p < PANEL_COUNT; p++)
+            if (tx.status[p] < 0)
+                printf("send: %s\n", strerror(-tx.status[p]));
+        goto err;
+    }
 
 	errorcode = 0;
 
 	// free all allocated ressources
 err:
-	if (sock > -1)
-		close(sock);
+	tx_close(&tx);
 
 	return errorcode;
 }
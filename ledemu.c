@@ -0,0 +1,894 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "compose.h"
+#include "layout.h"
+#include "tx.h"
+#include "utils.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Seconds between two reports. */
+#define EMU_REPORT_INTERVAL	1
+
+/** Silence in microseconds after which the next packet of a panel starts a new frame. */
+#define EMU_FRAME_GAP		2000
+
+/** Number of packets received with one recvmmsg() call. */
+#define EMU_BATCH			64
+
+/** Largest packet the emulator accepts. */
+#define EMU_PACKET_SIZE		(ETH_HLEN + TX_MAX_MTU)
+
+/** Receive buffer of the sockets, holds the packets of several frames. */
+#define EMU_RCVBUF			(8 * 1024 * 1024)
+
+/** Magic numbers of pcap files with micro and nanosecond timestamps. */
+#define EMU_PCAP_MAGIC_US	0xa1b2c3d4
+#define EMU_PCAP_MAGIC_NS	0xa1b23c4d
+
+/** Where the packets come from. */
+#define EMU_SOURCE_RAW		0
+#define EMU_SOURCE_UNIX		1
+#define EMU_SOURCE_PCAP		2
+#define EMU_SOURCE_COUNT	3
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Reception statistics of an emulated panel. A frame is a burst of
+ * packets to the panel without a gap of more than the frame gap.
+ */
+struct emu_panel
+{
+	/** Packets and chunks received. */
+	uint64_t packets;
+	uint64_t chunks;
+
+	/** Frames seen and finished frames in which every chunk arrived. */
+	uint64_t frames;
+	uint64_t complete;
+
+	/** Chunks missing from a frame and chunks arriving after a later one. */
+	uint64_t lost;
+	uint64_t reordered;
+
+	/** Packets or chunks which could not be decoded. */
+	uint64_t malformed;
+
+	/** Smoothed variation of the frame interval in microseconds, RFC 3550. */
+	double jitter;
+
+	/** A frame is being received, its first and the last packet arrived at. */
+	bool in_frame;
+	uint64_t frame_start;
+	uint64_t last_packet;
+
+	/** Time between the starts of the last two frames. */
+	uint64_t interval;
+
+	/** Last chunk and number of distinct chunks of the current frame. */
+	int last_chunk;
+	unsigned int received;
+
+	/** Counters at the previous report. */
+	uint64_t report_frames;
+	uint64_t report_packets;
+};
+
+/**
+ * The emulated wall.
+ */
+struct emu
+{
+	struct layout *layout;
+
+	/** First chunk of every panel, panel_count + 1 entries. */
+	unsigned int *panel_chunks;
+
+	/** Frame number a chunk was last received in, per chunk of the layout. */
+	uint64_t *seen;
+
+	/** Statistics of every panel. */
+	struct emu_panel *panels;
+
+	/** Panel the last packet was addressed to. */
+	unsigned int last_panel;
+
+	/** Reconstructed wall in the 24bpp framebuffer format. */
+	uint8_t *surface;
+	size_t surface_size;
+	uint32_t xres;
+	uint32_t yres;
+
+	/** Packets to addresses of no panel of the layout. */
+	uint64_t foreign;
+
+	/** Silence starting a new frame in microseconds. */
+	uint64_t frame_gap;
+};
+
+/**
+ * Buffers of a recvmmsg() batch.
+ */
+struct emu_rx
+{
+	uint8_t buffers[EMU_BATCH][EMU_PACKET_SIZE];
+	uint8_t control[EMU_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct sockaddr_ll addrs[EMU_BATCH];
+	struct iovec iovs[EMU_BATCH];
+	struct mmsghdr msgs[EMU_BATCH];
+};
+
+
+// ----------------------------------------------------------------------------------
+//  options
+// ----------------------------------------------------------------------------------
+static struct option long_options[] =
+{
+        {"flip-x", optional_argument, NULL, 'x'},
+        {"flip-y", optional_argument, NULL, 'y'},
+        {"layout", required_argument, NULL, 'l'},
+        {"grid", required_argument, NULL, 'g'},
+        {"source", required_argument, NULL, 't'},
+        {"shm", required_argument, NULL, 's'},
+        {"ppm", required_argument, NULL, 'p'},
+        {"report", required_argument, NULL, 'r'},
+        {"gap", required_argument, NULL, 'G'},
+        {NULL, 0, NULL, 0}
+};
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/** The user requested the application to shutdown. */
+static volatile sig_atomic_t closereq = 0;
+
+/** Names of the packet sources as selected on the command line. */
+static const char *source_names[EMU_SOURCE_COUNT] = { "raw", "unix", "pcap" };
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+static uint64_t realtime_us(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_REALTIME, &time);
+
+	return (uint64_t)time.tv_sec * 1000 * 1000 + time.tv_nsec / 1000;
+}
+
+/**
+ * Finishes the current frame of a panel and accounts its missing chunks.
+ */
+static void emu_frame_end(struct emu *emu, unsigned int p)
+{
+	struct emu_panel *panel = &emu->panels[p];
+	unsigned int chunks = emu->panel_chunks[p + 1] - emu->panel_chunks[p];
+
+	if (!panel->in_frame)
+		return;
+
+	panel->lost += chunks - panel->received;
+	if (panel->received == chunks)
+		panel->complete++;
+	panel->in_frame = false;
+}
+
+/**
+ * Accounts a packet to a panel, the first one after a gap starts a new frame.
+ */
+static void emu_frame_packet(struct emu *emu, unsigned int p, uint64_t now)
+{
+	struct emu_panel *panel = &emu->panels[p];
+
+	panel->packets++;
+
+	if (!panel->in_frame || now - panel->last_packet > emu->frame_gap)
+	{
+		emu_frame_end(emu, p);
+
+		// jitter of the frame starts, as for rtp packets
+		if (panel->frames > 0)
+		{
+			uint64_t interval = now - panel->frame_start;
+
+			if (panel->frames > 1)
+			{
+				double d = (double)interval - (double)panel->interval;
+				panel->jitter += ((d < 0 ? -d : d) - panel->jitter) / 16;
+			}
+			panel->interval = interval;
+		}
+
+		panel->in_frame = true;
+		panel->frame_start = now;
+		panel->frames++;
+		panel->last_chunk = -1;
+		panel->received = 0;
+	}
+
+	panel->last_packet = now;
+}
+
+/**
+ * Stores the pixels of a chunk at their place on the wall.
+ */
+static void emu_chunk(struct emu *emu, unsigned int p, unsigned int id,
+	const uint8_t *pixels, unsigned int count)
+{
+	struct emu_panel *panel = &emu->panels[p];
+	const struct layout_chunk *chunk;
+	const uint32_t *gather;
+	unsigned int i = emu->panel_chunks[p] + id;
+
+	if (i >= emu->panel_chunks[p + 1] || count != emu->layout->chunks[i].pixels)
+	{
+		panel->malformed++;
+		return;
+	}
+	chunk = &emu->layout->chunks[i];
+	gather = emu->layout->gather + chunk->gather;
+
+	panel->chunks++;
+	if ((int)id <= panel->last_chunk)
+		panel->reordered++;
+	panel->last_chunk = (int)id;
+
+	if (emu->seen[i] != panel->frames)
+	{
+		emu->seen[i] = panel->frames;
+		panel->received++;
+	}
+
+	// the wire is in framebuffer byte order unless the panel swaps red and blue
+	if (emu->layout->panels[p].swap_rb)
+	{
+		for (unsigned int n = 0; n < count; n++, pixels += PANEL_BPP)
+		{
+			uint8_t *dst = emu->surface + gather[n];
+			dst[0] = pixels[2];
+			dst[1] = pixels[1];
+			dst[2] = pixels[0];
+		}
+	}
+	else
+	{
+		for (unsigned int n = 0; n < count; n++, pixels += PANEL_BPP)
+			memcpy(emu->surface + gather[n], pixels, PANEL_BPP);
+	}
+}
+
+/**
+ * Decodes an ethernet frame addressed to one of the panels.
+ */
+static void emu_packet(struct emu *emu, const uint8_t *data, size_t len, uint64_t now)
+{
+	const struct ether_header *eh = (const struct ether_header *)data;
+	const uint8_t *payload = data + ETH_HLEN;
+	size_t payload_len = len - ETH_HLEN;
+	unsigned int p = emu->last_panel;
+	struct emu_panel *panel;
+
+	if (len < ETH_HLEN + PP_HEADER_SIZE || ntohs(eh->ether_type) != TX_ETHERTYPE)
+		return;
+
+	// consecutive packets mostly go to the same panel
+	if (memcmp(emu->layout->panels[p].mac, eh->ether_dhost, ETH_ALEN) != 0)
+	{
+		for (p = 0; p < emu->layout->panel_count; p++)
+			if (memcmp(emu->layout->panels[p].mac, eh->ether_dhost, ETH_ALEN) == 0)
+				break;
+
+		if (p == emu->layout->panel_count)
+		{
+			emu->foreign++;
+			return;
+		}
+		emu->last_panel = p;
+	}
+	panel = &emu->panels[p];
+
+	emu_frame_packet(emu, p, now);
+
+	switch (payload[0])
+	{
+		case PP_OP_STORE_FRAME:
+			if ((payload_len - PP_HEADER_SIZE) % PANEL_BPP != 0)
+			{
+				panel->malformed++;
+				break;
+			}
+			emu_chunk(emu, p, payload[1], payload + PP_HEADER_SIZE,
+				(payload_len - PP_HEADER_SIZE) / PANEL_BPP);
+			break;
+
+		case PP_OP_STORE_CHUNKS:
+		{
+			size_t pos = PP_MULTI_HEADER_SIZE;
+
+			for (unsigned int c = 0; c < payload[1]; c++)
+			{
+				unsigned int count;
+
+				if (pos + PP_DESC_SIZE > payload_len)
+				{
+					panel->malformed++;
+					break;
+				}
+
+				count = (payload[pos + 1] << 8) | payload[pos + 2];
+				if (pos + PP_DESC_SIZE + (size_t)count * PANEL_BPP > payload_len)
+				{
+					panel->malformed++;
+					break;
+				}
+
+				emu_chunk(emu, p, payload[pos], payload + pos + PP_DESC_SIZE, count);
+				pos += PP_DESC_SIZE + (size_t)count * PANEL_BPP;
+			}
+			break;
+		}
+
+		default:
+			// control commands carry no pixels
+			break;
+	}
+}
+
+/**
+ * Prints the statistics of every panel since the last report.
+ */
+static void emu_report(struct emu *emu, double seconds)
+{
+	printf("%-17s %8s %10s %9s %9s %9s %11s %9s\n", "panel", "fps", "packets/s",
+		"complete", "lost", "reordered", "jitter_us", "malformed");
+
+	for (unsigned int p = 0; p < emu->layout->panel_count; p++)
+	{
+		struct emu_panel *panel = &emu->panels[p];
+		const uint8_t *mac = emu->layout->panels[p].mac;
+		uint64_t finished = panel->frames - (panel->in_frame ? 1 : 0);
+		char addr[18];
+
+		snprintf(addr, sizeof(addr), "%02x:%02x:%02x:%02x:%02x:%02x",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+		printf("%-17s %8.1f %10.1f %8.2f%% %9llu %9llu %11.1f %9llu\n", addr,
+			(panel->frames - panel->report_frames) / seconds,
+			(panel->packets - panel->report_packets) / seconds,
+			finished ? 100.0 * panel->complete / finished : 0.0,
+			(unsigned long long)panel->lost, (unsigned long long)panel->reordered,
+			panel->jitter, (unsigned long long)panel->malformed);
+
+		panel->report_frames = panel->frames;
+		panel->report_packets = panel->packets;
+	}
+
+	if (emu->foreign > 0)
+		printf("packets to unknown panels: %llu\n", (unsigned long long)emu->foreign);
+	fflush(stdout);
+}
+
+/**
+ * Writes the reconstructed wall as binary ppm image.
+ */
+static int emu_dump_ppm(struct emu *emu, const char *path)
+{
+	uint8_t *line;
+	FILE *file;
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	line = malloc(emu->xres * 3);
+	if (line == NULL)
+	{
+		fclose(file);
+		return -1;
+	}
+
+	// the surface is in framebuffer byte order, blue first
+	fprintf(file, "P6\n%u %u\n255\n", emu->xres, emu->yres);
+	for (uint32_t y = 0; y < emu->yres; y++)
+	{
+		const uint8_t *src = emu->surface + (size_t)y * emu->xres * PANEL_BPP;
+
+		for (uint32_t x = 0; x < emu->xres; x++)
+		{
+			line[x * 3 + 0] = src[x * PANEL_BPP + 2];
+			line[x * 3 + 1] = src[x * PANEL_BPP + 1];
+			line[x * 3 + 2] = src[x * PANEL_BPP + 0];
+		}
+		fwrite(line, 3, emu->xres, file);
+	}
+
+	free(line);
+	return fclose(file);
+}
+
+/**
+ * Opens a raw socket receiving the packets of all panels on an interface.
+ */
+static int emu_open_raw(const char *iface)
+{
+	struct sockaddr_ll addr;
+	struct packet_mreq mreq;
+	int fd;
+
+	if ((fd = socket(AF_PACKET, SOCK_RAW, htons(TX_ETHERTYPE))) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(struct sockaddr_ll));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(TX_ETHERTYPE);
+	addr.sll_ifindex = if_nametoindex(iface);
+	if (addr.sll_ifindex == 0 || bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_ll)) < 0)
+	{
+		perror(iface);
+		close(fd);
+		return -1;
+	}
+
+	// the panels have their own addresses, the nic has to pass them up
+	memset(&mreq, 0, sizeof(struct packet_mreq));
+	mreq.mr_ifindex = addr.sll_ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+		perror("PACKET_MR_PROMISC");
+
+	return fd;
+}
+
+/**
+ * Binds the AF_UNIX socket the unix backend of the daemon sends to.
+ */
+static int emu_open_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Receives all pending packets of the socket and decodes them.
+ */
+static void emu_receive(struct emu *emu, struct emu_rx *rx, int fd)
+{
+	int count;
+
+	for (int i = 0; i < EMU_BATCH; i++)
+	{
+		rx->iovs[i].iov_base = rx->buffers[i];
+		rx->iovs[i].iov_len = EMU_PACKET_SIZE;
+		rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+		rx->msgs[i].msg_hdr.msg_iovlen = 1;
+		rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+		rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+		rx->msgs[i].msg_hdr.msg_control = rx->control[i];
+		rx->msgs[i].msg_hdr.msg_controllen = sizeof(rx->control[i]);
+		rx->addrs[i].sll_pkttype = PACKET_HOST;
+	}
+
+	count = recvmmsg(fd, rx->msgs, EMU_BATCH, MSG_DONTWAIT, NULL);
+	if (count < 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			perror("recvmmsg");
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		struct msghdr *hdr = &rx->msgs[i].msg_hdr;
+		uint64_t now = 0;
+
+		// on the sending host the copy leaving the interface is seen as well
+		if (hdr->msg_namelen >= sizeof(struct sockaddr_ll) &&
+			rx->addrs[i].sll_family == AF_PACKET && rx->addrs[i].sll_pkttype == PACKET_OUTGOING)
+			continue;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				struct timespec ts;
+
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				now = (uint64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+			}
+		}
+		if (now == 0)
+			now = realtime_us();
+
+		emu_packet(emu, rx->buffers[i], rx->msgs[i].msg_len, now);
+	}
+}
+
+/**
+ * Decodes all packets of a pcap file, as written by the pcap backend.
+ * @return the time in seconds the capture spans, -1 on error
+ */
+static double emu_read_pcap(struct emu *emu, const char *path, uint8_t *buffer)
+{
+	uint32_t header[6], record[4];
+	uint64_t first = 0, last = 0;
+	bool nsec;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1 ||
+		(header[0] != EMU_PCAP_MAGIC_US && header[0] != EMU_PCAP_MAGIC_NS))
+	{
+		printf("%s: not a pcap file\n", path);
+		fclose(file);
+		return -1;
+	}
+	nsec = (header[0] == EMU_PCAP_MAGIC_NS);
+
+	while (!closereq && fread(record, sizeof(record), 1, file) == 1)
+	{
+		uint64_t now = (uint64_t)record[0] * 1000 * 1000 + (nsec ? record[1] / 1000 : record[1]);
+
+		if (record[2] > EMU_PACKET_SIZE)
+		{
+			fseek(file, record[2], SEEK_CUR);
+			continue;
+		}
+		if (fread(buffer, 1, record[2], file) != record[2])
+			break;
+
+		if (first == 0)
+			first = now;
+		last = now;
+
+		emu_packet(emu, buffer, record[2], now);
+	}
+
+	fclose(file);
+	return (last - first) / 1e6;
+}
+
+/**
+ * Allocates the reconstructed wall, in a named shared memory object
+ * if a name is given.
+ */
+static int emu_surface(struct emu *emu, const char *shm_name)
+{
+	int fd;
+
+	emu->surface_size = (size_t)emu->xres * emu->yres * PANEL_BPP;
+
+	if (shm_name == NULL)
+	{
+		emu->surface = calloc(1, emu->surface_size);
+		return (emu->surface != NULL) ? 0 : -1;
+	}
+
+	fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror(shm_name);
+		return -1;
+	}
+
+	if (ftruncate(fd, emu->surface_size) < 0)
+	{
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	emu->surface = mmap(NULL, emu->surface_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (emu->surface == MAP_FAILED)
+	{
+		emu->surface = NULL;
+		perror("mmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  signal handlers
+// ----------------------------------------------------------------------------------
+
+static void sigint_handler(int signal)
+{
+	closereq = 1;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  entry point
+// ----------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	struct emu emu = { 0 };
+	struct emu_rx *rx = NULL;
+	struct sigaction signal_handler;
+	const char *layout_path = NULL;
+	const char *grid = NULL;
+	const char *shm_name = NULL;
+	const char *ppm_prefix = NULL;
+	unsigned int report_interval = EMU_REPORT_INTERVAL;
+	unsigned int dumps = 0;
+	int source = EMU_SOURCE_RAW;
+	int fd = -1, errorcode = -1;
+	bool flip_x = false;
+	bool flip_y = false;
+	char path[PATH_MAX];
+	int ch;
+
+	emu.frame_gap = EMU_FRAME_GAP;
+
+    // loop over all of the options
+    while ((ch = getopt_long(argc, argv, "xyl:g:t:s:p:r:G:", long_options, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'x':
+                flip_x = true;
+                break;
+            case 'y':
+                flip_y = true;
+                break;
+            case 'l':
+                layout_path = optarg;
+                break;
+            case 'g':
+                grid = optarg;
+                break;
+            case 't':
+                for (source = 0; source < EMU_SOURCE_COUNT && strcmp(optarg, source_names[source]) != 0; source++);
+                if (source == EMU_SOURCE_COUNT)
+                {
+                    printf("unknown packet source: %s\n", optarg);
+                    goto err;
+                }
+                break;
+            case 's':
+                shm_name = optarg;
+                break;
+            case 'p':
+                ppm_prefix = optarg;
+                break;
+            case 'r':
+                report_interval = (unsigned int)atoi(optarg);
+                break;
+            case 'G':
+                emu.frame_gap = strtoull(optarg, NULL, 10);
+                break;
+        }
+    }
+
+    // make sure all cmd args are present
+	if (argv[optind] == NULL || report_interval == 0)
+	{
+		printf("usage: ./ledemu [-l layout | -g colsxrows] [-t raw|unix|pcap] [-s shm_name] [-p ppm_prefix] [-r report_s] [-G gap_us] [-x] [-y] iface|socket|pcap\n");
+		goto err;
+	}
+
+	// the panels to emulate, from the layout file or a grid of default panels
+	if (grid != NULL)
+	{
+		unsigned int cols, rows;
+
+		if (sscanf(grid, "%ux%u", &cols, &rows) != 2)
+		{
+			printf("invalid grid: %s\n", grid);
+			goto err;
+		}
+		emu.layout = layout_grid(cols, rows, false);
+	}
+	else
+	{
+		emu.layout = layout_load(layout_path);
+	}
+	if (emu.layout == NULL)
+		goto err;
+
+	// the wall is reconstructed in the layout of the daemon's framebuffer
+	layout_size(emu.layout, &emu.xres, &emu.yres);
+	if (layout_compile(emu.layout, emu.xres, emu.yres, emu.xres * PANEL_BPP, PANEL_BPP, flip_x, flip_y) < 0)
+		goto err;
+
+	emu.panel_chunks = calloc(emu.layout->panel_count + 1, sizeof(unsigned int));
+	emu.seen = calloc(emu.layout->chunk_count, sizeof(uint64_t));
+	emu.panels = calloc(emu.layout->panel_count, sizeof(struct emu_panel));
+	rx = malloc(sizeof(struct emu_rx));
+	if (!emu.panel_chunks || !emu.seen || !emu.panels || !rx)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	// the chunks of a panel follow each other in the layout
+	for (unsigned int i = 0; i < emu.layout->chunk_count; i++)
+		emu.panel_chunks[emu.layout->chunks[i].panel + 1] = i + 1;
+	for (unsigned int p = 0; p < emu.layout->panel_count; p++)
+		if (emu.panel_chunks[p + 1] < emu.panel_chunks[p])
+			emu.panel_chunks[p + 1] = emu.panel_chunks[p];
+
+	if (emu_surface(&emu, shm_name) < 0)
+		goto err;
+
+	printf("Emulating %u panels, %ux%u pixels, from %s %s\n", emu.layout->panel_count,
+		emu.xres, emu.yres, source_names[source], argv[optind]);
+
+	// setup SIGINT handler to shutdown the application
+	signal_handler.sa_handler = sigint_handler;
+	sigemptyset(&signal_handler.sa_mask);
+	signal_handler.sa_flags = 0;
+	sigaction(SIGINT, &signal_handler, NULL);
+	sigaction(SIGTERM, &signal_handler, NULL);
+
+	if (source == EMU_SOURCE_PCAP)
+	{
+		double seconds = emu_read_pcap(&emu, argv[optind], rx->buffers[0]);
+
+		if (seconds < 0)
+			goto err;
+
+		for (unsigned int p = 0; p < emu.layout->panel_count; p++)
+			emu_frame_end(&emu, p);
+		emu_report(&emu, seconds > 0 ? seconds : 1);
+	}
+	else
+	{
+		int on = 1, rcvbuf = EMU_RCVBUF;
+		uint64_t next_report;
+
+		fd = (source == EMU_SOURCE_RAW) ? emu_open_raw(argv[optind]) : emu_open_unix(argv[optind]);
+		if (fd < 0)
+			goto err;
+
+		// timestamps of the kernel, the batch is only read afterwards
+		if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+			perror("SO_TIMESTAMPNS");
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+			perror("SO_RCVBUF");
+
+		next_report = clock_us() + report_interval * 1000000ULL;
+		while (!closereq)
+		{
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			uint64_t now = clock_us();
+
+			if (now >= next_report)
+			{
+				emu_report(&emu, report_interval);
+				if (ppm_prefix != NULL)
+				{
+					snprintf(path, sizeof(path), "%s%06u.ppm", ppm_prefix, dumps++);
+					emu_dump_ppm(&emu, path);
+				}
+				next_report += report_interval * 1000000ULL;
+				continue;
+			}
+
+			if (poll(&pfd, 1, (int)((next_report - now + 999) / 1000)) > 0)
+				emu_receive(&emu, rx, fd);
+		}
+
+		// the frames in flight are finished by the shutdown
+		for (unsigned int p = 0; p < emu.layout->panel_count; p++)
+			emu_frame_end(&emu, p);
+		emu_report(&emu, (clock_us() + report_interval * 1000000ULL - next_report) / 1e6);
+	}
+
+	if (ppm_prefix != NULL)
+	{
+		snprintf(path, sizeof(path), "%s%06u.ppm", ppm_prefix, dumps);
+		emu_dump_ppm(&emu, path);
+	}
+
+	errorcode = 0;
+
+	// free all allocated ressources
+err:
+	if (fd > -1)
+		close(fd);
+	if (fd > -1 && source == EMU_SOURCE_UNIX)
+		unlink(argv[optind]);
+
+	if (emu.surface != NULL && shm_name != NULL)
+		munmap(emu.surface, emu.surface_size);
+	else
+		free(emu.surface);
+
+	free(rx);
+	free(emu.panel_chunks);
+	free(emu.seen);
+	free(emu.panels);
+	layout_free(emu.layout);
+
+	return errorcode;
+}
@@ -3,6 +3,22 @@
 #include <linux/console.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/file.h>
+#include <linux/capability.h>
+#include <linux/major.h>
+#include <linux/pid.h>
+#include <linux/sched/signal.h>
+
+#include "ledfb.h"
 
 
 // ----------------------------------------------------------------------------------
@@ -10,18 +26,154 @@
 // ----------------------------------------------------------------------------------
 
 #define VIRT_FB_NAME	"ledfb"
-#define VIRT_FB_ID		0
+
+/** Maximum number of framebuffers one module instance creates. */
+#define LEDFB_MAX_DEVICES	8
 
 #define BITS_PER_PIXEL 	24
 
+/** Deepest supported format, the vram is sized for it. */
+#define MAX_BITS_PER_PIXEL	48
+
+/** States of a slot of the presentation queue. */
+#define LEDFB_SLOT_FREE		0
+#define LEDFB_SLOT_DRAWING	1
+#define LEDFB_SLOT_QUEUED	2
+#define LEDFB_SLOT_SHOWN	3
+
+/** Ethertype and opcode of the packets sent by the in-kernel transmitter. */
+#define LEDFB_TX_ETHERTYPE	0x0801
+#define LEDFB_TX_OP_STORE	0x29
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * In-kernel transmitter of a framebuffer, configured by LEDFB_IOCTL_SETTX.
+ */
+struct ledfb_tx
+{
+	struct fb_info *info;
+
+	/** Interface the packets are queued on, a reference is held. */
+	struct net_device *dev;
+
+	/** Thread composing and sending the frames. */
+	struct task_struct *thread;
+
+	/** Periodic refresh of the wall, if period is not 0. */
+	struct hrtimer timer;
+	ktime_t period;
+	bool tick;
+
+	/** Format the tables were compiled for, frames of another one are skipped. */
+	u32 line_length;
+	u32 bytes_per_pixel;
+	u32 page_size;
+
+	/** Tables copied from the configuration. */
+	u32 chunk_count;
+	struct ledfb_tx_chunk *chunks;
+	u32 *gather;
+	u8 *luts;
+
+	/** Packets queued and failed since the transmitter was started. */
+	u64 packets;
+	u64 errors;
+};
+
+/**
+ * Private data of a framebuffer.
+ */
+struct ledfb_par
+{
+	/** Id of the framebuffer. */
+	u32 id;
+
+	/** Protects the flip and dirty state. */
+	spinlock_t lock;
+
+	/** Consumers waiting for page flips or dirty lines. */
+	wait_queue_head_t wait;
+
+	/** Incremented on every page flip. */
+	u32 flip_seq;
+
+	/** Tracks the pages written through userspace mappings. */
+	struct fb_deferred_io defio;
+
+	/** Dirty lines since the last LEDFB_IOCTL_GETDIRTY. */
+	u32 dirty_y1;
+	u32 dirty_y2;
+	u32 dirty_rows[LEDFB_DIRTY_BITS / 32];
+
+	/** State and presentation time of every page of the presentation queue. */
+	u8 slot_state[LEDFB_QUEUE_SLOTS];
+	u64 slot_pts[LEDFB_QUEUE_SLOTS];
+
+	/** Process drawing into a page, a reference is held while it is drawn. */
+	struct pid *slot_owner[LEDFB_QUEUE_SLOTS];
+
+	/** Due frames skipped since the last LEDFB_IOCTL_QTAKE. */
+	u32 queue_dropped;
+
+	/** Running in-kernel transmitter or NULL, protected by tx_lock. */
+	struct ledfb_tx *tx;
+	struct mutex tx_lock;
+
+	/**
+	 * Held while the vram is reallocated and while the transmitter reads
+	 * it. The fb lock cannot be used, ioctls are called with it held.
+	 */
+	struct mutex vram_lock;
+};
+
+
+/**
+ * A pixel format the framebuffer can be switched to.
+ */
+struct ledfb_format
+{
+	u32 bits_per_pixel;
+	struct fb_bitfield red;
+	struct fb_bitfield green;
+	struct fb_bitfield blue;
+};
+
 
 // ----------------------------------------------------------------------------------
 //  local variables
 // ----------------------------------------------------------------------------------
 
-struct fb_info *g_fbi = NULL;
-int xres = 4 * 32;
-int yres = 3 * 32;
+/** Supported formats, the first one is the fallback. */
+static const struct ledfb_format formats[] =
+{
+	// packed RGB888, the native format of the led matrix
+	{ 24, { 16, 8, 0 }, { 8, 8, 0 }, { 0, 8, 0 } },
+	// XRGB8888, the upper byte is unused
+	{ 32, { 16, 8, 0 }, { 8, 8, 0 }, { 0, 8, 0 } },
+	// RGB565
+	{ 16, { 11, 5, 0 }, { 5, 6, 0 }, { 0, 5, 0 } },
+	// 16 bits per channel, dithered down to the panels by ledfbd
+	{ 48, { 32, 16, 0 }, { 16, 16, 0 }, { 0, 16, 0 } },
+};
+
+/** All framebuffers, one per entry of the xres parameter. */
+static struct fb_info *g_fbis[LEDFB_MAX_DEVICES];
+static unsigned int g_fb_count = 0;
+
+/** Per framebuffer parameters, missing entries keep the defaults. */
+int xres[LEDFB_MAX_DEVICES] = { [0 ... LEDFB_MAX_DEVICES - 1] = 4 * 32 };
+int yres[LEDFB_MAX_DEVICES] = { [0 ... LEDFB_MAX_DEVICES - 1] = 3 * 32 };
+int pages[LEDFB_MAX_DEVICES] = { [0 ... LEDFB_MAX_DEVICES - 1] = 2 };
+int bpp[LEDFB_MAX_DEVICES] = { [0 ... LEDFB_MAX_DEVICES - 1] = BITS_PER_PIXEL };
+unsigned int xres_count = 0;
+int defio_delay = 5;
+
+/** Interface the in-kernel transmitter of each framebuffer sends on. */
+char *txdev[LEDFB_MAX_DEVICES];
 
 
 // ----------------------------------------------------------------------------------
@@ -35,8 +187,10 @@ int yres = 3 * 32;
  */
 static int virtfb_map_video_memory(struct fb_info *fbi)
 {   
+	// one page per screen of the virtual resolution, large enough for
+	// every format so switching the depth keeps the mappings valid
 	fbi->screen_size = fbi->var.xres * fbi->var.yres * (fbi->var.bits_per_pixel / 8);
-    fbi->fix.smem_len = fbi->screen_size * 2;   // double the memory for double-buffering
+    fbi->fix.smem_len = PAGE_ALIGN(fbi->var.yres_virtual * fbi->var.xres_virtual * MAX_BITS_PER_PIXEL / 8);
     fbi->fix.smem_start = 0;
 
 	// allocate the virtual memory
@@ -59,14 +213,769 @@ static int virtfb_map_video_memory(struct fb_info *fbi)
  */
 static int virtfb_unmap_video_memory(struct fb_info *fbi)
 {
+	vfree(fbi->screen_base);
 	fbi->screen_base = NULL;
 	fbi->fix.smem_len = 0;
-	vfree(fbi->screen_base);
 
 	return 0;
 }
 
 
+/**
+ * Returns the number of lines covered by one bit of the dirty bitmap.
+ * @param fbi framebuffer information pointer
+ */
+static u32 virtfb_dirty_band(struct fb_info *fbi)
+{
+	return max_t(u32, DIV_ROUND_UP(fbi->var.yres_virtual, LEDFB_DIRTY_BITS), 1);
+}
+
+/**
+ * Marks the lines [y1, y2) as dirty, the caller holds the lock.
+ * @param fbi framebuffer information pointer
+ * @param y1 first dirty line
+ * @param y2 line behind the last dirty line
+ */
+static void virtfb_mark_dirty(struct fb_info *fbi, u32 y1, u32 y2)
+{
+	struct ledfb_par *par = fbi->par;
+	u32 band = virtfb_dirty_band(fbi);
+	u32 b;
+
+	y2 = min(y2, fbi->var.yres_virtual);
+	if (y1 >= y2)
+		return;
+
+	if (par->dirty_y1 == par->dirty_y2)
+	{
+		par->dirty_y1 = y1;
+		par->dirty_y2 = y2;
+	}
+	else
+	{
+		par->dirty_y1 = min(par->dirty_y1, y1);
+		par->dirty_y2 = max(par->dirty_y2, y2);
+	}
+
+	for (b = y1 / band; b <= (y2 - 1) / band && b < LEDFB_DIRTY_BITS; b++)
+		par->dirty_rows[b / 32] |= 1u << (b % 32);
+}
+
+/**
+ * Called by the deferred io worker with all pages written since its last run.
+ * @param info framebuffer information pointer
+ * @param pagelist written pages
+ */
+static void virtfb_deferred_io(struct fb_info *info, struct list_head *pagelist)
+{
+	struct ledfb_par *par = info->par;
+	unsigned long flags;
+	struct page *page;
+
+	spin_lock_irqsave(&par->lock, flags);
+	list_for_each_entry(page, pagelist, lru)
+	{
+		unsigned long offset = page->index << PAGE_SHIFT;
+
+		virtfb_mark_dirty(info, offset / info->fix.line_length,
+			(offset + PAGE_SIZE - 1) / info->fix.line_length + 1);
+	}
+	spin_unlock_irqrestore(&par->lock, flags);
+
+	wake_up_interruptible(&par->wait);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  presentation queue
+// ----------------------------------------------------------------------------------
+
+/**
+ * Returns the number of slots of the presentation queue, one per page.
+ * @param info framebuffer information pointer
+ */
+static u32 virtfb_queue_slots(struct fb_info *info)
+{
+	return min_t(u32, info->var.yres_virtual / info->var.yres, LEDFB_QUEUE_SLOTS);
+}
+
+/**
+ * Finds a slot in the given state, the caller holds the lock.
+ * @param info framebuffer information pointer
+ * @param state LEDFB_SLOT_* state
+ * @return the slot or -1 if there is none
+ */
+static int virtfb_queue_find(struct fb_info *info, u8 state)
+{
+	struct ledfb_par *par = info->par;
+	u32 i;
+
+	for (i = 0; i < virtfb_queue_slots(info); i++)
+		if (par->slot_state[i] == state)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Drops the producer of a slot, the caller holds the lock.
+ * @param par private data of the framebuffer
+ * @param slot slot leaving LEDFB_SLOT_DRAWING
+ */
+static void virtfb_queue_disown(struct ledfb_par *par, u32 slot)
+{
+	put_pid(par->slot_owner[slot]);
+	par->slot_owner[slot] = NULL;
+}
+
+/**
+ * Frees the slots of producers that exited before queueing or cancelling
+ * them, the caller holds the lock.
+ * @param info framebuffer information pointer
+ */
+static void virtfb_queue_reclaim(struct fb_info *info)
+{
+	struct ledfb_par *par = info->par;
+	struct task_struct *task;
+	u32 i;
+
+	rcu_read_lock();
+	for (i = 0; i < virtfb_queue_slots(info); i++)
+	{
+		if (par->slot_state[i] != LEDFB_SLOT_DRAWING)
+			continue;
+
+		// the group leader stays around until the last thread exited
+		task = pid_task(par->slot_owner[i], PIDTYPE_PID);
+		if (task != NULL && !((task->flags & PF_EXITING) && thread_group_empty(task)))
+			continue;
+
+		virtfb_queue_disown(par, i);
+		par->slot_state[i] = LEDFB_SLOT_FREE;
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * Finds the queued slot with the latest presentation time due at the
+ * deadline, the caller holds the lock.
+ * @param info framebuffer information pointer
+ * @param deadline time the frame is shown at
+ * @return the slot or -1 if none is due
+ */
+static int virtfb_queue_due(struct fb_info *info, u64 deadline)
+{
+	struct ledfb_par *par = info->par;
+	int best = -1;
+	u32 i;
+
+	for (i = 0; i < virtfb_queue_slots(info); i++)
+	{
+		if (par->slot_state[i] != LEDFB_SLOT_QUEUED || par->slot_pts[i] > deadline)
+			continue;
+		if (best < 0 || par->slot_pts[i] >= par->slot_pts[best])
+			best = i;
+	}
+
+	return best;
+}
+
+/**
+ * Counts the queued slots, the caller holds the lock.
+ * @param info framebuffer information pointer
+ */
+static u32 virtfb_queue_count(struct fb_info *info)
+{
+	struct ledfb_par *par = info->par;
+	u32 i, count = 0;
+
+	for (i = 0; i < virtfb_queue_slots(info); i++)
+		if (par->slot_state[i] == LEDFB_SLOT_QUEUED)
+			count++;
+
+	return count;
+}
+
+/**
+ * Wait condition of the producers: a slot is free.
+ * @param info framebuffer information pointer
+ */
+static bool virtfb_queue_has_free(struct fb_info *info)
+{
+	struct ledfb_par *par = info->par;
+	bool ret;
+
+	spin_lock_irq(&par->lock);
+	virtfb_queue_reclaim(info);
+	ret = virtfb_queue_find(info, LEDFB_SLOT_FREE) >= 0;
+	spin_unlock_irq(&par->lock);
+
+	return ret;
+}
+
+/**
+ * Wait condition of the consumer: a queued frame is due at the deadline.
+ * @param info framebuffer information pointer
+ * @param deadline time the frame is shown at
+ */
+static bool virtfb_queue_has_due(struct fb_info *info, u64 deadline)
+{
+	struct ledfb_par *par = info->par;
+	bool ret;
+
+	spin_lock_irq(&par->lock);
+	ret = virtfb_queue_due(info, deadline) >= 0;
+	spin_unlock_irq(&par->lock);
+
+	return ret;
+}
+
+/**
+ * Hands a free page to a producer. Pages of producers that exited while
+ * drawing are freed first, waiting producers find them on the next wakeup.
+ * @param info framebuffer information pointer
+ * @param upresent queue state returned to the caller
+ */
+static int virtfb_queue_getbuf(struct fb_info *info, struct ledfb_present __user *upresent)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_present present;
+	long ret;
+	int slot;
+
+	if (copy_from_user(&present, upresent, sizeof(present)))
+		return -EFAULT;
+
+	// ioctls are called with the fb lock held, the consumer
+	// has to get in while the producer waits and vice versa
+	mutex_unlock(&info->lock);
+	ret = wait_event_interruptible_timeout(par->wait,
+		virtfb_queue_has_free(info), msecs_to_jiffies(present.timeout));
+	mutex_lock(&info->lock);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(&par->lock);
+	virtfb_queue_reclaim(info);
+	slot = virtfb_queue_find(info, LEDFB_SLOT_FREE);
+	if (slot >= 0)
+	{
+		par->slot_state[slot] = LEDFB_SLOT_DRAWING;
+		par->slot_owner[slot] = get_pid(task_tgid(current));
+	}
+	present.page = slot;
+	present.yoffset = slot * info->var.yres;
+	present.queued = virtfb_queue_count(info);
+	present.slots = virtfb_queue_slots(info);
+	spin_unlock_irq(&par->lock);
+
+	if (slot < 0)
+		return -EAGAIN;
+
+	if (copy_to_user(upresent, &present, sizeof(present)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Queues a page drawn by a producer.
+ * @param info framebuffer information pointer
+ * @param upresent page and its presentation time
+ */
+static int virtfb_queue_put(struct fb_info *info, struct ledfb_present __user *upresent)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_present present;
+
+	if (copy_from_user(&present, upresent, sizeof(present)))
+		return -EFAULT;
+
+	spin_lock_irq(&par->lock);
+	if (present.page >= virtfb_queue_slots(info) ||
+		par->slot_state[present.page] != LEDFB_SLOT_DRAWING)
+	{
+		spin_unlock_irq(&par->lock);
+		return -EINVAL;
+	}
+	virtfb_queue_disown(par, present.page);
+	par->slot_state[present.page] = LEDFB_SLOT_QUEUED;
+	par->slot_pts[present.page] = present.pts;
+	present.yoffset = present.page * info->var.yres;
+	present.queued = virtfb_queue_count(info);
+	present.slots = virtfb_queue_slots(info);
+	spin_unlock_irq(&par->lock);
+
+	wake_up_interruptible(&par->wait);
+
+	if (copy_to_user(upresent, &present, sizeof(present)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Returns a page to the queue without showing it.
+ * @param info framebuffer information pointer
+ * @param upresent page handed out to the caller
+ */
+static int virtfb_queue_cancel(struct fb_info *info, struct ledfb_present __user *upresent)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_present present;
+
+	if (copy_from_user(&present, upresent, sizeof(present)))
+		return -EFAULT;
+
+	spin_lock_irq(&par->lock);
+	if (present.page >= virtfb_queue_slots(info) ||
+		par->slot_state[present.page] != LEDFB_SLOT_DRAWING ||
+		par->slot_owner[present.page] != task_tgid(current))
+	{
+		spin_unlock_irq(&par->lock);
+		return -EINVAL;
+	}
+	virtfb_queue_disown(par, present.page);
+	par->slot_state[present.page] = LEDFB_SLOT_FREE;
+	spin_unlock_irq(&par->lock);
+
+	wake_up_interruptible(&par->wait);
+
+	return 0;
+}
+
+/**
+ * Hands the page due at the deadline to the consumer.
+ * @param info framebuffer information pointer
+ * @param upresent deadline of the caller and the page to show
+ */
+static int virtfb_queue_take(struct fb_info *info, struct ledfb_present __user *upresent)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_present present;
+	long ret;
+	int slot;
+	u32 i;
+
+	if (copy_from_user(&present, upresent, sizeof(present)))
+		return -EFAULT;
+
+	mutex_unlock(&info->lock);
+	ret = wait_event_interruptible_timeout(par->wait,
+		virtfb_queue_has_due(info, present.pts), msecs_to_jiffies(present.timeout));
+	mutex_lock(&info->lock);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(&par->lock);
+	slot = virtfb_queue_due(info, present.pts);
+	if (slot >= 0)
+	{
+		// the page shown so far and all earlier due ones become free
+		for (i = 0; i < virtfb_queue_slots(info); i++)
+		{
+			if (i == (u32)slot)
+				continue;
+
+			if (par->slot_state[i] == LEDFB_SLOT_SHOWN)
+				par->slot_state[i] = LEDFB_SLOT_FREE;
+			else if (par->slot_state[i] == LEDFB_SLOT_QUEUED && par->slot_pts[i] <= present.pts)
+			{
+				par->slot_state[i] = LEDFB_SLOT_FREE;
+				par->queue_dropped++;
+			}
+		}
+
+		par->slot_state[slot] = LEDFB_SLOT_SHOWN;
+		present.page = slot;
+		present.pts = par->slot_pts[slot];
+		present.yoffset = slot * info->var.yres;
+		present.dropped = par->queue_dropped;
+		par->queue_dropped = 0;
+	}
+	present.queued = virtfb_queue_count(info);
+	present.slots = virtfb_queue_slots(info);
+	spin_unlock_irq(&par->lock);
+
+	if (slot < 0)
+		return -EAGAIN;
+
+	wake_up_interruptible(&par->wait);
+
+	if (copy_to_user(upresent, &present, sizeof(present)))
+		return -EFAULT;
+
+	return 0;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  in-kernel transmitter
+// ----------------------------------------------------------------------------------
+
+/**
+ * Sends all chunks of the front buffer, one skb per chunk built straight
+ * from the vram.
+ * @param tx transmitter
+ */
+static void ledfb_tx_frame(struct ledfb_tx *tx)
+{
+	struct fb_info *info = tx->info;
+	struct ledfb_par *par = info->par;
+	struct net_device *dev = tx->dev;
+	const u8 *front;
+	u32 offset, i, p;
+
+	mutex_lock(&par->vram_lock);
+	offset = READ_ONCE(info->var.yoffset) * tx->line_length;
+	if (info->fix.line_length != tx->line_length || !info->screen_base ||
+		info->var.bits_per_pixel != tx->bytes_per_pixel * 8 ||
+		offset + tx->page_size > info->fix.smem_len)
+	{
+		mutex_unlock(&par->vram_lock);
+		return;
+	}
+	front = info->screen_base + offset;
+
+	for (i = 0; i < tx->chunk_count; i++)
+	{
+		const struct ledfb_tx_chunk *chunk = &tx->chunks[i];
+		const u32 *gather = tx->gather + chunk->gather;
+		const u8 *lut = tx->luts + chunk->panel * 3 * 256;
+		int c0 = (chunk->flags & LEDFB_TX_SWAP_RB) ? 2 : 0, c2 = 2 - c0;
+		unsigned int len = 2 + chunk->pixels * 3;
+		struct sk_buff *skb;
+		u8 *data;
+
+		skb = alloc_skb(LL_RESERVED_SPACE(dev) + len + dev->needed_tailroom, GFP_KERNEL);
+		if (!skb)
+		{
+			tx->errors++;
+			continue;
+		}
+		skb_reserve(skb, LL_RESERVED_SPACE(dev));
+		skb_reset_network_header(skb);
+
+		// opcode, chunk and the pixels in wire order
+		data = skb_put(skb, len);
+		*data++ = LEDFB_TX_OP_STORE;
+		*data++ = chunk->id;
+		for (p = 0; p < chunk->pixels; p++)
+		{
+			const u8 *src = front + gather[p];
+
+			*data++ = lut[c0 * 256 + src[c0]];
+			*data++ = lut[256 + src[1]];
+			*data++ = lut[c2 * 256 + src[c2]];
+		}
+
+		skb->dev = dev;
+		skb->protocol = htons(LEDFB_TX_ETHERTYPE);
+		if (dev_hard_header(skb, dev, LEDFB_TX_ETHERTYPE, chunk->dst, dev->dev_addr, skb->len) < 0)
+		{
+			kfree_skb(skb);
+			tx->errors++;
+			continue;
+		}
+
+		if (dev_queue_xmit(skb) == NET_XMIT_SUCCESS)
+			tx->packets++;
+		else
+			tx->errors++;
+	}
+	mutex_unlock(&par->vram_lock);
+}
+
+/**
+ * Sends a frame on every flip and whenever the refresh timer fires.
+ * @param data transmitter
+ */
+static int ledfb_tx_thread(void *data)
+{
+	struct ledfb_tx *tx = data;
+	struct ledfb_par *par = tx->info->par;
+	u32 seen = READ_ONCE(par->flip_seq);
+
+	// the first frame is sent right away
+	WRITE_ONCE(tx->tick, true);
+
+	while (!kthread_should_stop())
+	{
+		wait_event_interruptible(par->wait, kthread_should_stop() ||
+			READ_ONCE(par->flip_seq) != seen || READ_ONCE(tx->tick));
+		if (kthread_should_stop())
+			break;
+
+		WRITE_ONCE(tx->tick, false);
+		seen = READ_ONCE(par->flip_seq);
+		ledfb_tx_frame(tx);
+	}
+
+	return 0;
+}
+
+/**
+ * Wakes up the transmitter to refresh the wall.
+ * @param timer refresh timer of a transmitter
+ */
+static enum hrtimer_restart ledfb_tx_timer(struct hrtimer *timer)
+{
+	struct ledfb_tx *tx = container_of(timer, struct ledfb_tx, timer);
+	struct ledfb_par *par = tx->info->par;
+
+	WRITE_ONCE(tx->tick, true);
+	wake_up_interruptible(&par->wait);
+
+	hrtimer_forward_now(timer, tx->period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * Releases all tables and references of a transmitter.
+ * @param tx transmitter, may be NULL
+ */
+static void ledfb_tx_free(struct ledfb_tx *tx)
+{
+	if (!tx)
+		return;
+
+	if (tx->dev)
+		dev_put(tx->dev);
+	kvfree(tx->chunks);
+	kvfree(tx->gather);
+	kvfree(tx->luts);
+	kfree(tx);
+}
+
+/**
+ * Stops the transmitter of a framebuffer, the caller holds the tx lock.
+ * @param info framebuffer information pointer
+ */
+static void ledfb_tx_stop(struct fb_info *info)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_tx *tx = par->tx;
+
+	if (!tx)
+		return;
+
+	if (tx->period)
+		hrtimer_cancel(&tx->timer);
+	kthread_stop(tx->thread);
+
+	printk("ledfb: transmitter of fb%d on %s stopped, %llu packets, %llu errors\n",
+		info->node, tx->dev->name, tx->packets, tx->errors);
+
+	par->tx = NULL;
+	ledfb_tx_free(tx);
+}
+
+/**
+ * Copies a table of count entries from userspace.
+ */
+static void *ledfb_tx_copy(__u64 uptr, size_t count, size_t size)
+{
+	void *table;
+
+	table = kvmalloc_array(count, size, GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+
+	if (copy_from_user(table, u64_to_user_ptr(uptr), count * size))
+	{
+		kvfree(table);
+		return ERR_PTR(-EFAULT);
+	}
+
+	return table;
+}
+
+/**
+ * The transmitter sends raw frames to any address, so only callers that
+ * may administer the network and opened the framebuffer for writing may
+ * configure it. fb_ioctl does not pass the file, the caller names it.
+ * @param info framebuffer information pointer
+ * @param fd file descriptor of the caller
+ */
+static int ledfb_tx_permitted(struct fb_info *info, int fd)
+{
+	struct fd f;
+	int ret = -EPERM;
+
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+
+	if ((f.file->f_mode & FMODE_WRITE) && imajor(file_inode(f.file)) == FB_MAJOR &&
+		f.file->private_data == info)
+		ret = 0;
+
+	fdput(f);
+	return ret;
+}
+
+/**
+ * Replaces the transmitter of a framebuffer with a new configuration.
+ * @param info framebuffer information pointer
+ * @param uconfig configuration from the caller
+ */
+static int virtfb_set_tx(struct fb_info *info, struct ledfb_tx_config __user *uconfig)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_tx_config config;
+	struct ledfb_tx *tx;
+	u32 i;
+	int ret;
+
+	if (copy_from_user(&config, uconfig, sizeof(config)))
+		return -EFAULT;
+
+	ret = ledfb_tx_permitted(info, config.fd);
+	if (ret < 0)
+		return ret;
+
+	if (config.chunk_count > LEDFB_TX_MAX_CHUNKS || config.pixel_count > LEDFB_TX_MAX_PIXELS ||
+		config.panel_count > LEDFB_TX_MAX_PANELS)
+		return -EINVAL;
+
+	// every tick sends a whole frame while holding the vram
+	if (config.period_us > 0 && config.period_us < LEDFB_TX_MIN_PERIOD_US)
+		return -EINVAL;
+
+	if (config.chunk_count > 0 && !txdev[par->id])
+		return -ENODEV;
+
+	// no chunks only stops the transmitter
+	if (config.chunk_count == 0)
+	{
+		mutex_lock(&par->tx_lock);
+		ledfb_tx_stop(info);
+		mutex_unlock(&par->tx_lock);
+		return 0;
+	}
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	if (!tx)
+		return -ENOMEM;
+	tx->info = info;
+	tx->chunk_count = config.chunk_count;
+
+	tx->dev = dev_get_by_name(&init_net, txdev[par->id]);
+	if (!tx->dev)
+	{
+		ret = -ENODEV;
+		goto err;
+	}
+
+	tx->chunks = ledfb_tx_copy(config.chunks, config.chunk_count, sizeof(struct ledfb_tx_chunk));
+	tx->gather = ledfb_tx_copy(config.gather, config.pixel_count, sizeof(u32));
+	tx->luts = ledfb_tx_copy(config.luts, config.panel_count, 3 * 256);
+	if (IS_ERR(tx->chunks) || IS_ERR(tx->gather) || IS_ERR(tx->luts))
+	{
+		ret = IS_ERR(tx->chunks) ? PTR_ERR(tx->chunks) :
+			IS_ERR(tx->gather) ? PTR_ERR(tx->gather) : PTR_ERR(tx->luts);
+		goto err;
+	}
+
+	// the tables are trusted by the thread, every pixel has to lie
+	// within a page and every chunk within the mtu, the caller
+	// holds the fb lock and the geometry cannot change meanwhile
+	tx->line_length = info->fix.line_length;
+	tx->bytes_per_pixel = info->var.bits_per_pixel / 8;
+	tx->page_size = info->var.yres * info->fix.line_length;
+
+	ret = -EINVAL;
+	if (tx->bytes_per_pixel != 3 && tx->bytes_per_pixel != 4)
+		goto err;
+
+	for (i = 0; i < config.pixel_count; i++)
+		if (tx->page_size < 3 || tx->gather[i] > tx->page_size - 3)
+			goto err;
+
+	for (i = 0; i < config.chunk_count; i++)
+	{
+		const struct ledfb_tx_chunk *chunk = &tx->chunks[i];
+
+		if (chunk->panel >= config.panel_count ||
+			(u64)chunk->gather + chunk->pixels > config.pixel_count ||
+			2 + chunk->pixels * 3 > tx->dev->mtu)
+			goto err;
+	}
+
+	// swap in the new transmitter
+	mutex_lock(&par->tx_lock);
+	ledfb_tx_stop(info);
+	par->tx = tx;
+
+	tx->thread = kthread_run(ledfb_tx_thread, tx, "ledfb%u-tx", par->id);
+	if (IS_ERR(tx->thread))
+	{
+		ret = PTR_ERR(tx->thread);
+		par->tx = NULL;
+		mutex_unlock(&par->tx_lock);
+		goto err;
+	}
+
+	tx->period = ns_to_ktime((u64)config.period_us * NSEC_PER_USEC);
+	if (tx->period)
+	{
+		hrtimer_init(&tx->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		tx->timer.function = ledfb_tx_timer;
+		hrtimer_start(&tx->timer, tx->period, HRTIMER_MODE_REL);
+	}
+	mutex_unlock(&par->tx_lock);
+
+	printk("ledfb: transmitting fb%d on %s, %u chunks, refresh every %u us\n",
+		info->node, tx->dev->name, tx->chunk_count, config.period_us);
+
+	return 0;
+
+err:
+	if (IS_ERR(tx->chunks))
+		tx->chunks = NULL;
+	if (IS_ERR(tx->gather))
+		tx->gather = NULL;
+	if (IS_ERR(tx->luts))
+		tx->luts = NULL;
+	ledfb_tx_free(tx);
+	return ret;
+}
+
+/**
+ * Stops the transmitters of an interface going away, they hold a reference.
+ * @param nb notifier block
+ * @param event netdev event
+ * @param ptr notifier info
+ */
+static int ledfb_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	unsigned int i;
+
+	if (event != NETDEV_UNREGISTER)
+		return NOTIFY_DONE;
+
+	for (i = 0; i < g_fb_count; i++)
+	{
+		struct ledfb_par *par = g_fbis[i]->par;
+
+		mutex_lock(&par->tx_lock);
+		if (par->tx && par->tx->dev == dev)
+			ledfb_tx_stop(g_fbis[i]);
+		mutex_unlock(&par->tx_lock);
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block ledfb_netdev_notifier = {
+	.notifier_call = ledfb_netdev_event,
+};
+
+
 // ----------------------------------------------------------------------------------
 //  framebuffer implementation
 // ----------------------------------------------------------------------------------
@@ -98,20 +1007,37 @@ static int virtfb_set_fix(struct fb_info *info)
  */
 static int virtfb_set_par(struct fb_info *fbi)
 {
+	struct ledfb_par *par = fbi->par;
+	unsigned long flags;
 	int retval = 0;
-	u32 mem_len;
+	u32 mem_len, i;
 
 	dev_dbg(fbi->device, "Reconfiguring framebuffer\n");
 
 	virtfb_set_fix(fbi);
 
+	// the pages of the presentation queue move with the geometry
+	spin_lock_irqsave(&par->lock, flags);
+	for (i = 0; i < LEDFB_QUEUE_SLOTS; i++)
+		virtfb_queue_disown(par, i);
+	memset(par->slot_state, LEDFB_SLOT_FREE, sizeof(par->slot_state));
+	par->queue_dropped = 0;
+	spin_unlock_irqrestore(&par->lock, flags);
+	wake_up_interruptible(&par->wait);
+
+	// the vram fits every format of the current resolution,
+	// only a larger virtual resolution needs a new allocation
+	fbi->screen_size = fbi->var.xres * fbi->var.yres * (fbi->var.bits_per_pixel / 8);
 	mem_len = fbi->var.yres_virtual * fbi->fix.line_length;
 
 	if (!fbi->screen_base || (mem_len > fbi->fix.smem_len)) {
+		mutex_lock(&par->vram_lock);
 		if (fbi->screen_base)
 			virtfb_unmap_video_memory(fbi);
 
-		if (virtfb_map_video_memory(fbi) < 0)
+		retval = virtfb_map_video_memory(fbi);
+		mutex_unlock(&par->vram_lock);
+		if (retval < 0)
 			return -ENOMEM;
 	}
 
@@ -126,6 +1052,9 @@ static int virtfb_set_par(struct fb_info *fbi)
  */
 static int virtfb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 {
+	const struct ledfb_format *format;
+	int i;
+
 	// TODO: do we really want this to be modfied? i think not...
 	if (var->xres_virtual < var->xres)
 		var->xres_virtual = var->xres;
@@ -133,17 +1062,16 @@ static int virtfb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 	if (var->yres_virtual < var->yres)
 		var->yres_virtual = var->yres;
 
-	// our led matrix is just 24bpp, nothing else
-	var->bits_per_pixel = 24;
-	var->red.length = 8;
-	var->red.offset = 16;
-	var->red.msb_right = 0;
-	var->green.length = 8;
-	var->green.offset = 8;
-	var->green.msb_right = 0;
-	var->blue.length = 8;
-	var->blue.offset = 0;
-	var->blue.msb_right = 0;
+	// pick the requested format, anything unknown gets the native one
+	format = &formats[0];
+	for (i = 0; i < ARRAY_SIZE(formats); i++)
+		if (formats[i].bits_per_pixel == var->bits_per_pixel)
+			format = &formats[i];
+
+	var->bits_per_pixel = format->bits_per_pixel;
+	var->red = format->red;
+	var->green = format->green;
+	var->blue = format->blue;
 	var->transp.length = 0;
 	var->transp.offset = 0;
 	var->transp.msb_right = 0;
@@ -164,18 +1092,137 @@ static int virtfb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
  */
 static int virtfb_pan_display(struct fb_var_screeninfo *var, struct fb_info *info)
 {
-
-	if (info->var.yoffset == var->yoffset)
-		return 0;	/* No change, do nothing */
+	struct ledfb_par *par = info->par;
+	unsigned long flags;
 
 	if ((var->yoffset + info->var.yres) > info->var.yres_virtual)
 		return -EINVAL;
 
+	// every pan is a flip, even to the same page: the producer
+	// finished a frame and the consumers should pick it up
+	spin_lock_irqsave(&par->lock, flags);
 	info->var.yoffset = var->yoffset;
+	par->flip_seq++;
+	virtfb_mark_dirty(info, var->yoffset, var->yoffset + info->var.yres);
+	spin_unlock_irqrestore(&par->lock, flags);
+
+	wake_up_interruptible(&par->wait);
 
 	return 0;
 }
 
+/**
+ * Blocks until the next page flip or the timeout elapsed.
+ * @param info Framebuffer information pointer
+ * @param uflip flip state of the caller
+ */
+static int virtfb_wait_flip(struct fb_info *info, struct ledfb_flip __user *uflip)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_flip flip;
+	long ret;
+
+	if (copy_from_user(&flip, uflip, sizeof(flip)))
+		return -EFAULT;
+
+	// ioctls are called with the fb lock held, which the producer
+	// needs to pan, so it is released while we wait for the flip
+	mutex_unlock(&info->lock);
+	ret = wait_event_interruptible_timeout(par->wait,
+		READ_ONCE(par->flip_seq) != flip.seq, msecs_to_jiffies(flip.timeout));
+	mutex_lock(&info->lock);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(&par->lock);
+	flip.seq = par->flip_seq;
+	flip.yoffset = info->var.yoffset;
+	spin_unlock_irq(&par->lock);
+
+	if (copy_to_user(uflip, &flip, sizeof(flip)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Blocks until lines got dirty or the timeout elapsed and hands the
+ * accumulated dirty lines to the caller.
+ * @param info Framebuffer information pointer
+ * @param udirty dirty state returned to the caller
+ */
+static int virtfb_get_dirty(struct fb_info *info, struct ledfb_dirty __user *udirty)
+{
+	struct ledfb_par *par = info->par;
+	struct ledfb_dirty dirty;
+	long ret;
+
+	if (!info->fbdefio)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&dirty, udirty, sizeof(dirty)))
+		return -EFAULT;
+
+	// producers pan and query the screen info under the fb lock
+	mutex_unlock(&info->lock);
+	ret = wait_event_interruptible_timeout(par->wait,
+		READ_ONCE(par->dirty_y1) != READ_ONCE(par->dirty_y2), msecs_to_jiffies(dirty.timeout));
+	mutex_lock(&info->lock);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(&par->lock);
+	dirty.seq = par->flip_seq;
+	dirty.yoffset = info->var.yoffset;
+	dirty.y1 = par->dirty_y1;
+	dirty.y2 = par->dirty_y2;
+	dirty.band = virtfb_dirty_band(info);
+	memcpy(dirty.rows, par->dirty_rows, sizeof(dirty.rows));
+	par->dirty_y1 = par->dirty_y2 = 0;
+	memset(par->dirty_rows, 0, sizeof(par->dirty_rows));
+	spin_unlock_irq(&par->lock);
+
+	if (copy_to_user(udirty, &dirty, sizeof(dirty)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Handles the ledfb specific ioctls.
+ * @param info Framebuffer information pointer
+ * @param cmd ioctl command
+ * @param arg ioctl argument
+ */
+static int virtfb_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd)
+	{
+		case LEDFB_IOCTL_WAITFLIP:
+			return virtfb_wait_flip(info, (struct ledfb_flip __user *)arg);
+
+		case LEDFB_IOCTL_GETDIRTY:
+			return virtfb_get_dirty(info, (struct ledfb_dirty __user *)arg);
+
+		case LEDFB_IOCTL_QGETBUF:
+			return virtfb_queue_getbuf(info, (struct ledfb_present __user *)arg);
+
+		case LEDFB_IOCTL_QUEUE:
+			return virtfb_queue_put(info, (struct ledfb_present __user *)arg);
+
+		case LEDFB_IOCTL_QTAKE:
+			return virtfb_queue_take(info, (struct ledfb_present __user *)arg);
+
+		case LEDFB_IOCTL_QCANCEL:
+			return virtfb_queue_cancel(info, (struct ledfb_present __user *)arg);
+
+		case LEDFB_IOCTL_SETTX:
+			return virtfb_set_tx(info, (struct ledfb_tx_config __user *)arg);
+	}
+
+	return -ENOTTY;
+}
+
 /**
  * Function to handle custom mmap for virtual framebuffer.
  * @param fbi framebuffer information pointer
@@ -213,6 +1260,7 @@ static struct fb_ops virtfb_ops = {
 	.fb_set_par = virtfb_set_par,
 	.fb_check_var = virtfb_check_var,
 	.fb_pan_display = virtfb_pan_display,
+	.fb_ioctl = virtfb_ioctl,
 	.fb_mmap = virtfb_mmap,
 };
 
@@ -227,12 +1275,19 @@ static struct fb_ops virtfb_ops = {
 static struct fb_info *virtfb_init_fbinfo(struct fb_ops *ops)
 {
 	struct fb_info *fbi;
+	struct ledfb_par *par;
 
 	// Allocate sufficient memory for the fb structure
-	fbi = framebuffer_alloc(sizeof(unsigned int), NULL);
+	fbi = framebuffer_alloc(sizeof(struct ledfb_par), NULL);
 	if (!fbi)
 		return NULL;
 
+	par = fbi->par;
+	spin_lock_init(&par->lock);
+	init_waitqueue_head(&par->wait);
+	mutex_init(&par->tx_lock);
+	mutex_init(&par->vram_lock);
+
 	fbi->var.activate = FB_ACTIVATE_NOW;
 	fbi->fbops = ops;
 	fbi->flags = FBINFO_FLAG_DEFAULT;
@@ -245,13 +1300,13 @@ static int virtfb_register(struct fb_info *fbi, unsigned int id)
 	struct fb_videomode m;
 	int ret = 0;
 
-	//TODO: Set framebuffer ID
 	sprintf(fbi->fix.id, "virt_fb%d", id);
 
-	//Setup small default resolution
-	fbi->var.xres_virtual = fbi->var.xres = xres;
-	fbi->var.yres_virtual = fbi->var.yres = yres;
-	fbi->var.bits_per_pixel = BITS_PER_PIXEL;
+	// resolution of this instance, with a page per buffer
+	fbi->var.xres_virtual = fbi->var.xres = xres[id];
+	fbi->var.yres = yres[id];
+	fbi->var.yres_virtual = yres[id] * max(pages[id], 1);
+	fbi->var.bits_per_pixel = bpp[id];
 	fbi->screen_base = 0;
 
 	virtfb_check_var(&fbi->var, fbi);
@@ -270,45 +1325,101 @@ static int virtfb_register(struct fb_info *fbi, unsigned int id)
 	fbi->flags &= ~FBINFO_MISC_USEREVENT;
 	console_unlock();
 
+	// track the pages written by userspace, replaces our mmap
+	if (defio_delay > 0)
+	{
+		struct ledfb_par *par = fbi->par;
+
+		par->defio.delay = msecs_to_jiffies(defio_delay);
+		par->defio.deferred_io = virtfb_deferred_io;
+		fbi->fbdefio = &par->defio;
+		fb_deferred_io_init(fbi);
+	}
+
 	return register_framebuffer(fbi);
 }
 
 
+/**
+ * Releases a framebuffer and its memory.
+ * @param fbi framebuffer information pointer
+ * @param registered the framebuffer was registered successfully
+ */
+static void virtfb_destroy(struct fb_info *fbi, bool registered)
+{
+	struct ledfb_par *par = fbi->par;
+	u32 i;
+
+	mutex_lock(&par->tx_lock);
+	ledfb_tx_stop(fbi);
+	mutex_unlock(&par->tx_lock);
+
+	for (i = 0; i < LEDFB_QUEUE_SLOTS; i++)
+		virtfb_queue_disown(par, i);
+
+	if (registered)
+		unregister_framebuffer(fbi);
+	if (fbi->fbdefio)
+		fb_deferred_io_cleanup(fbi);
+	virtfb_unmap_video_memory(fbi);
+	framebuffer_release(fbi);
+}
+
+
 // ----------------------------------------------------------------------------------
 //  module entry
 // ----------------------------------------------------------------------------------
 
 /**
  * Main entry function for the framebuffer.
+ * Creates one framebuffer per entry of the xres parameter.
  * @return error code indicating success or failure
  */
 int __init ledfb_init(void)
 {
-	int ret;    
-
-	// initialize the framebuffer structure
-    g_fbi = virtfb_init_fbinfo(&virtfb_ops);
-    if (!g_fbi)
-    {
-            ret = -ENOMEM;
-            goto fail;
-    }
-    *((u32*)g_fbi->par) = VIRT_FB_ID;
-   
-    // register the framebuffer
-    ret = virtfb_register(g_fbi, VIRT_FB_ID);
-    if (ret < 0)
+	unsigned int count = max_t(unsigned int, xres_count, 1);
+	int ret = 0;
+
+	for (g_fb_count = 0; g_fb_count < count; g_fb_count++)
+	{
+		unsigned int id = g_fb_count;
+		struct fb_info *fbi;
+
+		// initialize the framebuffer structure
+		fbi = virtfb_init_fbinfo(&virtfb_ops);
+		if (!fbi)
+		{
+			ret = -ENOMEM;
+			goto fail;
+		}
+		((struct ledfb_par *)fbi->par)->id = id;
+
+		// register the framebuffer
+		ret = virtfb_register(fbi, id);
+		if (ret < 0)
+		{
+			virtfb_destroy(fbi, false);
+			goto fail;
+		}
+
+		g_fbis[id] = fbi;
+	}
+
+	// transmitters stop when their interface goes away
+	ret = register_netdevice_notifier(&ledfb_netdev_notifier);
+	if (ret < 0)
 		goto fail;
 
-	printk("ledfb: Successfully initialized ledfb\n");
+	printk("ledfb: Successfully initialized %u framebuffers\n", g_fb_count);
 
 	return 0;
 
 fail:
-	if(g_fbi)
+	while (g_fb_count > 0)
 	{
-		unregister_framebuffer(g_fbi);
-    	framebuffer_release(g_fbi);
+		g_fb_count--;
+		virtfb_destroy(g_fbis[g_fb_count], true);
+		g_fbis[g_fb_count] = NULL;
 	}
 
 	printk(KERN_ALERT "failed to initialize ledfb driver\n");
@@ -317,14 +1428,19 @@ fail:
 }
 
 /**
- * When the module gets unloaded we deregister the framebuffer.
+ * When the module gets unloaded we deregister all framebuffers.
  */
 void ledfb_exit(void)
 {
-	// destroy the freamebuffer device
-	unregister_framebuffer(g_fbi);
-	virtfb_unmap_video_memory(g_fbi);
-	framebuffer_release(g_fbi);
+	unregister_netdevice_notifier(&ledfb_netdev_notifier);
+
+	// destroy the framebuffer devices, newest first
+	while (g_fb_count > 0)
+	{
+		g_fb_count--;
+		virtfb_destroy(g_fbis[g_fb_count], true);
+		g_fbis[g_fb_count] = NULL;
+	}
 }
 
 
@@ -340,5 +1456,9 @@ MODULE_SUPPORTED_DEVICE("fb");
 module_init(ledfb_init);
 module_exit(ledfb_exit);
 
-module_param(xres, int, 0);
-module_param(yres, int, 0);
+module_param_array(xres, int, &xres_count, 0);
+module_param_array(yres, int, NULL, 0);
+module_param_array(pages, int, NULL, 0);
+module_param_array(bpp, int, NULL, 0);
+module_param(defio_delay, int, 0);
+module_param_array(txdev, charp, NULL, 0);
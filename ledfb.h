@@ -0,0 +1,226 @@
+/*
+ * ledfb - framebuffer driver for led matrix
+ *
+ * Interface between the ledfb kernel module and its userspace consumers.
+ * This header is shared by the module and ledfbd.
+ */
+
+#ifndef _LEDFB_H_
+#define _LEDFB_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Number of bits in the dirty row bitmap. */
+#define LEDFB_DIRTY_BITS	1024
+
+/** Limits of a transmitter configuration. */
+#define LEDFB_TX_MAX_CHUNKS	4096
+#define LEDFB_TX_MAX_PIXELS	(4 * 1024 * 1024)
+#define LEDFB_TX_MAX_PANELS	1024
+
+/** Shortest refresh interval of the transmitter in microseconds, 1000 fps. */
+#define LEDFB_TX_MIN_PERIOD_US	1000
+
+/** Maximum number of pages in the presentation queue. */
+#define LEDFB_QUEUE_SLOTS	16
+
+/** Flags of a transmitted chunk. */
+#define LEDFB_TX_SWAP_RB	0x01
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Argument of LEDFB_IOCTL_WAITFLIP.
+ */
+struct ledfb_flip
+{
+	/** in: last flip seen by the caller, out: current flip */
+	__u32 seq;
+
+	/** out: first line of the front buffer in the virtual framebuffer */
+	__u32 yoffset;
+
+	/** in: maximum time to wait in milliseconds */
+	__u32 timeout;
+};
+
+/**
+ * Argument of LEDFB_IOCTL_GETDIRTY. Lines are counted in the virtual
+ * framebuffer, i.e. across all pages.
+ */
+struct ledfb_dirty
+{
+	/** in: maximum time to wait in milliseconds */
+	__u32 timeout;
+
+	/** out: current flip sequence number */
+	__u32 seq;
+
+	/** out: first line of the front buffer in the virtual framebuffer */
+	__u32 yoffset;
+
+	/** out: bounding range [y1, y2) of all dirty lines, empty if y1 == y2 */
+	__u32 y1;
+	__u32 y2;
+
+	/** out: number of lines covered by one bit of rows */
+	__u32 band;
+
+	/** out: bitmap of dirty line bands */
+	__u32 rows[LEDFB_DIRTY_BITS / 32];
+};
+
+/**
+ * Argument of the presentation queue ioctls. Every page of the virtual
+ * framebuffer is a slot, presentation times are on CLOCK_MONOTONIC.
+ */
+struct ledfb_present
+{
+	/**
+	 * QGETBUF out: free page to draw into, QUEUE in: page drawn,
+	 * QCANCEL in: page not drawn, QTAKE out: page to show
+	 */
+	__u32 page;
+
+	/** in: maximum time to wait in milliseconds */
+	__u32 timeout;
+
+	/** QUEUE in: presentation time, QTAKE in: deadline, out: presentation time of the page */
+	__u64 pts;
+
+	/** out: first line of the page in the virtual framebuffer */
+	__u32 yoffset;
+
+	/** QTAKE out: due frames skipped for a later one since the last QTAKE */
+	__u32 dropped;
+
+	/** out: frames waiting in the queue */
+	__u32 queued;
+
+	/** out: number of slots of the queue */
+	__u32 slots;
+};
+
+/**
+ * A chunk sent by the in-kernel transmitter, one packet each.
+ */
+struct ledfb_tx_chunk
+{
+	/** Hardware address of the panel. */
+	__u8 dst[6];
+
+	/** Number of the chunk on the wire. */
+	__u8 id;
+
+	/** LEDFB_TX_* flags. */
+	__u8 flags;
+
+	/** Index of the lookup tables of the panel. */
+	__u16 panel;
+
+	/** Number of pixels. */
+	__u16 pixels;
+
+	/** First entry of the chunk in the gather table. */
+	__u32 gather;
+};
+
+/**
+ * Argument of LEDFB_IOCTL_SETTX. The tables are compiled for the current
+ * geometry and format of the framebuffer, only 24 and 32 bpp are supported.
+ */
+struct ledfb_tx_config
+{
+	/** Number of chunks, 0 stops the transmitter. */
+	__u32 chunk_count;
+
+	/** Number of entries of the gather table. */
+	__u32 pixel_count;
+
+	/** Number of panels with lookup tables. */
+	__u32 panel_count;
+
+	/**
+	 * Interval in microseconds the wall is refreshed without flips, 0 for
+	 * flips only, at least LEDFB_TX_MIN_PERIOD_US otherwise.
+	 */
+	__u32 period_us;
+
+	/** The file descriptor the ioctl is issued on, it has to be open for writing. */
+	__s32 fd;
+	__u32 reserved;
+
+	/** chunk_count struct ledfb_tx_chunk. */
+	__u64 chunks;
+
+	/** Byte offset of every pixel in the front buffer, pixel_count __u32. */
+	__u64 gather;
+
+	/**
+	 * Lookup tables of every panel, panel_count * 3 * 256 bytes, the
+	 * channels in framebuffer byte order: blue, green, red.
+	 */
+	__u64 luts;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  ioctls
+// ----------------------------------------------------------------------------------
+
+/**
+ * Waits until a producer flipped to a new page or the timeout elapsed.
+ * Returns the current flip sequence number and front buffer offset.
+ */
+#define LEDFB_IOCTL_WAITFLIP	_IOWR('F', 0xA0, struct ledfb_flip)
+
+/**
+ * Waits until lines were written or flipped to, or the timeout elapsed.
+ * Returns and clears all dirty lines accumulated since the last call.
+ * Fails with EOPNOTSUPP if the module was loaded with defio_delay=0.
+ */
+#define LEDFB_IOCTL_GETDIRTY	_IOWR('F', 0xA1, struct ledfb_dirty)
+
+/**
+ * Hands a free page of the presentation queue to a producer, waits for one
+ * if all are queued or shown. Fails with EAGAIN after the timeout. The page
+ * belongs to the calling process until it is queued or cancelled, or until
+ * the process exits.
+ */
+#define LEDFB_IOCTL_QGETBUF	_IOWR('F', 0xA3, struct ledfb_present)
+
+/**
+ * Queues a page drawn by a producer to be shown at its presentation time.
+ */
+#define LEDFB_IOCTL_QUEUE		_IOWR('F', 0xA4, struct ledfb_present)
+
+/**
+ * Takes the latest queued page due at the deadline, the earlier due ones
+ * are dropped and the page taken before is released. Waits for a due page
+ * until the timeout, then fails with EAGAIN and the previous page stays shown.
+ */
+#define LEDFB_IOCTL_QTAKE		_IOWR('F', 0xA5, struct ledfb_present)
+
+/**
+ * Returns a page handed out by QGETBUF to the queue without showing it.
+ * Fails with EINVAL if the calling process is not drawing into the page.
+ */
+#define LEDFB_IOCTL_QCANCEL	_IOW('F', 0xA6, struct ledfb_present)
+
+/**
+ * Configures and starts the in-kernel transmitter, which sends every
+ * flipped frame and refreshes the wall periodically on the interface
+ * given by the txdev module parameter. Fails with ENODEV if there is none
+ * and with EPERM without CAP_NET_ADMIN or write access to the framebuffer.
+ */
+#define LEDFB_IOCTL_SETTX		_IOW('F', 0xA2, struct ledfb_tx_config)
+
+#endif
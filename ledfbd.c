@@ -17,6 +17,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
@@ -28,48 +29,42 @@
 #include <netinet/ether.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <linux/if_packet.h>
-#include <math.h>
 #include <getopt.h>
+#include <errno.h>
 #include <stdbool.h>
 
+#include "calib.h"
+#include "compose.h"
+#include "encode.h"
+#include "layers.h"
+#include "layout.h"
+#include "ledfb.h"
+#include "ledshm.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "pipeline.h"
+#include "record.h"
+#include "tx.h"
+#include "utils.h"
+
 // ----------------------------------------------------------------------------------
 //  constants
 // ----------------------------------------------------------------------------------
 
-/** Frame cycle time in milliseconds. */
-#define FRAME_CYCLE_TIME	25
-
-/** Maximum packet size in bytes. */
-#define PACKET_SIZE			2000
-
-/** Ethertype of the packet. */
-#define PACKET_ETHERTYPE	0x0801
-
-/** LED matrix panel dimensions. */
-#define PANEL_SIZE_X		128
-#define PANEL_SIZE_Y		32
-#define PANEL_BPP			3
-#define PANEL_CHUNKS		8
-
-/** All mac adresses of the led panels. */
-static uint8_t panel_addrs[][6] = 
-{
-	{0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD0},
-    {0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD1},
-    {0xDE, 0xAD, 0xBE, 0xEF, 0xC0, 0xD2},
-};
+/** Default frame rate. */
+#define FRAME_RATE			40
 
-/** Definition of the panel matrix. */
-#define PANEL_COUNT			(sizeof(panel_addrs) / sizeof(panel_addrs[0]))
+/** Default gamma correction value. */
+#define GAMMA               2
 
-/** Pixel protocol opcodes. */
-#define PP_OP_STORE_FRAME	0x29
+/** Default interval in milliseconds unchanged chunks are resent. */
+#define KEEPALIVE_TIME		1000
 
-/** Gamma correction value. */
-#define GAMMA               2
+/** Maximum number of interfaces the panels are spread over. */
+#define MAX_PORTS			16
 
 // ----------------------------------------------------------------------------------
 //  options
@@ -78,6 +73,25 @@ static struct option long_options[] =
 {
         {"flip-x", optional_argument, NULL, 'x'},
         {"flip-y", optional_argument, NULL, 'y'},
+        {"calib", required_argument, NULL, 'c'},
+        {"keepalive", required_argument, NULL, 'k'},
+        {"tx", required_argument, NULL, 't'},
+        {"layout", required_argument, NULL, 'l'},
+        {"encoder", required_argument, NULL, 'e'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"fps", required_argument, NULL, 'f'},
+        {"overrun", required_argument, NULL, 'o'},
+        {"realtime", optional_argument, NULL, 'r'},
+        {"mlock", no_argument, NULL, 'm'},
+        {"dither", no_argument, NULL, 'd'},
+        {"stats", required_argument, NULL, 's'},
+        {"metrics", required_argument, NULL, 'p'},
+        {"record", required_argument, NULL, 'R'},
+        {"play", required_argument, NULL, 'P'},
+        {"kernel", optional_argument, NULL, 'K'},
+        {"queue", no_argument, NULL, 'q'},
+        {"layer", required_argument, NULL, 'L'},
         {NULL, 0, NULL, 0}
 };
 
@@ -88,58 +102,241 @@ static struct option long_options[] =
 /** The user requested the application to shutdown. */
 static int closereq = 0;
 
-/** The buffer containing the ethernet frame to send. */
-static uint8_t packet_buffer[PACKET_SIZE];
+/** The user requested the calibration to be reloaded. */
+static volatile sig_atomic_t reloadreq = 0;
+
+/** The user requested the frame statistics. */
+static volatile sig_atomic_t statsreq = 0;
 
 
 // ----------------------------------------------------------------------------------
 //  local helper functions
 // ----------------------------------------------------------------------------------
 
-static uint64_t clock_us(void)
+/**
+ * Checks whether the pixels are RGB565, RGB888, XRGB8888 or have
+ * 16 bits per channel, all with blue in the lowest bits.
+ */
+static bool fb_format_known(const struct fb_var_screeninfo *var)
 {
-	struct timeval time;
-	gettimeofday(&time, NULL);
+	uint32_t len = (var->bits_per_pixel == 48) ? 16 : 8;
+
+	if (var->bits_per_pixel == 16)
+		return var->blue.offset == 0 && var->blue.length == 5 &&
+			var->green.offset == 5 && var->green.length == 6 &&
+			var->red.offset == 11 && var->red.length == 5;
+
+	if (var->bits_per_pixel != 24 && var->bits_per_pixel != 32 && var->bits_per_pixel != 48)
+		return false;
 
-	return (time.tv_sec * 1000 * 1000) + time.tv_usec;
+	return var->blue.offset == 0 && var->blue.length == len &&
+		var->green.offset == len && var->green.length == len &&
+		var->red.offset == 2 * len && var->red.length == len;
 }
 
-static uint8_t correct_gamma(double g, uint8_t val)
+/**
+ * Parses a comma separated list of cpu numbers.
+ * @return the number of cpus or -1 on a malformed list
+ */
+static int parse_cpus(char *list, int *cpus, int max)
 {
-	return (uint8_t) (round(255 * pow((val / 255.0), g) * 1));
+	char *save = NULL;
+	int count = 0;
+
+	for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		char *end;
+		long cpu = strtol(tok, &end, 10);
+
+		if (*end != '\0' || cpu < 0 || count == max)
+			return -1;
+		cpus[count++] = (int)cpu;
+	}
+
+	return count;
 }
 
-static int eth_prepare_packet(struct sockaddr *source_hwaddr)
+/**
+ * Parses a comma separated list of interfaces, each optionally followed
+ * by @cpu to pin its sender thread. The list is split in place.
+ * @return the number of interfaces or -1 on a malformed list
+ */
+static int parse_ifaces(char *list, char **ifaces, int *cpus, int max)
 {
-	struct ether_header *eh = (struct ether_header *)packet_buffer;
-
-	// ethernet header
-	eh->ether_shost[0] = ((uint8_t*)&source_hwaddr->sa_data)[0];
-	eh->ether_shost[1] = ((uint8_t*)&source_hwaddr->sa_data)[1];
-	eh->ether_shost[2] = ((uint8_t*)&source_hwaddr->sa_data)[2];
-	eh->ether_shost[3] = ((uint8_t*)&source_hwaddr->sa_data)[3];
-	eh->ether_shost[4] = ((uint8_t*)&source_hwaddr->sa_data)[4];
-	eh->ether_shost[5] = ((uint8_t*)&source_hwaddr->sa_data)[5];
-	eh->ether_type = htons(PACKET_ETHERTYPE);
-
-	return sizeof(struct ether_header);
+	char *save = NULL;
+	int count = 0;
+
+	for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		char *at = strchr(tok, '@');
+
+		if (count == max || at == tok)
+			return -1;
+
+		cpus[count] = -1;
+		if (at != NULL)
+		{
+			char *end;
+			long cpu = strtol(at + 1, &end, 10);
+
+			if (*end != '\0' || end == at + 1 || cpu < 0)
+				return -1;
+			*at = '\0';
+			cpus[count] = (int)cpu;
+		}
+		ifaces[count++] = tok;
+	}
+
+	return count;
+}
+
+/**
+ * Hands the compiled layout and the calibration to the in-kernel
+ * transmitter of the framebuffer, which sends the frames from then on.
+ * @return 0 on success, -1 on error
+ */
+static int kernel_start(int fb, const struct layout *layout, const struct calib *cal, double fps)
+{
+	struct ledfb_tx_config config = { 0 };
+	struct ledfb_tx_chunk *chunks;
+	uint8_t *luts;
+	int ret = -1;
+
+	if (1000000 / fps < LEDFB_TX_MIN_PERIOD_US)
+	{
+		printf("in-kernel transmitter refreshes at most %d fps\n", 1000000 / LEDFB_TX_MIN_PERIOD_US);
+		return -1;
+	}
+
+	chunks = calloc(layout->chunk_count, sizeof(struct ledfb_tx_chunk));
+	luts = malloc((size_t)layout->panel_count * 3 * 256);
+	if (chunks == NULL || luts == NULL)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	for (unsigned int i = 0; i < layout->chunk_count; i++)
+	{
+		const struct layout_chunk *chunk = &layout->chunks[i];
+		const struct layout_panel *panel = &layout->panels[chunk->panel];
+
+		memcpy(chunks[i].dst, panel->mac, 6);
+		chunks[i].id = (uint8_t)chunk->id;
+		chunks[i].flags = panel->swap_rb ? LEDFB_TX_SWAP_RB : 0;
+		chunks[i].panel = chunk->panel;
+		chunks[i].pixels = chunk->pixels;
+		chunks[i].gather = chunk->gather;
+	}
+
+	// the tables are indexed by the framebuffer byte order
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		memcpy(luts + (p * 3 + 0) * 256, calib_lut(cal, p, CALIB_BLUE), 256);
+		memcpy(luts + (p * 3 + 1) * 256, calib_lut(cal, p, CALIB_GREEN), 256);
+		memcpy(luts + (p * 3 + 2) * 256, calib_lut(cal, p, CALIB_RED), 256);
+	}
+
+	config.chunk_count = layout->chunk_count;
+	config.pixel_count = layout->gather_count;
+	config.panel_count = layout->panel_count;
+	config.period_us = (uint32_t)(1000000 / fps);
+	config.fd = fb;
+	config.chunks = (uintptr_t)chunks;
+	config.gather = (uintptr_t)layout->gather;
+	config.luts = (uintptr_t)luts;
+	if (ioctl(fb, LEDFB_IOCTL_SETTX, &config) < 0)
+	{
+		perror("LEDFB_IOCTL_SETTX");
+		goto err;
+	}
+
+	ret = 0;
+
+err:
+	free(chunks);
+	free(luts);
+	return ret;
 }
 
-static int eth_send_packet(int fd, uint8_t dst[6], int ifindex, int len)
+/**
+ * Streams a recording to the panels in a loop until the application is
+ * asked to shut down, with the timing it was recorded with. The packets
+ * are copied from the mapped file straight into the transmit buffers.
+ * @return 0 on success, -1 on error
+ */
+static int play_recording(const char *path, const struct tx_ops *tx_ops, const char *iface)
 {
-	struct ether_header *eh = (struct ether_header *)packet_buffer;
-	struct sockaddr_ll addr;
+	struct record_map map;
+	struct tx tx = { .fd = -1 };
+	uint64_t base, duration;
+	int ret = -1;
+
+	if (record_map(&map, path) < 0)
+		return -1;
+
+	if (tx_open(&tx, tx_ops, iface, map.max_packets > 0 ? map.max_packets : 1) < 0)
+		goto err;
+	if (map.max_len > tx.payload_size)
+	{
+		printf("the recording needs an mtu of %zu bytes\n", map.max_len);
+		goto err;
+	}
+
+	// a single frame is repeated at the default frame rate
+	duration = map.header->duration_us * 1000;
+	if (duration == 0)
+		duration = 1000000000ULL / FRAME_RATE;
+
+	printf("Playing %u frames of %u panels, %.2f s per loop, transmit backend: %s\n",
+		map.header->frame_count, map.header->panel_count, duration / 1e9, tx.ops->name);
+
+	base = clock_ns();
+	while (!closereq)
+	{
+		for (unsigned int f = 0; f < map.header->frame_count && !closereq; f++)
+		{
+			const struct record_frame *frame = &map.frames[f];
+			const struct record_packet *packet = record_first(&map, f);
+			uint64_t deadline = base + frame->time_us * 1000;
+			struct timespec ts = { deadline / 1000000000ULL, deadline % 1000000000ULL };
 
-	// set the destination mac address
-	memcpy(eh->ether_dhost, dst, 6);
+			unsigned int unsent = 0;
 
-	// prepare the socketaddr
-	addr.sll_ifindex = ifindex;
-	addr.sll_halen = ETH_ALEN;
-	memcpy(addr.sll_addr, dst, 6);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+			for (unsigned int i = 0; i < frame->packets; i++, packet = record_next(packet))
+			{
+				uint8_t *payload = tx_packet(&tx, map.panels[packet->panel].mac);
+
+				// a ring without free slots stays full for the rest of the frame
+				if (payload == NULL)
+				{
+					unsent = frame->packets - i;
+					break;
+				}
+
+				memcpy(payload, packet + 1, packet->len);
+				tx_commit(&tx, packet->len);
+			}
+
+			int failed = tx_flush(&tx) + unsent;
+			if (failed > 0)
+				printf("sendto: %d of %u packets failed\n", failed, frame->packets);
+		}
+
+		// start the next loop on time, or right away after a stall
+		base += duration;
+		if (base < clock_ns())
+			base = clock_ns();
+	}
 
-	return sendto(fd, packet_buffer, len, 0,
-		(struct sockaddr*)&addr, sizeof(struct sockaddr_ll));
+	ret = 0;
+
+err:
+	tx_close(&tx);
+	record_unmap(&map);
+	return ret;
 }
 
 
@@ -153,6 +350,16 @@ static void sigint_handler(int signal)
     printf("Shutting down application...\n");
 }
 
+static void sighup_handler(int signal)
+{
+	reloadreq = 1;
+}
+
+static void sigusr1_handler(int signal)
+{
+	statsreq = 1;
+}
+
 
 // ----------------------------------------------------------------------------------
 //  entry point
@@ -160,24 +367,69 @@ static void sigint_handler(int signal)
 
 int main(int argc, char *argv[])
 {
-	int fb = -1, sock = -1;
-	int ifindex, mtu, payload_offset, errorcode = -1;
+	int fb = -1, errorcode = -1;
 	uint8_t *framebuffer = NULL;
 	struct fb_var_screeninfo vinfo;
     struct fb_fix_screeninfo finfo;
-	struct ifreq iface;
-	struct sockaddr hwaddr;
+	struct tx tx[MAX_PORTS];
+	char *ifaces[MAX_PORTS];
+	int iface_cpus[MAX_PORTS];
+	int port_count = 0;
 	struct sigaction signal_handler;
-	uint32_t fb_width = 0;
 	uint32_t fb_bpp = 0;
 	uint32_t framesize = 0;
-	char ch;
+	struct ledfb_flip flip = { 0 };
+	struct ledfb_dirty dirty = { 0 };
+	int fb_events = FB_EVENTS_NONE;
+	struct calib *cal = NULL;
+	const char *calib_path = NULL;
+	struct layout *layout = NULL;
+	const char *layout_path = NULL;
+	uint64_t keepalive = KEEPALIVE_TIME * 1000;
+	const struct tx_ops *tx_ops = &tx_mmsg_ops;
+	const struct encode_ops *encoder = NULL;
+	const char *encoder_name = NULL;
+	struct pipeline pl = { 0 };
+	struct metrics metrics = { 0 };
+	const char *stats_name = NULL;
+	const char *metrics_path = NULL;
+	struct record rec = { 0 };
+	const char *record_path = NULL;
+	const char *play_path = NULL;
+	const char *fb_path;
+	int kernel_tx = 0;
+	bool queue = false;
+	bool composed = false;
+	struct ledfb_present present = { 0 };
+	uint64_t queue_dropped = 0;
+	struct ledshm_server shm = LEDSHM_SERVER_INIT;
+	const char *shm_path = NULL;
+	struct layers layers = { 0 };
+	char *layer_specs[LAYERS_MAX];
+	unsigned int layer_count = 0;
+	uint32_t line_length, bpp;
+	int workers = 0;
+	int cpus[PIPELINE_MAX_CPUS];
+	int cpu_count = 0;
+	struct pacer pacer;
+	double fps = FRAME_RATE;
+	int overrun = PACER_SKIP;
+	int rt_priority = 0;
+	bool lock_memory = false;
+	bool dither = false;
+	unsigned int depth = CALIB_DEPTH_SD;
+	struct compose ctx = { 0 };
+	struct compose_frame frame_infos[PIPELINE_FRAMES];
+	int ch;
 
 	bool flip_x = false;
 	bool flip_y = false;
 
+	for (int p = 0; p < MAX_PORTS; p++)
+		tx[p] = (struct tx){ .fd = -1 };
+
     // loop over all of the options
-    while ((ch = getopt_long(argc, argv, "xy", long_options, NULL)) != -1)
+    while ((ch = getopt_long(argc, argv, "xyc:k:t:l:e:j:a:f:o:r::mds:p:R:P:K::qL:", long_options, NULL)) != -1)
     {
         switch (ch)
         {
@@ -189,25 +441,193 @@ int main(int argc, char *argv[])
                 flip_y = true;
                 printf("flip y enabled: yes\n");
                 break;
+            case 'c':
+                calib_path = optarg;
+                break;
+            case 'k':
+                keepalive = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 't':
+                tx_ops = tx_find(optarg);
+                if (tx_ops == NULL)
+                {
+                    printf("unknown tx backend: %s\n", optarg);
+                    goto err;
+                }
+                break;
+            case 'l':
+                layout_path = optarg;
+                break;
+            case 'e':
+                encoder_name = optarg;
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'a':
+                cpu_count = parse_cpus(optarg, cpus, PIPELINE_MAX_CPUS);
+                if (cpu_count < 0)
+                {
+                    printf("invalid cpu list: %s\n", optarg);
+                    goto err;
+                }
+                break;
+            case 'f':
+                fps = atof(optarg);
+                if (fps <= 0)
+                {
+                    printf("invalid frame rate: %s\n", optarg);
+                    goto err;
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "skip") == 0)
+                    overrun = PACER_SKIP;
+                else if (strcmp(optarg, "catchup") == 0)
+                    overrun = PACER_CATCHUP;
+                else
+                {
+                    printf("unknown overrun policy: %s\n", optarg);
+                    goto err;
+                }
+                break;
+            case 'r':
+                rt_priority = optarg ? atoi(optarg) : sched_get_priority_min(SCHED_FIFO);
+                break;
+            case 'm':
+                lock_memory = true;
+                break;
+            case 'd':
+                dither = true;
+                break;
+            case 's':
+                stats_name = optarg;
+                break;
+            case 'p':
+                metrics_path = optarg;
+                break;
+            case 'R':
+                record_path = optarg;
+                break;
+            case 'P':
+                play_path = optarg;
+                break;
+            case 'K':
+                kernel_tx = (optarg && strcmp(optarg, "off") == 0) ? -1 : 1;
+                break;
+            case 'q':
+                queue = true;
+                break;
+            case 'L':
+                if (layer_count == LAYERS_MAX)
+                {
+                    printf("at most %d layers\n", LAYERS_MAX);
+                    goto err;
+                }
+                layer_specs[layer_count++] = optarg;
+                break;
         }
     }
 
 
     // make sure all cmd args are present
-	if (argv[optind] == NULL || argv[optind + 1] == NULL)
+	if (argv[optind] == NULL || (play_path == NULL && !kernel_tx && argv[optind + 1] == NULL))
+	{
+		printf("usage: ./ledfbd [-x] [-y] [-c calib] [-k keepalive_ms] [-t sendto|mmsg|ring|uring|veth|pcap|unix|null] [-l layout] [-e scalar|ssse3|avx2|neon] [-j workers] [-a cpu,...] [-f fps] [-o skip|catchup] [-r[prio]] [-m] [-d] [-s stats_shm] [-p metrics_socket] [-R recording] [-q] [-L layer ...] iface[@cpu][,iface[@cpu]...] fbdev|shm:socket\n");
+		printf("       ./ledfbd [-t backend] -P recording iface\n");
+		printf("       ./ledfbd [-x] [-y] [-c calib] [-l layout] [-f fps] -K[off] fbdev\n");
+		goto err;
+	}
+
+	// playback needs neither a framebuffer nor the compose stages
+	if (play_path != NULL)
+	{
+		signal_handler.sa_handler = sigint_handler;
+		sigemptyset(&signal_handler.sa_mask);
+		signal_handler.sa_flags = 0;
+		sigaction(SIGINT, &signal_handler, NULL);
+
+		errorcode = play_recording(play_path, tx_ops, argv[optind]);
+		goto err;
+	}
+
+	// the module sends on the interface it was loaded with
+	fb_path = kernel_tx ? argv[optind] : argv[optind + 1];
+
+	// the panels of port n are sent on the n-th interface
+	if (!kernel_tx)
+		port_count = parse_ifaces(argv[optind], ifaces, iface_cpus, MAX_PORTS);
+	if (!kernel_tx && port_count <= 0)
 	{
-		printf("usage: ./ledfbd iface fbdev\n");
+		printf("invalid interface list: %s\n", argv[optind]);
 		goto err;
 	}
 
-	// open the framebuffer device file
-	fb = open(argv[optind + 1], O_RDONLY);
+	// read the panels of the wall
+	layout = layout_load(layout_path);
+	if (layout == NULL)
+	{
+		printf("failed to load layout\n");
+		goto err;
+	}
+	printf("Panels: %u\n", layout->panel_count);
+
+	// producers without the module publish their frames in a ring of
+	// shared memory the size of the wall, the daemon wakes up on every
+	// published frame
+	if (strncmp(fb_path, "shm:", 4) == 0)
+	{
+		shm_path = fb_path + 4;
+		if (kernel_tx || queue)
+		{
+			printf("the in-kernel transmitter and the presentation queue need the ledfb module\n");
+			goto err;
+		}
+
+		memset(&vinfo, 0, sizeof(vinfo));
+		memset(&finfo, 0, sizeof(finfo));
+		layout_size(layout, &vinfo.xres, &vinfo.yres);
+		vinfo.yres_virtual = vinfo.yres;
+		vinfo.bits_per_pixel = LEDSHM_BPP * 8;
+		vinfo.red = (struct fb_bitfield){ 16, 8, 0 };
+		vinfo.green = (struct fb_bitfield){ 8, 8, 0 };
+		vinfo.blue = (struct fb_bitfield){ 0, 8, 0 };
+		finfo.line_length = vinfo.xres * LEDSHM_BPP;
+		finfo.smem_len = vinfo.yres * finfo.line_length;
+
+		if (ledshm_serve(&shm, shm_path, vinfo.xres, vinfo.yres, LEDSHM_SLOTS) < 0)
+			goto err;
+		fb_bpp = LEDSHM_BPP;
+		framesize = finfo.smem_len;
+		printf("Shared memory input: %s, width: %d, height: %d, slots: %d\n",
+			shm_path, vinfo.xres, vinfo.yres, LEDSHM_SLOTS);
+		goto input_ready;
+	}
+
+	// open the framebuffer device file, the module only takes the
+	// transmitter configuration from a writer
+	fb = open(fb_path, kernel_tx ? O_RDWR : O_RDONLY);
 	if (-1 == fb)
 	{
 		perror("open");
 		goto err;
 	}
 
+	// no chunks stop the in-kernel transmitter
+	if (kernel_tx < 0)
+	{
+		struct ledfb_tx_config config = { .fd = fb };
+
+		if (ioctl(fb, LEDFB_IOCTL_SETTX, &config) < 0)
+		{
+			perror("LEDFB_IOCTL_SETTX");
+			goto err;
+		}
+		printf("In-kernel transmitter stopped\n");
+		errorcode = 0;
+		goto err;
+	}
+
 	// inquire screen infos
 	if (ioctl(fb, FBIOGET_VSCREENINFO, &vinfo) == -1) {
 		perror("FBIOGET_VSCREENINFO");
@@ -221,53 +641,201 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // map the framebuffer pixels to userspace
+    // map all pages of the framebuffer to userspace
     fb_bpp = (vinfo.bits_per_pixel / 8);
-    fb_width = finfo.line_length / fb_bpp;
-    framesize = vinfo.xres * vinfo.yres * fb_bpp;
-    printf("Framebuffer width: %d, height: %d\n", vinfo.xres, vinfo.yres);
+    framesize = finfo.smem_len;
+    printf("Framebuffer width: %d, height: %d, pages: %d\n",
+        vinfo.xres, vinfo.yres, vinfo.yres_virtual / vinfo.yres);
+	if (kernel_tx && fb_bpp != 3 && fb_bpp != 4)
+	{
+		printf("the in-kernel transmitter only sends 24 and 32 bpp framebuffers\n");
+		goto err;
+	}
 
 	framebuffer = (unsigned char*)mmap(0, framesize, PROT_READ, MAP_SHARED, fb, 0);
 	if (framebuffer == MAP_FAILED)
 	{
+		framebuffer = NULL;
 		perror("mmap");
 		goto err;
 	}
 
-	// Open RAW socket to send on
-	if ((sock = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
-	    perror("socket");
-	    goto err;
+	// ledfb wakes us up on written pages or at least on page flips, or
+	// hands out the frames producers queued with presentation times,
+	// other framebuffers are sampled
+	flip.timeout = 0;
+	dirty.timeout = 0;
+	if (queue)
+	{
+		if (ioctl(fb, LEDFB_IOCTL_QTAKE, &present) == 0)
+			flip.yoffset = present.yoffset;
+		else if (errno != EAGAIN)
+		{
+			perror("LEDFB_IOCTL_QTAKE");
+			goto err;
+		}
+		fb_events = FB_EVENTS_QUEUE;
+	}
+	else if (ioctl(fb, LEDFB_IOCTL_GETDIRTY, &dirty) == 0)
+		fb_events = FB_EVENTS_DIRTY;
+	else if (ioctl(fb, LEDFB_IOCTL_WAITFLIP, &flip) == 0)
+		fb_events = FB_EVENTS_FLIP;
+	printf("Framebuffer events: %s\n", (fb_events == FB_EVENTS_QUEUE) ? "presentation queue" :
+		(fb_events == FB_EVENTS_DIRTY) ? "dirty pages" :
+		(fb_events == FB_EVENTS_FLIP) ? "page flips" : "none");
+
+input_ready:
+	// 16 bits per channel are always dithered, their tables are indexed
+	// by the upper bits, the other formats only on request
+	ctx.known_format = fb_format_known(&vinfo);
+	printf("Framebuffer format: %ubpp%s\n", vinfo.bits_per_pixel,
+		ctx.known_format ? "" : " (unknown channel layout)");
+	if (ctx.known_format && fb_bpp == ENCODE_BPP_RGB16)
+	{
+		dither = true;
+		depth = CALIB_DEPTH_HD;
+	}
+	else if (dither && !ctx.known_format)
+	{
+		printf("dithering needs one of the known framebuffer formats\n");
+		goto err;
+	}
+	printf("Dithering: %s\n", dither ? "on" : "off");
+
+	// layers are drawn over an XRGB8888 copy of the framebuffer, the
+	// chunks are read from that copy instead
+	line_length = finfo.line_length;
+	bpp = fb_bpp;
+	if (layer_count > 0)
+	{
+		if (kernel_tx || !ctx.known_format || (fb_bpp != ENCODE_BPP && fb_bpp != ENCODE_BPP_XRGB8888))
+		{
+			printf("layers need a 24 or 32bpp framebuffer and the daemon to send the frames\n");
+			goto err;
+		}
+		line_length = vinfo.xres * ENCODE_BPP_XRGB8888;
+		bpp = ENCODE_BPP_XRGB8888;
+	}
+
+	// precompute the color calibration tables
+	cal = calib_load(calib_path, layout->panel_count, depth, GAMMA);
+	if (cal == NULL)
+	{
+		printf("failed to load calibration\n");
+		goto err;
 	}
 
-	// Get the index of the interface to send on
-	memset(&iface, 0, sizeof(struct ifreq));
-	strncpy(iface.ifr_name, argv[optind], IFNAMSIZ - 1);
-	if (ioctl(sock, SIOCGIFINDEX, &iface) < 0)
+	// resolve every pixel of every chunk to its framebuffer offset
+	if (layout_compile(layout, vinfo.xres, vinfo.yres, line_length, bpp, flip_x, flip_y) < 0)
+		goto err;
+
+	// the module sends the frames from now on, nothing left to do for us
+	if (kernel_tx > 0)
 	{
-		perror("SIOCGIFINDEX");
+		if (kernel_start(fb, layout, cal, fps) < 0)
+			goto err;
+		printf("In-kernel transmitter started, %u chunks at %.2f fps\n", layout->chunk_count, fps);
+		errorcode = 0;
 		goto err;
 	}
-	ifindex = iface.ifr_ifindex;
 
-	// Get the MAC address of the interface to send on
-	if (ioctl(sock, SIOCGIFHWADDR, &iface) < 0)
+	// known formats are converted and dithered by the fastest kernel of
+	// the cpu, others take the first three bytes of each pixel one by one
+	encoder = encode_select(encoder_name);
+	if (encoder == NULL)
 	{
-		perror("SIOCGIFHWADDR");
+		printf("unknown pixel encoder: %s\n", encoder_name);
 		goto err;
 	}
-	hwaddr = iface.ifr_hwaddr;
+	printf("Pixel encoder: %s\n", encoder->name);
 
-	// get the mtu of the sending interface
-	if (ioctl(sock, SIOCGIFMTU, &iface) < 0)
+	// every layer has a source of its own, drawn bottom up in the given order
+	if (layer_count > 0)
+	{
+		if (layers_open(&layers, layer_specs, layer_count, vinfo.xres, vinfo.yres, encoder) < 0)
+			goto err;
+		for (unsigned int i = 0; i < layers.count; i++)
+			printf("Layer %u: %s at %u,%u, %ux%u, opacity: %u%s\n", i, layers.layers[i].source,
+				layers.layers[i].x, layers.layers[i].y, layers.layers[i].width, layers.layers[i].height,
+				layers.layers[i].opacity, layers.layers[i].alpha ? ", alpha" : "");
+	}
+
+	// open a raw socket per interface with one packet buffer per chunk of the wall
+	for (int p = 0; p < port_count; p++)
+	{
+		if (tx_open(&tx[p], tx_ops, ifaces[p], layout->chunk_count) < 0)
+			goto err;
+		printf("Port %d: %s, transmit backend: %s, mtu: %d", p, ifaces[p], tx[p].ops->name, tx[p].mtu);
+		if (iface_cpus[p] >= 0)
+			printf(", cpu: %d", iface_cpus[p]);
+		printf("\n");
+	}
+
+	// counters of the stages, published as a stats page and on a socket
+	if (metrics_open(&metrics, layout, stats_name) < 0)
+		goto err;
+	metrics.page->period_us = (uint64_t)(1000000 / fps);
+	if (metrics_path != NULL && metrics_serve(&metrics, metrics_path) < 0)
+		goto err;
+	if (stats_name != NULL || metrics_path != NULL)
+		printf("Metrics: stats page %s, endpoint %s\n", stats_name ? stats_name : "-",
+			metrics_path ? metrics_path : "-");
+
+	// delta state of every chunk, every chunk has to fit into a packet
+	ctx.layout = layout;
+	ctx.cal = cal;
+	ctx.encoder = encoder;
+	ctx.tx = tx;
+	ctx.shard_count = port_count;
+	ctx.line_length = line_length;
+	ctx.bpp = bpp;
+	ctx.keepalive = keepalive;
+	ctx.dither = dither;
+	ctx.metrics = metrics.page;
+	if (compose_init(&ctx) < 0)
 	{
-		perror("SIOCGIFMTU");
+		printf("cannot send the layout on the given interfaces\n");
 		goto err;
 	}
 
-	// setup the ethernet packet
-	payload_offset = eth_prepare_packet(&hwaddr);
-	uint8_t *packet = packet_buffer + payload_offset;
+	// every frame as sent is appended to the recording
+	if (record_path != NULL)
+	{
+		if (record_open(&rec, record_path, layout) < 0)
+			goto err;
+		ctx.record = &rec;
+		printf("Recording to %s\n", record_path);
+	}
+
+	// one worker per cpu by default, more than one per panel is useless
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > (int)layout->panel_count)
+		workers = layout->panel_count;
+	if (workers <= 0)
+		workers = 1;
+
+
+	// keep the daemon from being paged out or preempted by normal tasks,
+	// the pipeline threads inherit the scheduling policy
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		perror("mlockall");
+	if (rt_priority > 0)
+	{
+		struct sched_param param = { .sched_priority = rt_priority };
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+			perror("sched_setscheduler");
+	}
+
+	// compose workers and a sender thread per interface, each
+	// frame is composed while the previous one is being sent
+	if (pipeline_start(&pl, &compose_pipeline_ops, &ctx, layout->panel_count, layout->chunk_count,
+		ctx.slot_size, vinfo.yres * line_length, workers,
+		cpu_count > 0 ? cpus : NULL, cpu_count, port_count, iface_cpus) < 0)
+		goto err;
+	for (int f = 0; f < PIPELINE_FRAMES; f++)
+		pl.frames[f].priv = &frame_infos[f];
+	printf("Compose workers: %d\n", workers);
 
 	// setup SIGINT handler
 	signal_handler.sa_handler = sigint_handler;
@@ -275,75 +843,187 @@ int main(int argc, char *argv[])
 	signal_handler.sa_flags = 0;
 	sigaction(SIGINT, &signal_handler, NULL);
 
+	// setup SIGHUP handler to reload the calibration at runtime
+	signal_handler.sa_handler = sighup_handler;
+	sigaction(SIGHUP, &signal_handler, NULL);
+
+	// setup SIGUSR1 handler to print the frame statistics
+	signal_handler.sa_handler = sigusr1_handler;
+	sigaction(SIGUSR1, &signal_handler, NULL);
+
+	printf("Frame rate: %.2f fps, overruns: %s\n", fps,
+		(overrun == PACER_SKIP) ? "skip" : "catch up");
+	pacer_init(&pacer, fps, overrun);
+
 	// mainloop composing ethernet packets
 	while (!closereq)
 	{
 		// time before pixel sending
-		uint64_t start = clock_us();
+		uint64_t start;
+
+		// release the frame at its deadline
+		pacer_wait(&pacer);
+		__atomic_store_n(&metrics.page->frames_skipped, pacer.skipped, __ATOMIC_RELAXED);
 
-		for (int p = 0; p < PANEL_COUNT; p++)
+		// a queued frame was composed ahead and is due now
+		if (composed)
 		{
-            int px = 0;
-            int py = p * PANEL_SIZE_Y;
+			pipeline_send(&pl);
+			composed = false;
+		}
 
-			for (int chunk = 0; chunk < PANEL_CHUNKS; chunk++)
+		// take the queued frame due at the next deadline, or wait for the
+		// producer to write, flip or publish a new frame, at most until
+		// the next deadline to keep the panels refreshed
+		if (shm_path != NULL)
+			ledshm_wait(&shm, pacer_left_ms(&pacer));
+		else if (fb_events == FB_EVENTS_QUEUE)
+		{
+			present.pts = pacer.deadline;
+			present.timeout = pacer_left_ms(&pacer);
+			if (ioctl(fb, LEDFB_IOCTL_QTAKE, &present) == 0)
 			{
-				int packet_pos = 0;
+				flip.yoffset = present.yoffset;
+				queue_dropped += present.dropped;
+			}
+			else if (errno != EAGAIN && errno != EINTR)
+			{
+				perror("LEDFB_IOCTL_QTAKE");
+				fb_events = FB_EVENTS_NONE;
+			}
+		}
+		else if (fb_events == FB_EVENTS_DIRTY)
+		{
+			dirty.timeout = pacer_left_ms(&pacer);
+			if (ioctl(fb, LEDFB_IOCTL_GETDIRTY, &dirty) < 0)
+			{
+				if (errno == EINTR)
+					continue;
 
-				// opcode and chunk
-				packet[packet_pos++] = PP_OP_STORE_FRAME;
-				packet[packet_pos++] = (uint8_t)chunk;
+				perror("LEDFB_IOCTL_GETDIRTY");
+				fb_events = FB_EVENTS_NONE;
+			}
+			flip.yoffset = dirty.yoffset;
+		}
+		else if (fb_events == FB_EVENTS_FLIP)
+		{
+			flip.timeout = pacer_left_ms(&pacer);
+			if (ioctl(fb, LEDFB_IOCTL_WAITFLIP, &flip) < 0 && errno != EINTR)
+			{
+				perror("LEDFB_IOCTL_WAITFLIP");
+				fb_events = FB_EVENTS_NONE;
+			}
+		}
+		else
+		{
+			struct fb_var_screeninfo cur;
+			if (ioctl(fb, FBIOGET_VSCREENINFO, &cur) == 0)
+				flip.yoffset = cur.yoffset;
+		}
+		start = clock_us();
 
-                int chunk_x = (chunk < 4) ? 0 : 64;
-                int chunk_y = (chunk % 4) * 8;
+		// only ever read the front buffer
+		if ((flip.yoffset + vinfo.yres) * finfo.line_length > framesize)
+			flip.yoffset = 0;
 
-				for (int y = 0; y < 8; y++)
-                {
-					for (int x = 0; x < 64; x++)
-					{
-                        uint32_t fb_x = px + chunk_x + x;
-                        if (flip_x)
-                            fb_x = (vinfo.xres - (px + chunk_x + x)) - 1;
-
-                        uint32_t fb_y = py + chunk_y + y;
-                        if (flip_y)
-                            fb_y = (vinfo.yres - (py + chunk_y + y)) - 1;
-
-						uint8_t *fb_base = &framebuffer[(fb_y * fb_width + fb_x) * (vinfo.bits_per_pixel / 8)];
-						packet[packet_pos++] = correct_gamma(GAMMA, fb_base[0]);
-						packet[packet_pos++] = correct_gamma(GAMMA, fb_base[1]);
-						packet[packet_pos++] = correct_gamma(GAMMA, fb_base[2]);
-					}
-                }
+		// swap in a new calibration between two frames, the
+		// workers are idle and the sender does not use it
+		if (reloadreq)
+		{
+			struct calib *reloaded;
 
-                // ethernet header (?) + opcode (1) + segment (1) + image data (8 * 64 *3)
-				int sz = (8 * 64 * PANEL_BPP) + payload_offset + 2;
-				if (eth_send_packet(sock, panel_addrs[p], ifindex, sz) < 0)
-					perror("sendto");
-            }
+			reloadreq = 0;
+			reloaded = calib_load(calib_path, layout->panel_count, depth, GAMMA);
+			if (reloaded != NULL)
+			{
+				calib_free(cal);
+				cal = reloaded;
+				ctx.cal = cal;
+				compose_invalidate(&ctx);
+				printf("Calibration reloaded\n");
+			}
 		}
 
-		// sleep the rest of the time to accomplish the cycle time
-		uint64_t time_left = (FRAME_CYCLE_TIME * 1000) - (clock_us() - start);
-		if (time_left > 0)
-			usleep(time_left);
+		// snapshot the front buffer, so the producer may flip
+		// again while the frame is still being composed
+		struct pipeline_frame *frame = pipeline_frame(&pl);
+		struct compose_frame *info = frame->priv;
+
+		// a queued frame is due at the next deadline
+		frame->start = (fb_events == FB_EVENTS_QUEUE) ? pacer.deadline / 1000 : start;
+		if (shm_path != NULL)
+		{
+			if (ledshm_read(&shm, frame->snapshot) < 0)
+				continue;
+		}
+		else if (layers.count > 0)
+			layers_base(&layers, frame->snapshot, framebuffer + flip.yoffset * finfo.line_length, fb_bpp, finfo.line_length);
+		else
+			memcpy(frame->snapshot, framebuffer + flip.yoffset * finfo.line_length, vinfo.yres * finfo.line_length);
+
+		// the layers change independently of the framebuffer, every
+		// chunk is looked at
+		if (layers.count > 0)
+			layers_draw(&layers, frame->snapshot);
+		info->events = (layers.count > 0) ? FB_EVENTS_NONE : fb_events;
+		info->yoffset = flip.yoffset;
+		if (fb_events == FB_EVENTS_DIRTY)
+			info->dirty = dirty;
+		metrics_observe(metrics.page, METRICS_CAPTURE, clock_us() - start);
+		metrics_add(&metrics.page->frames_captured, 1);
+
+		// compose all panels in parallel, then send them while
+		// the next frame is captured and composed, queued
+		// frames wait for their deadline
+		uint64_t composing = clock_us();
+		pipeline_compose(&pl);
+		metrics_observe(metrics.page, METRICS_COMPOSE, clock_us() - composing);
+		if (fb_events == FB_EVENTS_QUEUE)
+			composed = true;
 		else
-			printf("warn: no time to sleep\n");
+			pipeline_send(&pl);
+
+		if (statsreq)
+		{
+			statsreq = 0;
+			pacer_report(&pacer, stdout);
+			if (queue)
+				printf("Queued frames dropped: %llu\n", (unsigned long long)queue_dropped);
+			if (shm_path != NULL)
+				printf("Shared memory frames retried: %llu\n", (unsigned long long)shm.torn);
+		}
 	}
 	errorcode = 0;
 
+	pacer_report(&pacer, stdout);
+	if (queue)
+		printf("Queued frames dropped: %llu\n", (unsigned long long)queue_dropped);
+	if (shm_path != NULL)
+		printf("Shared memory frames retried: %llu\n", (unsigned long long)shm.torn);
     printf("Bye Bye :)\n");
 
 	// free all allocated ressources
 err:
-	if (sock > -1)
-		close(sock);
+	pipeline_stop(&pl);
+	metrics_close(&metrics);
+	if (rec.file != NULL)
+		printf("Recorded %u frames\n", rec.header.frame_count);
+	if (record_close(&rec) < 0)
+		errorcode = -1;
+	for (int p = 0; p < port_count; p++)
+		tx_close(&tx[p]);
 
 	if (framebuffer)
 		munmap(framebuffer, framesize);
+	ledshm_shutdown(&shm);
+	layers_close(&layers);
 
 	if (fb > -1)
 		close(fb);	
 
+	calib_free(cal);
+	layout_free(layout);
+	compose_free(&ctx);
+
 	return errorcode;
 }
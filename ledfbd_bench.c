@@ -0,0 +1,547 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "calib.h"
+#include "compose.h"
+#include "encode.h"
+#include "layout.h"
+#include "pipeline.h"
+#include "tx.h"
+#include "utils.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Default number of frames per case. */
+#define BENCH_FRAMES		400
+
+/** Simulated frame rate, drives the keepalive of unchanged chunks. */
+#define BENCH_FRAME_RATE	40
+
+/** Default walls, columns x rows of 128x32 panels. */
+#define BENCH_GRIDS			"1x1,1x3,2x3,4x4"
+
+/** Distinct frames generated per pattern, played in a loop. */
+#define BENCH_PATTERN_FRAMES	32
+
+/** Synthetic content. */
+#define PATTERN_STATIC		0
+#define PATTERN_NOISE		1
+#define PATTERN_SCROLL		2
+#define PATTERN_VIDEO		3
+#define PATTERN_COUNT		4
+
+/** Edge of the moving block of the video pattern. */
+#define VIDEO_BLOCK_SIZE	24
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * A wall and framebuffer format the patterns are run against.
+ */
+struct bench_case
+{
+	const char *name;
+	struct layout *layout;
+	uint32_t xres;
+	uint32_t yres;
+	uint32_t bpp;
+};
+
+/**
+ * Results of a pattern on a case.
+ */
+struct bench_result
+{
+	uint64_t elapsed_ns;
+	uint64_t packets;
+	uint64_t bytes_copied;
+	int64_t cache_misses;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  options
+// ----------------------------------------------------------------------------------
+static struct option long_options[] =
+{
+        {"layout", required_argument, NULL, 'l'},
+        {"grids", required_argument, NULL, 'g'},
+        {"patterns", required_argument, NULL, 'p'},
+        {"frames", required_argument, NULL, 'n'},
+        {"bpp", required_argument, NULL, 'b'},
+        {"mtu", required_argument, NULL, 'M'},
+        {"calib", required_argument, NULL, 'c'},
+        {"keepalive", required_argument, NULL, 'k'},
+        {"encoder", required_argument, NULL, 'e'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"multi-chunk", no_argument, NULL, 'u'},
+        {"dither", no_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+};
+
+static const char *pattern_names[PATTERN_COUNT] =
+{
+	"static", "noise", "scroll", "video",
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/** Payload bytes composed since the counter was last reset. */
+static uint64_t composed_bytes = 0;
+
+
+// ----------------------------------------------------------------------------------
+//  pipeline stages
+// ----------------------------------------------------------------------------------
+
+static void bench_compose(void *ctx, struct pipeline_frame *frame, unsigned int panel)
+{
+	compose_pipeline_ops.compose(ctx, frame, panel);
+}
+
+/**
+ * Counts the composed payload before it is packed into packets.
+ */
+static void bench_send(void *ctx, struct pipeline_frame *frame, unsigned int shard)
+{
+	struct compose *c = ctx;
+
+	for (unsigned int i = 0; i < c->layout->chunk_count; i++)
+		composed_bytes += frame->lens[i];
+
+	compose_pipeline_ops.send(ctx, frame, shard);
+}
+
+static void bench_sent(void *ctx, struct pipeline_frame *frame)
+{
+	compose_pipeline_ops.sent(ctx, frame);
+}
+
+static const struct pipeline_ops bench_ops =
+{
+	.compose = bench_compose,
+	.send = bench_send,
+	.sent = bench_sent,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Opens a counter of the cache misses of this process and all threads
+ * started afterwards. Returns -1 if the kernel does not allow it.
+ */
+static int perf_open_cache_misses(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Stores a pixel in the framebuffer format.
+ */
+static void put_pixel(uint8_t *dst, uint32_t bpp, uint8_t r, uint8_t g, uint8_t b)
+{
+	switch (bpp)
+	{
+		case ENCODE_BPP_RGB565:
+		{
+			uint16_t v = (uint16_t)((r >> 3) << 11 | (g >> 2) << 5 | (b >> 3));
+			memcpy(dst, &v, sizeof(v));
+			break;
+		}
+		case ENCODE_BPP_RGB16:
+		{
+			uint16_t v[3] = { b * 257, g * 257, r * 257 };
+			memcpy(dst, v, sizeof(v));
+			break;
+		}
+		default:
+			dst[0] = b;
+			dst[1] = g;
+			dst[2] = r;
+			if (bpp == ENCODE_BPP_XRGB8888)
+				dst[3] = 0;
+			break;
+	}
+}
+
+/**
+ * Renders the frames of a pattern, one page of line_length * yres each.
+ */
+static void render_pattern(uint8_t *pages, const struct bench_case *bc, int pattern,
+	unsigned int frames)
+{
+	uint32_t line_length = bc->xres * bc->bpp;
+	unsigned int seed = 1;
+
+	for (unsigned int f = 0; f < frames; f++)
+	{
+		uint8_t *page = pages + (size_t)f * line_length * bc->yres;
+		uint32_t bx = (f * 4) % (bc->xres > VIDEO_BLOCK_SIZE ? bc->xres - VIDEO_BLOCK_SIZE : 1);
+		uint32_t by = (f * 2) % (bc->yres > VIDEO_BLOCK_SIZE ? bc->yres - VIDEO_BLOCK_SIZE : 1);
+
+		for (uint32_t y = 0; y < bc->yres; y++)
+		{
+			for (uint32_t x = 0; x < bc->xres; x++)
+			{
+				uint8_t *px = page + y * line_length + x * bc->bpp;
+				uint32_t u = (pattern == PATTERN_SCROLL) ? x + f : x;
+
+				// smooth gradient background of all patterns
+				uint8_t r = (uint8_t)(u * 7), g = (uint8_t)(y * 5), b = (uint8_t)((u + y) * 3);
+
+				if (pattern == PATTERN_NOISE)
+				{
+					r = (uint8_t)rand_r(&seed);
+					g = (uint8_t)rand_r(&seed);
+					b = (uint8_t)rand_r(&seed);
+				}
+				else if (pattern == PATTERN_VIDEO && x - bx < VIDEO_BLOCK_SIZE && y - by < VIDEO_BLOCK_SIZE)
+				{
+					r = 255;
+					g = (uint8_t)(f * 8);
+					b = 0;
+				}
+
+				put_pixel(px, bc->bpp, r, g, b);
+			}
+		}
+	}
+}
+
+/**
+ * Runs a pattern through the whole compose and transmit pipeline.
+ */
+static int run_pattern(const struct bench_case *bc, struct compose *c, int pattern,
+	unsigned int frames, unsigned int workers, struct bench_result *res)
+{
+	size_t page_size = (size_t)bc->xres * bc->bpp * bc->yres;
+	unsigned int pattern_frames = (pattern == PATTERN_STATIC) ? 1 : BENCH_PATTERN_FRAMES;
+	struct compose_frame infos[PIPELINE_FRAMES] = { { 0 } };
+	struct pipeline pl = { 0 };
+	uint64_t packets = c->tx->packets_sent;
+	uint8_t *pages;
+	int perf;
+
+	pages = malloc(page_size * pattern_frames);
+	if (pages == NULL)
+	{
+		perror("malloc");
+		return -1;
+	}
+	render_pattern(pages, bc, pattern, pattern_frames);
+
+	// every case starts with all chunks unsent, like the daemon
+	compose_invalidate(c);
+	composed_bytes = 0;
+
+	perf = perf_open_cache_misses();
+	if (perf >= 0)
+		ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+
+	if (pipeline_start(&pl, &bench_ops, c, bc->layout->panel_count, bc->layout->chunk_count,
+		c->slot_size, page_size, workers, NULL, 0, 1, NULL) < 0)
+	{
+		if (perf >= 0)
+			close(perf);
+		free(pages);
+		return -1;
+	}
+	for (int f = 0; f < PIPELINE_FRAMES; f++)
+		pl.frames[f].priv = &infos[f];
+
+	uint64_t start = clock_ns();
+	for (unsigned int f = 0; f < frames; f++)
+	{
+		struct pipeline_frame *frame = pipeline_frame(&pl);
+
+		// simulated capture time, the keepalive behaves like at the frame rate
+		frame->start = 1 + (uint64_t)f * 1000000 / BENCH_FRAME_RATE;
+		memcpy(frame->snapshot, pages + (f % pattern_frames) * page_size, page_size);
+
+		pipeline_compose(&pl);
+		pipeline_send(&pl);
+	}
+	pipeline_drain(&pl);
+	res->elapsed_ns = clock_ns() - start;
+
+	// inherited counts are added when the threads exit
+	pipeline_stop(&pl);
+	res->cache_misses = -1;
+	if (perf >= 0)
+	{
+		int64_t count;
+
+		ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf, &count, sizeof(count)) == sizeof(count))
+			res->cache_misses = count;
+		close(perf);
+	}
+
+	res->packets = c->tx->packets_sent - packets;
+	// the snapshot, the composed payload and its copy into the packets
+	res->bytes_copied = (uint64_t)frames * page_size + 2 * composed_bytes;
+
+	free(pages);
+	return 0;
+}
+
+/**
+ * Runs all selected patterns on a wall.
+ */
+static int run_case(struct bench_case *bc, const struct encode_ops *encoder, const char *calib_path,
+	const char *mtu, uint64_t keepalive, bool dither, const bool *patterns,
+	unsigned int frames, unsigned int workers)
+{
+	unsigned int depth = (bc->bpp == ENCODE_BPP_RGB16) ? CALIB_DEPTH_HD : CALIB_DEPTH_SD;
+	struct compose c = { 0 };
+	struct tx tx = { .fd = -1 };
+	struct calib *cal = NULL;
+	int ret = -1;
+
+	layout_size(bc->layout, &bc->xres, &bc->yres);
+	if (layout_compile(bc->layout, bc->xres, bc->yres, bc->xres * bc->bpp, bc->bpp, false, false) < 0)
+		return -1;
+
+	cal = calib_load(calib_path, bc->layout->panel_count, depth, 2);
+	if (cal == NULL)
+		goto err;
+
+	if (tx_open(&tx, &tx_null_ops, mtu, bc->layout->chunk_count) < 0)
+		goto err;
+
+	c.layout = bc->layout;
+	c.cal = cal;
+	c.encoder = encoder;
+	c.tx = &tx;
+	c.line_length = bc->xres * bc->bpp;
+	c.bpp = bc->bpp;
+	c.keepalive = keepalive;
+	c.known_format = true;
+	c.dither = dither || (bc->bpp == ENCODE_BPP_RGB16);
+	if (compose_init(&c) < 0)
+		goto err;
+
+	for (int p = 0; p < PATTERN_COUNT; p++)
+	{
+		struct bench_result res;
+		double seconds;
+		char misses[32];
+
+		if (!patterns[p])
+			continue;
+
+		if (run_pattern(bc, &c, p, frames, workers, &res) < 0)
+			goto err;
+
+		seconds = res.elapsed_ns / 1e9;
+		if (res.cache_misses >= 0)
+			snprintf(misses, sizeof(misses), "%.0f", (double)res.cache_misses / frames);
+		else
+			snprintf(misses, sizeof(misses), "-");
+
+		printf("%-8s %4ux%-4u %6u  %-7s %11.0f %11.0f %12.0f %12s\n",
+			bc->name, bc->xres, bc->yres, bc->layout->panel_count, pattern_names[p],
+			(double)res.elapsed_ns / frames, res.packets / seconds,
+			(double)res.bytes_copied / frames, misses);
+	}
+	ret = 0;
+
+err:
+	compose_free(&c);
+	tx_close(&tx);
+	calib_free(cal);
+	return ret;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  entry point
+// ----------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	const char *layout_path = NULL;
+	char grids_default[] = BENCH_GRIDS;
+	char *grids = grids_default;
+	bool patterns[PATTERN_COUNT] = { true, true, true, true };
+	unsigned int frames = BENCH_FRAMES;
+	uint32_t bpp = ENCODE_BPP;
+	const char *mtu = "9000";
+	const char *calib_path = NULL;
+	uint64_t keepalive = 1000 * 1000;
+	const char *encoder_name = NULL;
+	const struct encode_ops *encoder;
+	unsigned int workers = 1;
+	bool multi_chunk = false;
+	bool dither = false;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "l:g:p:n:b:M:c:k:e:j:ud", long_options, NULL)) != -1)
+	{
+		switch (ch)
+		{
+			case 'l':
+				layout_path = optarg;
+				break;
+			case 'g':
+				grids = optarg;
+				break;
+			case 'p':
+				memset(patterns, 0, sizeof(patterns));
+				for (char *save = NULL, *tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+				{
+					int p;
+
+					for (p = 0; p < PATTERN_COUNT && strcmp(tok, pattern_names[p]) != 0; p++);
+					if (p == PATTERN_COUNT)
+					{
+						printf("unknown pattern: %s\n", tok);
+						return -1;
+					}
+					patterns[p] = true;
+				}
+				break;
+			case 'n':
+				frames = (unsigned int)atoi(optarg);
+				break;
+			case 'b':
+				bpp = (uint32_t)atoi(optarg) / 8;
+				if (bpp != ENCODE_BPP_RGB565 && bpp != ENCODE_BPP &&
+					bpp != ENCODE_BPP_XRGB8888 && bpp != ENCODE_BPP_RGB16)
+				{
+					printf("unsupported bits per pixel: %s\n", optarg);
+					return -1;
+				}
+				break;
+			case 'M':
+				mtu = optarg;
+				break;
+			case 'c':
+				calib_path = optarg;
+				break;
+			case 'k':
+				keepalive = strtoull(optarg, NULL, 10) * 1000;
+				break;
+			case 'e':
+				encoder_name = optarg;
+				break;
+			case 'j':
+				workers = (unsigned int)atoi(optarg);
+				break;
+			case 'u':
+				multi_chunk = true;
+				break;
+			case 'd':
+				dither = true;
+				break;
+			default:
+				printf("usage: ./ledfbd_bench [-l layout | -g colsxrows,...] [-p static|noise|scroll|video,...] "
+					"[-n frames] [-b 16|24|32|48] [-M mtu] [-c calib] [-k keepalive_ms] "
+					"[-e scalar|ssse3|avx2|neon] [-j workers] [-u] [-d]\n");
+				return -1;
+		}
+	}
+
+	if (frames == 0 || workers == 0)
+	{
+		printf("frames and workers must be positive\n");
+		return -1;
+	}
+
+	encoder = encode_select(encoder_name);
+	if (encoder == NULL)
+	{
+		printf("unknown pixel encoder: %s\n", encoder_name);
+		return -1;
+	}
+
+	printf("Pixel encoder: %s, %u bpp, mtu %s, %u frames, %u workers\n",
+		encoder->name, bpp * 8, mtu, frames, workers);
+	printf("%-8s %-9s %6s  %-7s %11s %11s %12s %12s\n", "wall", "fb", "panels", "pattern",
+		"ns/frame", "packets/s", "bytes/frame", "misses/frame");
+
+	// a single wall from a file or a sweep over grids of default panels
+	if (layout_path != NULL)
+	{
+		struct bench_case bc = { .name = "file", .bpp = bpp };
+		int ret;
+
+		bc.layout = layout_load(layout_path);
+		if (bc.layout == NULL)
+			return -1;
+
+		ret = run_case(&bc, encoder, calib_path, mtu, keepalive, dither, patterns, frames, workers);
+		layout_free(bc.layout);
+		return ret;
+	}
+
+	for (char *save = NULL, *tok = strtok_r(grids, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		struct bench_case bc = { .name = tok, .bpp = bpp };
+		unsigned int cols, rows;
+		int ret;
+
+		if (sscanf(tok, "%ux%u", &cols, &rows) != 2)
+		{
+			printf("invalid grid: %s\n", tok);
+			return -1;
+		}
+
+		bc.layout = layout_grid(cols, rows, multi_chunk);
+		if (bc.layout == NULL)
+			return -1;
+
+		ret = run_case(&bc, encoder, calib_path, mtu, keepalive, dither, patterns, frames, workers);
+		layout_free(bc.layout);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
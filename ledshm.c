@@ -0,0 +1,474 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ledshm.h"
+#include "utils.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Copies of a frame tried before giving up on a producer lapping the ring. */
+#define LEDSHM_READ_TRIES	4
+
+/** Time in milliseconds the handshake may block on a full socket buffer. */
+#define LEDSHM_SEND_MS		100
+
+/** Backlog of the listening socket. */
+#define LEDSHM_BACKLOG		4
+
+
+// ----------------------------------------------------------------------------------
+//  local functions
+// ----------------------------------------------------------------------------------
+
+static inline size_t ledshm_align(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+/**
+ * Passes the ring and the eventfd to a new producer, along with the
+ * size of the ring to map.
+ */
+static int ledshm_hello(struct ledshm_server *srv, int conn)
+{
+	uint64_t size = srv->size;
+	int fds[2] = { srv->memfd, srv->eventfd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct timeval timeout = { 0, LEDSHM_SEND_MS * 1000 };
+
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return (sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(size)) ? 0 : -1;
+}
+
+/**
+ * Attaches a connecting producer, unless another one is attached.
+ */
+static void ledshm_accept(struct ledshm_server *srv)
+{
+	int conn = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn < 0)
+		return;
+
+	if (srv->client_fd > -1)
+	{
+		printf("ledshm: refused a producer, another one is attached\n");
+		close(conn);
+		return;
+	}
+
+	if (ledshm_hello(srv, conn) < 0)
+	{
+		perror("ledshm: sendmsg");
+		close(conn);
+		return;
+	}
+
+	srv->client_fd = conn;
+	printf("ledshm: producer attached\n");
+}
+
+/**
+ * Detaches the producer once it closed its connection.
+ */
+static void ledshm_hangup(struct ledshm_server *srv)
+{
+	char byte;
+
+	// producers send nothing, anything readable but data is the end
+	if (recv(srv->client_fd, &byte, 1, MSG_DONTWAIT) > 0)
+		return;
+
+	close(srv->client_fd);
+	srv->client_fd = -1;
+	printf("ledshm: producer detached\n");
+}
+
+
+// ----------------------------------------------------------------------------------
+//  daemon side
+// ----------------------------------------------------------------------------------
+
+int ledshm_serve(struct ledshm_server *srv, const char *path, uint32_t width, uint32_t height, unsigned int slots)
+{
+	struct sockaddr_un addr;
+	size_t offset, slot_size;
+
+	*srv = (struct ledshm_server)LEDSHM_SERVER_INIT;
+
+	if (slots < 2 || slots > LEDSHM_MAX_SLOTS)
+	{
+		printf("ledshm: slots must be 2 ... %d\n", LEDSHM_MAX_SLOTS);
+		return -1;
+	}
+
+	// every slot starts on a page of its own
+	offset = ledshm_align(sizeof(struct ledshm_header));
+	slot_size = ledshm_align((size_t)width * height * LEDSHM_BPP);
+	srv->size = offset + slots * slot_size;
+	srv->height = height;
+	srv->stride = width * LEDSHM_BPP;
+	srv->slot_count = slots;
+	srv->slot_size = slot_size;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("ledshm: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	// the ring is sealed, a producer cannot shrink it under our feet
+	srv->memfd = memfd_create("ledfbd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (srv->memfd < 0)
+	{
+		perror("memfd_create");
+		return -1;
+	}
+	if (ftruncate(srv->memfd, srv->size) < 0 ||
+		fcntl(srv->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+	{
+		perror("ledshm: memfd");
+		return -1;
+	}
+
+	srv->header = mmap(NULL, srv->size, PROT_READ | PROT_WRITE, MAP_SHARED, srv->memfd, 0);
+	if (srv->header == MAP_FAILED)
+	{
+		srv->header = NULL;
+		perror("mmap");
+		return -1;
+	}
+
+	srv->data = (uint8_t*)srv->header + offset;
+	srv->header->width = width;
+	srv->header->height = height;
+	srv->header->stride = srv->stride;
+	srv->header->bpp = LEDSHM_BPP;
+	srv->header->slot_count = slots;
+	srv->header->slot_size = slot_size;
+	srv->header->data_offset = offset;
+	srv->header->version = LEDSHM_VERSION;
+	__atomic_store_n(&srv->header->magic, LEDSHM_MAGIC, __ATOMIC_RELEASE);
+
+	srv->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (srv->eventfd < 0)
+	{
+		perror("eventfd");
+		return -1;
+	}
+
+	if ((srv->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	// a stale socket of a previous instance is replaced
+	unlink(path);
+	if (bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0 ||
+		listen(srv->listen_fd, LEDSHM_BACKLOG) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	srv->socket_path = strdup(path);
+
+	return 0;
+}
+
+int ledshm_wait(struct ledshm_server *srv, int timeout_ms)
+{
+	uint64_t until = clock_us() + (uint64_t)timeout_ms * 1000;
+
+	for (;;)
+	{
+		struct pollfd pfds[3] = {
+			{ .fd = srv->eventfd, .events = POLLIN },
+			{ .fd = srv->listen_fd, .events = POLLIN },
+			{ .fd = srv->client_fd, .events = POLLIN },
+		};
+		uint64_t now, count;
+		int timeout;
+
+		// frames published since the last read, the wakeup may be pending
+		if (__atomic_load_n(&srv->header->published, __ATOMIC_ACQUIRE) != srv->consumed)
+		{
+			if (read(srv->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				perror("ledshm: read");
+			return 1;
+		}
+
+		// producers are attached even without waiting
+		now = clock_us();
+		timeout = (now < until) ? (until - now + 999) / 1000 : 0;
+		if (poll(pfds, (srv->client_fd > -1) ? 3 : 2, timeout) < 0)
+			return 0;
+
+		// a producer reconnecting has hung up before
+		if (srv->client_fd > -1 && pfds[2].revents)
+			ledshm_hangup(srv);
+		if (pfds[1].revents & POLLIN)
+			ledshm_accept(srv);
+		if (pfds[0].revents & POLLIN)
+		{
+			if (read(srv->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				perror("ledshm: read");
+		}
+
+		if (timeout == 0)
+			return __atomic_load_n(&srv->header->published, __ATOMIC_ACQUIRE) != srv->consumed;
+	}
+}
+
+int ledshm_read(struct ledshm_server *srv, uint8_t *dst)
+{
+	size_t len = (size_t)srv->height * srv->stride;
+
+	for (int tries = 0; tries < LEDSHM_READ_TRIES; tries++)
+	{
+		uint64_t published = __atomic_load_n(&srv->header->published, __ATOMIC_ACQUIRE);
+		uint32_t index, seq;
+
+		if (published == 0)
+		{
+			memset(dst, 0, len);
+			return 0;
+		}
+
+		// the producer writes the slot after the latest one, it only
+		// reaches ours again after filling all others
+		index = (published - 1) % srv->slot_count;
+		seq = __atomic_load_n(&srv->header->slots[index].seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) == 0)
+		{
+			memcpy(dst, srv->data + (size_t)index * srv->slot_size, len);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&srv->header->slots[index].seq, __ATOMIC_RELAXED) == seq)
+			{
+				srv->consumed = published;
+				return 0;
+			}
+		}
+		srv->torn++;
+	}
+
+	return -1;
+}
+
+void ledshm_shutdown(struct ledshm_server *srv)
+{
+	if (srv->client_fd > -1)
+		close(srv->client_fd);
+	srv->client_fd = -1;
+
+	if (srv->listen_fd > -1)
+		close(srv->listen_fd);
+	srv->listen_fd = -1;
+
+	if (srv->socket_path != NULL)
+		unlink(srv->socket_path);
+	free(srv->socket_path);
+	srv->socket_path = NULL;
+
+	if (srv->header != NULL)
+		munmap(srv->header, srv->size);
+	srv->header = NULL;
+
+	if (srv->eventfd > -1)
+		close(srv->eventfd);
+	srv->eventfd = -1;
+
+	if (srv->memfd > -1)
+		close(srv->memfd);
+	srv->memfd = -1;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  producer side
+// ----------------------------------------------------------------------------------
+
+struct ledshm *ledshm_connect(const char *path)
+{
+	struct ledshm *shm;
+	struct sockaddr_un addr;
+	uint64_t size = 0;
+	int fds[2] = { -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	shm = calloc(1, sizeof(struct ledshm));
+	if (shm == NULL)
+		return NULL;
+	shm->eventfd = -1;
+	shm->fd = -1;
+
+	shm->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (shm->fd < 0)
+		goto err;
+	if (connect(shm->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0)
+		goto err;
+
+	// the daemon answers with the ring and the eventfd, or hangs
+	// up if another producer is attached
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	len = recvmsg(shm->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len != sizeof(size))
+	{
+		if (len >= 0)
+			errno = EBUSY;
+		goto err;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+	{
+		errno = EPROTO;
+		goto err;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	shm->eventfd = fds[1];
+
+	shm->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (shm->header == MAP_FAILED)
+	{
+		shm->header = NULL;
+		goto err;
+	}
+	shm->size = size;
+
+	if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) != LEDSHM_MAGIC ||
+		shm->header->version != LEDSHM_VERSION)
+	{
+		errno = EPROTO;
+		goto err;
+	}
+	shm->width = shm->header->width;
+	shm->height = shm->header->height;
+	shm->stride = shm->header->stride;
+	shm->bpp = shm->header->bpp;
+
+	return shm;
+
+err:
+	ledshm_close(shm);
+	return NULL;
+}
+
+uint8_t *ledshm_begin(struct ledshm *shm)
+{
+	struct ledshm_header *h = shm->header;
+	uint32_t seq;
+
+	// a previous producer may have died with the slot odd
+	shm->frame = __atomic_load_n(&h->published, __ATOMIC_RELAXED);
+	shm->slot = &h->slots[shm->frame % h->slot_count];
+	seq = __atomic_load_n(&shm->slot->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->slot->seq, (seq + 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return (uint8_t*)h + h->data_offset + (size_t)(shm->frame % h->slot_count) * h->slot_size;
+}
+
+int ledshm_publish(struct ledshm *shm)
+{
+	struct pollfd pfd = { .fd = shm->fd, .events = POLLIN };
+	uint64_t one = 1;
+
+	shm->slot->pts = clock_ns();
+	__atomic_store_n(&shm->slot->seq, shm->slot->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->header->published, shm->frame + 1, __ATOMIC_RELEASE);
+
+	// a full counter still wakes the daemon
+	if (write(shm->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+
+	// the daemon closes the connection when it exits
+	if (poll(&pfd, 1, 0) > 0)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+
+	return 0;
+}
+
+void ledshm_close(struct ledshm *shm)
+{
+	if (shm == NULL)
+		return;
+
+	if (shm->header != NULL)
+		munmap(shm->header, shm->size);
+	if (shm->eventfd > -1)
+		close(shm->eventfd);
+	if (shm->fd > -1)
+		close(shm->fd);
+	free(shm);
+}
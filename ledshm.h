@@ -0,0 +1,215 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LEDSHM_H_
+#define _LEDSHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Identifies a frame ring, "LSHM", and the version of its layout. */
+#define LEDSHM_MAGIC		0x4d48534c
+#define LEDSHM_VERSION		1
+
+/** Frame slots of a ring, by default and at most. */
+#define LEDSHM_SLOTS		3
+#define LEDSHM_MAX_SLOTS	8
+
+/** Bytes per pixel of a ring, B, G, R and an unused byte like a 32bpp framebuffer. */
+#define LEDSHM_BPP			4
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Sequence of a frame slot.
+ */
+struct ledshm_slot
+{
+	/** Odd while the producer writes the slot, incremented before and after. */
+	uint32_t seq;
+	uint32_t reserved;
+
+	/** CLOCK_MONOTONIC time in nanoseconds the frame was published. */
+	uint64_t pts;
+};
+
+/**
+ * Start of the shared memory of a ring, followed by the slots. The
+ * producer writes frame n into slot n % slot_count and publishes it by
+ * storing n + 1 to published, the daemon copies the latest slot and
+ * retries if its sequence changed meanwhile. Neither side ever waits
+ * for the other.
+ */
+struct ledshm_header
+{
+	/** LEDSHM_MAGIC, LEDSHM_VERSION. */
+	uint32_t magic;
+	uint32_t version;
+
+	/** Size of a frame in pixels, bytes per line and bytes per pixel. */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t bpp;
+
+	/** Number of slots and the distance between two of them in bytes. */
+	uint32_t slot_count;
+	uint32_t slot_size;
+
+	/** Offset of the first slot from the start of the ring. */
+	uint64_t data_offset;
+
+	/** Frames published so far, the latest is in slot (published - 1) % slot_count. */
+	uint64_t published;
+
+	struct ledshm_slot slots[LEDSHM_MAX_SLOTS];
+};
+
+/**
+ * Daemon side of a ring. One producer is attached at a time, it gets
+ * the ring and the wakeup eventfd passed over the unix socket.
+ */
+struct ledshm_server
+{
+	struct ledshm_header *header;
+	size_t size;
+
+	/** The ring, the eventfd the producer signals, -1 if not open. */
+	int memfd;
+	int eventfd;
+
+	/** Listening socket and its path, connection of the attached producer. */
+	int listen_fd;
+	char *socket_path;
+	int client_fd;
+
+	/** Geometry of the ring, never read back from the shared memory. */
+	uint8_t *data;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t slot_count;
+	uint32_t slot_size;
+
+	/** Value of published at the last read. */
+	uint64_t consumed;
+
+	/** Reads retried since the producer overwrote the slot meanwhile. */
+	uint64_t torn;
+};
+
+/** Initializer of a server that is not serving yet. */
+#define LEDSHM_SERVER_INIT	{ .memfd = -1, .eventfd = -1, .listen_fd = -1, .client_fd = -1 }
+
+/**
+ * Producer side of a ring.
+ */
+struct ledshm
+{
+	struct ledshm_header *header;
+	size_t size;
+
+	/** Eventfd waking up the daemon and the connection keeping us attached. */
+	int eventfd;
+	int fd;
+
+	/** Size of a frame in pixels, bytes per line and bytes per pixel. */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t bpp;
+
+	/** Frame being written, its slot. */
+	uint64_t frame;
+	struct ledshm_slot *slot;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Creates a ring of frames and accepts producers on a unix socket.
+ * @param srv server to initialize
+ * @param path path the socket is bound to
+ * @param width width of a frame in pixels
+ * @param height height of a frame in pixels
+ * @param slots number of frame slots, 2 ... LEDSHM_MAX_SLOTS
+ * @return 0 on success, -1 on error
+ */
+int ledshm_serve(struct ledshm_server *srv, const char *path, uint32_t width, uint32_t height, unsigned int slots);
+
+/**
+ * Waits for the producer to publish a frame, attaching and detaching
+ * producers meanwhile.
+ * @param srv server
+ * @param timeout_ms time to wait at most, 0 to only look
+ * @return 1 if a new frame was published, 0 on timeout or signal
+ */
+int ledshm_wait(struct ledshm_server *srv, int timeout_ms);
+
+/**
+ * Copies the latest frame, black before the first one was published.
+ * @param srv server
+ * @param dst height * stride bytes
+ * @return 0 on success, -1 if the producer kept overwriting the slot
+ */
+int ledshm_read(struct ledshm_server *srv, uint8_t *dst);
+
+/**
+ * Detaches the producer and removes the ring and the socket. Safe to
+ * call on a server initialized with LEDSHM_SERVER_INIT.
+ * @param srv server
+ */
+void ledshm_shutdown(struct ledshm_server *srv);
+
+/**
+ * Attaches a producer to the ring of a daemon.
+ * @param path socket of the daemon
+ * @return the ring or NULL on error
+ */
+struct ledshm *ledshm_connect(const char *path);
+
+/**
+ * Starts a frame. The slot is not read by the daemon until published.
+ * @param shm ring
+ * @return height lines of stride bytes to draw into
+ */
+uint8_t *ledshm_begin(struct ledshm *shm);
+
+/**
+ * Publishes the frame started last and wakes up the daemon.
+ * @param shm ring
+ * @return 0 on success, -1 if the daemon is gone
+ */
+int ledshm_publish(struct ledshm *shm);
+
+/**
+ * Detaches from the ring.
+ * @param shm ring, may be NULL
+ */
+void ledshm_close(struct ledshm *shm);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Interval in milliseconds the server checks for shutdown. */
+#define METRICS_POLL_MS		200
+
+/** Time in milliseconds a client has to send its request. */
+#define METRICS_REQUEST_MS	100
+
+/** Backlog of the listening socket. */
+#define METRICS_BACKLOG		8
+
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/** Frame counters of the page. */
+static const struct
+{
+	const char *name;
+	const char *help;
+	size_t offset;
+}
+frame_counters[] =
+{
+	{ "ledfbd_frames_captured_total", "Frames captured from the framebuffer.",
+		offsetof(struct metrics_page, frames_captured) },
+	{ "ledfbd_frames_sent_total", "Frames handed to the transmit backend.",
+		offsetof(struct metrics_page, frames_sent) },
+	{ "ledfbd_frames_skipped_total", "Frame deadlines dropped after an overrun.",
+		offsetof(struct metrics_page, frames_skipped) },
+	{ "ledfbd_frames_late_total", "Frames sent more than a frame period after their capture.",
+		offsetof(struct metrics_page, frames_late) },
+};
+
+/** Names and descriptions of the stage histograms. */
+static const char *stage_names[METRICS_STAGES] =
+{
+	"ledfbd_capture_seconds",
+	"ledfbd_compose_seconds",
+	"ledfbd_send_seconds",
+	"ledfbd_frame_latency_seconds",
+};
+
+static const char *stage_help[METRICS_STAGES] =
+{
+	"Time to snapshot the front buffer.",
+	"Time to compose all panels of a frame.",
+	"Time to pack and transmit a frame.",
+	"Time from the capture of a frame until it was transmitted.",
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Answers a single client, with an http response if it sent a GET
+ * request and with the plain text otherwise.
+ */
+static void metrics_answer(struct metrics *m, int conn)
+{
+	struct pollfd pfd = { .fd = conn, .events = POLLIN };
+	char request[512];
+	bool http = false;
+	char *text = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0)
+	{
+		ssize_t n = recv(conn, request, sizeof(request) - 1, MSG_DONTWAIT);
+		http = (n >= 4 && memcmp(request, "GET ", 4) == 0);
+	}
+
+	// the client may be gone, compose first and never raise SIGPIPE
+	out = open_memstream(&text, &len);
+	if (out == NULL)
+		return;
+	if (http)
+		fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	metrics_write(m, out);
+	fclose(out);
+
+	for (size_t sent = 0; sent < len; )
+	{
+		ssize_t n = send(conn, text + sent, len - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+
+	free(text);
+}
+
+/**
+ * Writes a counter of every panel, labelled with the panel's address.
+ */
+static void metrics_write_panels(const struct metrics *m, FILE *out,
+	const char *name, const char *help, size_t offset)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+	for (unsigned int p = 0; p < m->page->panel_count; p++)
+	{
+		const uint64_t *counter = (const uint64_t *)((const uint8_t *)&m->page->panels[p] + offset);
+		const uint8_t *mac = m->layout->panels[p].mac;
+
+		fprintf(out, "%s{panel=\"%02x:%02x:%02x:%02x:%02x:%02x\"} %llu\n", name,
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], (unsigned long long)load(counter));
+	}
+}
+
+static void *metrics_server(void *arg)
+{
+	struct metrics *m = arg;
+
+	while (!m->stop)
+	{
+		struct pollfd pfd = { .fd = m->listen_fd, .events = POLLIN };
+		int conn;
+
+		if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+			continue;
+
+		conn = accept4(m->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0)
+			continue;
+
+		metrics_answer(m, conn);
+		close(conn);
+	}
+
+	return NULL;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+int metrics_open(struct metrics *m, const struct layout *layout, const char *shm_name)
+{
+	size_t size = sizeof(struct metrics_page) + layout->panel_count * sizeof(struct metrics_panel);
+
+	memset(m, 0, sizeof(struct metrics));
+	m->layout = layout;
+	m->listen_fd = -1;
+
+	if (shm_name != NULL)
+	{
+		int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+		{
+			perror(shm_name);
+			return -1;
+		}
+
+		if (ftruncate(fd, size) < 0)
+		{
+			perror("ftruncate");
+			close(fd);
+			return -1;
+		}
+
+		m->page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (m->page == MAP_FAILED)
+		{
+			m->page = NULL;
+			perror("mmap");
+			return -1;
+		}
+
+		// a previous instance may have left its counters behind
+		memset(m->page, 0, size);
+		m->shared = true;
+	}
+	else
+	{
+		m->page = calloc(1, size);
+		if (m->page == NULL)
+			return -1;
+	}
+
+	m->page->size = size;
+	m->page->panel_count = layout->panel_count;
+	m->page->version = METRICS_VERSION;
+	__atomic_store_n(&m->page->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int metrics_serve(struct metrics *m, const char *path)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("metrics: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((m->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	// a stale socket of a previous instance is replaced
+	unlink(path);
+	if (bind(m->listen_fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0 ||
+		listen(m->listen_fd, METRICS_BACKLOG) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+
+	m->socket_path = strdup(path);
+	err = pthread_create(&m->server, NULL, metrics_server, m);
+	if (err != 0)
+	{
+		printf("metrics: cannot start the server: %s\n", strerror(err));
+		return -1;
+	}
+	m->server_started = true;
+
+	return 0;
+}
+
+void metrics_close(struct metrics *m)
+{
+	if (m->page == NULL)
+		return;
+
+	if (m->server_started)
+	{
+		m->stop = true;
+		pthread_join(m->server, NULL);
+		m->server_started = false;
+	}
+
+	if (m->listen_fd > -1)
+		close(m->listen_fd);
+	m->listen_fd = -1;
+
+	if (m->socket_path != NULL)
+		unlink(m->socket_path);
+	free(m->socket_path);
+	m->socket_path = NULL;
+
+	if (m->page != NULL && m->shared)
+		munmap(m->page, m->page->size);
+	else
+		free(m->page);
+	m->page = NULL;
+}
+
+void metrics_write(const struct metrics *m, FILE *out)
+{
+	const struct metrics_page *page = m->page;
+
+	for (size_t i = 0; i < sizeof(frame_counters) / sizeof(frame_counters[0]); i++)
+	{
+		const uint64_t *counter = (const uint64_t *)((const uint8_t *)page + frame_counters[i].offset);
+
+		fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+			frame_counters[i].name, frame_counters[i].help, frame_counters[i].name,
+			frame_counters[i].name, (unsigned long long)load(counter));
+	}
+
+	fprintf(out, "# HELP ledfbd_frame_period_seconds Time between two frame deadlines.\n"
+		"# TYPE ledfbd_frame_period_seconds gauge\nledfbd_frame_period_seconds %g\n",
+		page->period_us / 1e6);
+
+	// buckets are stored on their own, the exposition format counts them up
+	for (int s = 0; s < METRICS_STAGES; s++)
+	{
+		const struct metrics_histogram *h = &page->stages[s];
+		uint64_t cumulative = 0;
+
+		fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", stage_names[s], stage_help[s], stage_names[s]);
+		for (int i = 0; i < METRICS_BUCKETS - 1; i++)
+		{
+			cumulative += load(&h->buckets[i]);
+			fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", stage_names[s],
+				(1ULL << i) / 1e6, (unsigned long long)cumulative);
+		}
+		cumulative += load(&h->buckets[METRICS_BUCKETS - 1]);
+		fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", stage_names[s], (unsigned long long)cumulative);
+		fprintf(out, "%s_sum %g\n%s_count %llu\n", stage_names[s], load(&h->sum_us) / 1e6,
+			stage_names[s], (unsigned long long)load(&h->count));
+	}
+
+	metrics_write_panels(m, out, "ledfbd_panel_packets_total", "Packets sent to a panel.",
+		offsetof(struct metrics_panel, packets));
+	metrics_write_panels(m, out, "ledfbd_panel_bytes_total",
+		"Bytes on the wire to a panel, including the ethernet header.",
+		offsetof(struct metrics_panel, bytes));
+	metrics_write_panels(m, out, "ledfbd_panel_send_errors_total", "Packets to a panel which failed to send.",
+		offsetof(struct metrics_panel, errors));
+}
+
+void metrics_observe(struct metrics_page *page, int stage, uint64_t us)
+{
+	struct metrics_histogram *h;
+	unsigned int bucket = 0;
+
+	if (page == NULL)
+		return;
+	h = &page->stages[stage];
+
+	// le is inclusive, 2^i us still belongs to bucket i
+	for (uint64_t v = (us > 0) ? us - 1 : 0; v > 0 && bucket < METRICS_BUCKETS - 1; v >>= 1)
+		bucket++;
+
+	metrics_add(&h->buckets[bucket], 1);
+	metrics_add(&h->sum_us, us);
+	metrics_add(&h->count, 1);
+}
@@ -0,0 +1,183 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "layout.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Identifies a stats page, "LEDS", and the version of its layout. */
+#define METRICS_MAGIC		0x5344454c
+#define METRICS_VERSION		1
+
+/** Histogram buckets, bucket i counts up to 2^i microseconds, the last one the rest. */
+#define METRICS_BUCKETS		20
+
+/** Timed stages of a frame. */
+#define METRICS_CAPTURE		0
+#define METRICS_COMPOSE		1
+#define METRICS_SEND		2
+#define METRICS_LATENCY		3
+#define METRICS_STAGES		4
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Distribution of a duration, with power of two buckets.
+ */
+struct metrics_histogram
+{
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+};
+
+/**
+ * Transmit counters of a panel.
+ */
+struct metrics_panel
+{
+	/** Packets and bytes including the ethernet header handed to the kernel. */
+	uint64_t packets;
+	uint64_t bytes;
+
+	/** Packets which failed to send. */
+	uint64_t errors;
+};
+
+/**
+ * All counters of the daemon. The page may be mapped by other processes,
+ * every field is only ever updated with a single atomic store or add, so
+ * readers need no lock but may see a histogram between two updates.
+ */
+struct metrics_page
+{
+	/** METRICS_MAGIC, METRICS_VERSION, the size of the page in bytes. */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t panel_count;
+
+	/** Frame period of the pacer in microseconds. */
+	uint64_t period_us;
+
+	/** Frames captured, sent, deadlines skipped and frames sent later than a period after capture. */
+	uint64_t frames_captured;
+	uint64_t frames_sent;
+	uint64_t frames_skipped;
+	uint64_t frames_late;
+
+	/** Duration of the stages of a frame, METRICS_CAPTURE ... METRICS_LATENCY. */
+	struct metrics_histogram stages[METRICS_STAGES];
+
+	/** Counters of every panel, panel_count entries. */
+	struct metrics_panel panels[];
+};
+
+/**
+ * Owner of the stats page and of the text endpoint.
+ */
+struct metrics
+{
+	struct metrics_page *page;
+
+	/** The page lives in a named shared memory object. */
+	bool shared;
+
+	/** Panel addresses for the labels of the endpoint. */
+	const struct layout *layout;
+
+	/** Listening socket of the endpoint and its path, -1 if not serving. */
+	int listen_fd;
+	char *socket_path;
+
+	/** Thread answering the requests. */
+	pthread_t server;
+	bool server_started;
+	volatile bool stop;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Allocates the stats page.
+ * @param m metrics to initialize
+ * @param layout layout of the wall, one set of counters per panel
+ * @param shm_name name of the shared memory object, NULL for private memory
+ * @return 0 on success, -1 on error
+ */
+int metrics_open(struct metrics *m, const struct layout *layout, const char *shm_name);
+
+/**
+ * Publishes the metrics in prometheus text format on a unix stream socket,
+ * answered from a thread of its own.
+ * @param m metrics
+ * @param path path the socket is bound to
+ * @return 0 on success, -1 on error
+ */
+int metrics_serve(struct metrics *m, const char *path);
+
+/**
+ * Stops the endpoint and releases the page. Safe to call on a zeroed
+ * struct.
+ * @param m metrics
+ */
+void metrics_close(struct metrics *m);
+
+/**
+ * Writes all metrics in prometheus text exposition format.
+ * @param m metrics
+ * @param out stream to write to
+ */
+void metrics_write(const struct metrics *m, FILE *out);
+
+/**
+ * Adds the duration of a stage to its histogram.
+ * @param page stats page, may be NULL
+ * @param stage METRICS_CAPTURE ... METRICS_LATENCY
+ * @param us duration in microseconds
+ */
+void metrics_observe(struct metrics_page *page, int stage, uint64_t us);
+
+/**
+ * Adds to a counter of the stats page.
+ * @param counter the counter
+ * @param n amount to add
+ */
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+#endif
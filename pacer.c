@@ -0,0 +1,138 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "pacer.h"
+#include "utils.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_USEC		1000ULL
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Adds the lateness of a frame release to the histogram.
+ */
+static void pacer_record(struct pacer *pacer, uint64_t lateness)
+{
+	uint64_t us = lateness / NSEC_PER_USEC;
+	unsigned int bucket = 0;
+
+	while (us > 0 && bucket < PACER_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+
+	pacer->histogram[bucket]++;
+	pacer->lateness_sum += lateness;
+	if (lateness > pacer->lateness_max)
+		pacer->lateness_max = lateness;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+void pacer_init(struct pacer *pacer, double fps, int policy)
+{
+	*pacer = (struct pacer) { 0 };
+	pacer->period = (uint64_t)(NSEC_PER_SEC / fps);
+	pacer->policy = policy;
+	pacer->deadline = clock_ns();
+}
+
+uint64_t pacer_wait(struct pacer *pacer)
+{
+	uint64_t now = clock_ns();
+	uint64_t lateness;
+
+	// handled signals interrupt the sleep, the frame is still
+	// released at its deadline and shutdown waits a period at most
+	if (now < pacer->deadline)
+	{
+		struct timespec ts =
+		{
+			.tv_sec = pacer->deadline / NSEC_PER_SEC,
+			.tv_nsec = pacer->deadline % NSEC_PER_SEC,
+		};
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		now = clock_ns();
+	}
+
+	lateness = (now > pacer->deadline) ? now - pacer->deadline : 0;
+	pacer_record(pacer, lateness);
+	pacer->frames++;
+
+	// an overrun either drops the missed deadlines or releases
+	// the frames back to back until the schedule is met again
+	pacer->deadline += pacer->period;
+	if (now >= pacer->deadline)
+	{
+		uint64_t missed = (now - pacer->deadline) / pacer->period + 1;
+
+		if (pacer->policy == PACER_SKIP || missed > PACER_MAX_BACKLOG)
+		{
+			pacer->deadline += missed * pacer->period;
+			pacer->skipped += missed;
+		}
+	}
+
+	return lateness;
+}
+
+unsigned int pacer_left_ms(const struct pacer *pacer)
+{
+	uint64_t now = clock_ns();
+
+	if (now >= pacer->deadline)
+		return 0;
+	return (pacer->deadline - now) / NSEC_PER_MSEC;
+}
+
+void pacer_report(const struct pacer *pacer, FILE *out)
+{
+	fprintf(out, "Frames: %llu, skipped deadlines: %llu, lateness mean: %llu us, max: %llu us\n",
+		(unsigned long long)pacer->frames, (unsigned long long)pacer->skipped,
+		(unsigned long long)(pacer->frames ? pacer->lateness_sum / pacer->frames / NSEC_PER_USEC : 0),
+		(unsigned long long)(pacer->lateness_max / NSEC_PER_USEC));
+
+	for (int i = 0; i < PACER_BUCKETS; i++)
+	{
+		if (pacer->histogram[i] == 0)
+			continue;
+
+		if (i == PACER_BUCKETS - 1)
+			fprintf(out, "  >= %8llu us: %llu\n", 1ULL << (i - 1), (unsigned long long)pacer->histogram[i]);
+		else
+			fprintf(out, "  <  %8llu us: %llu\n", 1ULL << i, (unsigned long long)pacer->histogram[i]);
+	}
+}
@@ -0,0 +1,103 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PACER_H_
+#define _PACER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** What happens to the deadlines of frames that were missed. */
+#define PACER_SKIP			0
+#define PACER_CATCHUP		1
+
+/** Catching up gives up if the schedule fell this many frames behind. */
+#define PACER_MAX_BACKLOG	8
+
+/** Lateness histogram buckets, bucket i counts less than 2^i microseconds. */
+#define PACER_BUCKETS		20
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Frame scheduler releasing frames at absolute deadlines on the
+ * monotonic clock, so sleeps never accumulate errors and overruns
+ * do not shift the cadence.
+ */
+struct pacer
+{
+	/** Time between two frames in nanoseconds. */
+	uint64_t period;
+
+	/** PACER_SKIP or PACER_CATCHUP. */
+	int policy;
+
+	/** Monotonic time of the next frame in nanoseconds. */
+	uint64_t deadline;
+
+	/** Frames released and deadlines dropped after an overrun. */
+	uint64_t frames;
+	uint64_t skipped;
+
+	/** Lateness of the frame releases. */
+	uint64_t histogram[PACER_BUCKETS];
+	uint64_t lateness_max;
+	uint64_t lateness_sum;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Initializes the scheduler, the first frame is due immediately.
+ * @param pacer scheduler to initialize
+ * @param fps frames per second
+ * @param policy PACER_SKIP or PACER_CATCHUP
+ */
+void pacer_init(struct pacer *pacer, double fps, int policy);
+
+/**
+ * Sleeps until the deadline of the next frame and schedules the one after it.
+ * @param pacer scheduler
+ * @return how late the frame was released in nanoseconds
+ */
+uint64_t pacer_wait(struct pacer *pacer);
+
+/**
+ * Returns the time left until the next deadline in milliseconds, rounded down.
+ * @param pacer scheduler
+ */
+unsigned int pacer_left_ms(const struct pacer *pacer);
+
+/**
+ * Prints the frame statistics and the lateness histogram.
+ * @param pacer scheduler
+ * @param out stream to print to
+ */
+void pacer_report(const struct pacer *pacer, FILE *out);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+
+#include "pipeline.h"
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Composes panels of the current frame until none are left.
+ * Called with the lock held.
+ */
+static void pipeline_compose_panels(struct pipeline *pl)
+{
+	while (pl->next_panel < pl->panel_count)
+	{
+		struct pipeline_frame *frame = pl->composing;
+		unsigned int panel = pl->next_panel++;
+
+		pthread_mutex_unlock(&pl->lock);
+		pl->ops->compose(pl->ctx, frame, panel);
+		pthread_mutex_lock(&pl->lock);
+	}
+}
+
+
+// ----------------------------------------------------------------------------------
+//  threads
+// ----------------------------------------------------------------------------------
+
+static void *pipeline_worker(void *arg)
+{
+	struct pipeline *pl = arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;)
+	{
+		while (!pl->stop && pl->generation == seen)
+			pthread_cond_wait(&pl->work_cond, &pl->lock);
+		if (pl->stop)
+			break;
+
+		seen = pl->generation;
+		pl->busy++;
+		pipeline_compose_panels(pl);
+		if (--pl->busy == 0)
+			pthread_cond_broadcast(&pl->done_cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void *pipeline_sender(void *arg)
+{
+	struct pipeline_sender *sender = arg;
+	struct pipeline *pl = sender->pl;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;)
+	{
+		struct pipeline_frame *frame;
+
+		// frames handed over before the stop are still sent
+		while (!pl->stop && pl->send_generation == seen)
+			pthread_cond_wait(&pl->send_cond, &pl->lock);
+		if (pl->send_generation == seen)
+			break;
+
+		seen = pl->send_generation;
+		frame = pl->sending;
+		pthread_mutex_unlock(&pl->lock);
+		pl->ops->send(pl->ctx, frame, sender->shard);
+		pthread_mutex_lock(&pl->lock);
+
+		// the last shard finishes the frame
+		if (--pl->send_pending > 0)
+			continue;
+
+		if (pl->ops->sent != NULL)
+		{
+			pthread_mutex_unlock(&pl->lock);
+			pl->ops->sent(pl->ctx, frame);
+			pthread_mutex_lock(&pl->lock);
+		}
+
+		pl->sending = NULL;
+		pthread_cond_broadcast(&pl->sent_cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+/**
+ * Starts a thread, pinned to a cpu unless it is negative.
+ */
+static int pipeline_thread(pthread_t *thread, int cpu, void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	int err;
+
+	pthread_attr_init(&attr);
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	err = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	return err;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+int pipeline_start(struct pipeline *pl, const struct pipeline_ops *ops, void *ctx,
+	unsigned int panel_count, unsigned int chunk_count, unsigned int payload_size,
+	size_t snapshot_size, unsigned int workers, const int *cpus, unsigned int cpu_count,
+	unsigned int shards, const int *shard_cpus)
+{
+	sigset_t all, old;
+	int err = 0;
+
+	memset(pl, 0, sizeof(struct pipeline));
+	pl->ops = ops;
+	pl->ctx = ctx;
+	pl->panel_count = panel_count;
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->work_cond, NULL);
+	pthread_cond_init(&pl->done_cond, NULL);
+	pthread_cond_init(&pl->send_cond, NULL);
+	pthread_cond_init(&pl->sent_cond, NULL);
+
+	for (int f = 0; f < PIPELINE_FRAMES; f++)
+	{
+		struct pipeline_frame *frame = &pl->frames[f];
+
+		frame->snapshot = malloc(snapshot_size);
+		frame->payload = malloc((size_t)chunk_count * payload_size);
+		frame->lens = calloc(chunk_count, sizeof(unsigned int));
+		if (frame->snapshot == NULL || frame->payload == NULL || frame->lens == NULL)
+		{
+			perror("malloc");
+			goto err;
+		}
+	}
+
+	pl->workers = calloc(workers, sizeof(pthread_t));
+	pl->senders = calloc(shards, sizeof(struct pipeline_sender));
+	if (pl->workers == NULL || pl->senders == NULL)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	// signals are handled by the capture thread only
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (unsigned int s = 0; s < shards && err == 0; s++)
+	{
+		struct pipeline_sender *sender = &pl->senders[s];
+
+		sender->pl = pl;
+		sender->shard = s;
+		err = pipeline_thread(&sender->thread, shard_cpus ? shard_cpus[s] : -1, pipeline_sender, sender);
+		if (err == 0)
+			pl->sender_count++;
+	}
+
+	for (unsigned int w = 0; w < workers && err == 0; w++)
+	{
+		err = pipeline_thread(&pl->workers[w], (cpus && cpu_count > 0) ? cpus[w % cpu_count] : -1,
+			pipeline_worker, pl);
+		if (err == 0)
+			pl->worker_count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0)
+	{
+		printf("pipeline: failed to start threads: %s\n", strerror(err));
+		goto err;
+	}
+
+	return 0;
+
+err:
+	pipeline_stop(pl);
+	return -1;
+}
+
+void pipeline_stop(struct pipeline *pl)
+{
+	if (pl->ops == NULL)
+		return;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = true;
+	pthread_cond_broadcast(&pl->work_cond);
+	pthread_cond_broadcast(&pl->send_cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	for (unsigned int w = 0; w < pl->worker_count; w++)
+		pthread_join(pl->workers[w], NULL);
+	for (unsigned int s = 0; s < pl->sender_count; s++)
+		pthread_join(pl->senders[s].thread, NULL);
+
+	for (int f = 0; f < PIPELINE_FRAMES; f++)
+	{
+		free(pl->frames[f].snapshot);
+		free(pl->frames[f].payload);
+		free(pl->frames[f].lens);
+	}
+	free(pl->workers);
+	free(pl->senders);
+
+	pthread_cond_destroy(&pl->work_cond);
+	pthread_cond_destroy(&pl->done_cond);
+	pthread_cond_destroy(&pl->send_cond);
+	pthread_cond_destroy(&pl->sent_cond);
+	pthread_mutex_destroy(&pl->lock);
+	pl->ops = NULL;
+}
+
+void pipeline_compose(struct pipeline *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->composing = pipeline_frame(pl);
+	pl->next_panel = 0;
+	pl->generation++;
+	pthread_cond_broadcast(&pl->work_cond);
+
+	while (pl->next_panel < pl->panel_count || pl->busy > 0)
+		pthread_cond_wait(&pl->done_cond, &pl->lock);
+	pl->composing = NULL;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+void pipeline_send(struct pipeline *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	while (pl->sending != NULL)
+		pthread_cond_wait(&pl->sent_cond, &pl->lock);
+
+	pl->sending = pipeline_frame(pl);
+	pl->send_pending = pl->sender_count;
+	pl->send_generation++;
+	pthread_cond_broadcast(&pl->send_cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	pl->current = (pl->current + 1) % PIPELINE_FRAMES;
+}
+
+void pipeline_drain(struct pipeline *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	while (pl->sending != NULL)
+		pthread_cond_wait(&pl->sent_cond, &pl->lock);
+	pthread_mutex_unlock(&pl->lock);
+}
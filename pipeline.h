@@ -0,0 +1,199 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Number of frames in flight: one being composed, one being sent. */
+#define PIPELINE_FRAMES		2
+
+/** Maximum number of cpus the workers can be pinned to. */
+#define PIPELINE_MAX_CPUS	64
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * A frame travelling through the pipeline. The capture stage fills in the
+ * snapshot, the workers compose the payload of every chunk and the sender
+ * transmits them.
+ */
+struct pipeline_frame
+{
+	/** Time in microseconds the frame was captured. */
+	uint64_t start;
+
+	/** Copy of the front buffer the frame is composed from. */
+	uint8_t *snapshot;
+
+	/** Payload of every chunk, payload_size bytes apart. */
+	uint8_t *payload;
+
+	/** Payload length of every chunk, 0 if the chunk is not sent. */
+	unsigned int *lens;
+
+	/** Context of the stages, owned by the caller. */
+	void *priv;
+};
+
+/**
+ * Callbacks of the pipeline stages.
+ */
+struct pipeline_ops
+{
+	/** Composes all chunks of a panel, called from a worker thread. */
+	void (*compose)(void *ctx, struct pipeline_frame *frame, unsigned int panel);
+
+	/** Transmits the panels of a shard of a composed frame, called from the sender thread of the shard. */
+	void (*send)(void *ctx, struct pipeline_frame *frame, unsigned int shard);
+
+	/** Called once all shards of a frame are transmitted, from the last sender thread. May be NULL. */
+	void (*sent)(void *ctx, struct pipeline_frame *frame);
+};
+
+struct pipeline;
+
+/**
+ * Sender thread transmitting one shard of every frame.
+ */
+struct pipeline_sender
+{
+	struct pipeline *pl;
+	unsigned int shard;
+	pthread_t thread;
+};
+
+/**
+ * Compose and transmit pipeline. While the sender threads transmit a frame,
+ * one shard of panels each, the next one is captured and its panels are
+ * composed by a pool of workers.
+ */
+struct pipeline
+{
+	const struct pipeline_ops *ops;
+	void *ctx;
+
+	/** Frames in flight and the one currently captured into. */
+	struct pipeline_frame frames[PIPELINE_FRAMES];
+	unsigned int current;
+
+	/** Worker pool composing the panels. */
+	pthread_t *workers;
+	unsigned int worker_count;
+	unsigned int panel_count;
+
+	/** Sender threads, one per shard, sender_count of them are running. */
+	struct pipeline_sender *senders;
+	unsigned int sender_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_cond_t send_cond;
+	pthread_cond_t sent_cond;
+
+	/** Compose stage: frame being composed, next panel and busy workers. */
+	struct pipeline_frame *composing;
+	unsigned int generation;
+	unsigned int next_panel;
+	unsigned int busy;
+
+	/** Send stage: frame handed to the senders, NULL while they are idle. */
+	struct pipeline_frame *sending;
+	unsigned int send_generation;
+	unsigned int send_pending;
+
+	/** All threads shall exit. */
+	bool stop;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Allocates the frames and starts all threads.
+ * @param pl pipeline to start
+ * @param ops stage callbacks
+ * @param ctx context passed to the callbacks
+ * @param panel_count number of panels composed per frame
+ * @param chunk_count number of chunks per frame
+ * @param payload_size maximum payload size of a chunk
+ * @param snapshot_size size of the frame snapshot in bytes
+ * @param workers number of worker threads
+ * @param cpus cpus the workers are pinned to in turn, NULL for no pinning
+ * @param cpu_count number of entries in cpus
+ * @param shards number of sender threads, one per shard
+ * @param shard_cpus cpu the sender of every shard is pinned to, negative or
+ *        NULL for no pinning
+ * @return 0 on success, -1 on error
+ */
+int pipeline_start(struct pipeline *pl, const struct pipeline_ops *ops, void *ctx,
+	unsigned int panel_count, unsigned int chunk_count, unsigned int payload_size,
+	size_t snapshot_size, unsigned int workers, const int *cpus, unsigned int cpu_count,
+	unsigned int shards, const int *shard_cpus);
+
+/**
+ * Stops all threads and releases the frames. Safe to call on a
+ * zeroed pipeline.
+ * @param pl pipeline to stop
+ */
+void pipeline_stop(struct pipeline *pl);
+
+/**
+ * Returns the frame the next capture goes into. It is neither
+ * composed nor sent at the moment.
+ * @param pl pipeline
+ */
+static inline struct pipeline_frame *pipeline_frame(struct pipeline *pl)
+{
+	return &pl->frames[pl->current];
+}
+
+/**
+ * Composes all panels of the captured frame on the worker pool
+ * and waits until they are done.
+ * @param pl pipeline
+ */
+void pipeline_compose(struct pipeline *pl);
+
+/**
+ * Hands the composed frame to the sender threads, after they finished the
+ * previous one, and moves on to the next frame.
+ * @param pl pipeline
+ */
+void pipeline_send(struct pipeline *pl);
+
+/**
+ * Waits until the sender threads transmitted all frames handed to them.
+ * @param pl pipeline
+ */
+void pipeline_drain(struct pipeline *pl);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "record.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Initial number of entries of the frame index, it grows by doubling. */
+#define RECORD_INDEX_SIZE	1024
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+int record_open(struct record *rec, const char *path, const struct layout *layout)
+{
+	memset(rec, 0, sizeof(struct record));
+
+	rec->file = fopen(path, "wb");
+	if (rec->file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	rec->capacity = RECORD_INDEX_SIZE;
+	rec->frames = malloc(rec->capacity * sizeof(struct record_frame));
+	if (rec->frames == NULL)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	// the header is written again with the index once the recording ends
+	rec->header.magic = RECORD_MAGIC;
+	rec->header.version = RECORD_VERSION;
+	rec->header.panel_count = layout->panel_count;
+	if (fwrite(&rec->header, sizeof(struct record_header), 1, rec->file) != 1)
+		goto err_write;
+
+	for (unsigned int p = 0; p < layout->panel_count; p++)
+	{
+		struct record_panel panel = { 0 };
+
+		memcpy(panel.mac, layout->panels[p].mac, 6);
+		if (fwrite(&panel, sizeof(struct record_panel), 1, rec->file) != 1)
+			goto err_write;
+	}
+
+	rec->offset = sizeof(struct record_header) + layout->panel_count * sizeof(struct record_panel);
+	rec->current.offset = rec->offset;
+
+	return 0;
+
+err_write:
+	perror(path);
+err:
+	fclose(rec->file);
+	free(rec->frames);
+	memset(rec, 0, sizeof(struct record));
+	return -1;
+}
+
+int record_packet(struct record *rec, unsigned int panel, const uint8_t *payload, size_t len)
+{
+	static const uint8_t padding[4];
+	struct record_packet packet = { .panel = (uint16_t)panel, .len = (uint16_t)len };
+	size_t size = sizeof(struct record_packet) + RECORD_ALIGN(len);
+
+	if (len > UINT16_MAX || rec->current.packets == UINT16_MAX)
+		return -1;
+
+	if (fwrite(&packet, sizeof(packet), 1, rec->file) != 1 ||
+		fwrite(payload, 1, len, rec->file) != len ||
+		fwrite(padding, 1, RECORD_ALIGN(len) - len, rec->file) != RECORD_ALIGN(len) - len)
+		return -1;
+
+	rec->current.packets++;
+	rec->current.size += size;
+	if (len > rec->current.max_len)
+		rec->current.max_len = (uint16_t)len;
+	rec->offset += size;
+
+	return 0;
+}
+
+int record_commit(struct record *rec, uint64_t time_us)
+{
+	if (rec->header.frame_count == rec->capacity)
+	{
+		struct record_frame *frames = realloc(rec->frames, 2 * rec->capacity * sizeof(struct record_frame));
+		if (frames == NULL)
+			return -1;
+
+		rec->frames = frames;
+		rec->capacity *= 2;
+	}
+
+	if (rec->header.frame_count == 0)
+		rec->first_us = time_us;
+	rec->last_us = time_us;
+
+	rec->current.time_us = time_us - rec->first_us;
+	rec->frames[rec->header.frame_count++] = rec->current;
+
+	memset(&rec->current, 0, sizeof(struct record_frame));
+	rec->current.offset = rec->offset;
+
+	return ferror(rec->file) ? -1 : 0;
+}
+
+int record_close(struct record *rec)
+{
+	static const uint8_t padding[8];
+	struct record_header *header = &rec->header;
+	size_t pad = (8 - rec->offset % 8) % 8;
+	int ret = 0;
+
+	if (rec->file == NULL)
+		return 0;
+
+	// a loop ends one mean frame period after the last frame
+	header->duration_us = rec->last_us - rec->first_us;
+	if (header->frame_count > 1)
+		header->duration_us += header->duration_us / (header->frame_count - 1);
+	header->index_offset = rec->offset + pad;
+
+	if (fwrite(padding, 1, pad, rec->file) != pad ||
+		fwrite(rec->frames, sizeof(struct record_frame), header->frame_count, rec->file) != header->frame_count ||
+		fseek(rec->file, 0, SEEK_SET) < 0 ||
+		fwrite(header, sizeof(struct record_header), 1, rec->file) != 1)
+	{
+		perror("record");
+		ret = -1;
+	}
+
+	if (fclose(rec->file) != 0)
+		ret = -1;
+	free(rec->frames);
+	memset(rec, 0, sizeof(struct record));
+
+	return ret;
+}
+
+int record_map(struct record_map *map, const char *path)
+{
+	const struct record_header *header;
+	struct stat st;
+	int fd;
+
+	memset(map, 0, sizeof(struct record_map));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror(path);
+		if (fd > -1)
+			close(fd);
+		return -1;
+	}
+
+	map->size = st.st_size;
+	map->data = (map->size >= sizeof(struct record_header)) ?
+		mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map->data == MAP_FAILED)
+	{
+		map->data = NULL;
+		printf("%s: not a recording\n", path);
+		return -1;
+	}
+
+	// the recording is streamed from start to end, over and over
+	madvise(map->data, map->size, MADV_SEQUENTIAL);
+
+	header = (const struct record_header *)map->data;
+	if (header->magic != RECORD_MAGIC || header->version != RECORD_VERSION ||
+		header->frame_count == 0 || header->index_offset % 8 != 0 ||
+		header->index_offset > map->size ||
+		(map->size - header->index_offset) / sizeof(struct record_frame) < header->frame_count ||
+		sizeof(struct record_header) + (uint64_t)header->panel_count * sizeof(struct record_panel) > header->index_offset)
+	{
+		printf("%s: not a complete recording\n", path);
+		goto err;
+	}
+
+	map->header = header;
+	map->panels = (const struct record_panel *)(header + 1);
+	map->frames = (const struct record_frame *)(map->data + header->index_offset);
+
+	// every packet has to lie within the file and address a known panel
+	for (unsigned int f = 0; f < header->frame_count; f++)
+	{
+		const struct record_frame *frame = &map->frames[f];
+		const struct record_packet *packet;
+		uint64_t end = frame->offset + frame->size;
+
+		if (frame->offset % 4 != 0 || end > header->index_offset)
+			goto corrupt;
+
+		packet = record_first(map, f);
+		for (unsigned int i = 0; i < frame->packets; i++, packet = record_next(packet))
+		{
+			if ((const uint8_t *)(packet + 1) > map->data + end ||
+				(const uint8_t *)record_next(packet) > map->data + end ||
+				packet->panel >= header->panel_count)
+				goto corrupt;
+
+			if (packet->len > map->max_len)
+				map->max_len = packet->len;
+		}
+
+		if (frame->packets > map->max_packets)
+			map->max_packets = frame->packets;
+	}
+
+	return 0;
+
+corrupt:
+	printf("%s: corrupt recording\n", path);
+err:
+	record_unmap(map);
+	return -1;
+}
+
+void record_unmap(struct record_map *map)
+{
+	if (map->data != NULL)
+		munmap(map->data, map->size);
+	memset(map, 0, sizeof(struct record_map));
+}
@@ -0,0 +1,210 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "layout.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Identifies a recording, "LEDR", and the version of its format. */
+#define RECORD_MAGIC		0x5244454c
+#define RECORD_VERSION		1
+
+/** Packets are padded to keep the next one aligned. */
+#define RECORD_ALIGN(len)	(((len) + 3) & ~(size_t)3)
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Start of a recording. It is followed by a record_panel per panel, the
+ * packets of all frames and the index of the frames at index_offset.
+ */
+struct record_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t panel_count;
+	uint32_t frame_count;
+
+	/** Offset of the frame index from the start of the file. */
+	uint64_t index_offset;
+
+	/** Time from the first frame to the end of the last one in microseconds. */
+	uint64_t duration_us;
+};
+
+/**
+ * A panel the packets are addressed to.
+ */
+struct record_panel
+{
+	uint8_t mac[6];
+	uint8_t reserved[2];
+};
+
+/**
+ * Entry of the frame index.
+ */
+struct record_frame
+{
+	/** Time the frame was captured, relative to the first one. */
+	uint64_t time_us;
+
+	/** Offset of the first packet from the start of the file and size of all packets. */
+	uint64_t offset;
+	uint32_t size;
+
+	/** Number of packets and the length of the largest one. */
+	uint16_t packets;
+	uint16_t max_len;
+};
+
+/**
+ * A packet of a frame, followed by len bytes of payload as sent after
+ * the ethernet header, padded with RECORD_ALIGN().
+ */
+struct record_packet
+{
+	uint16_t panel;
+	uint16_t len;
+};
+
+/**
+ * A recording being written.
+ */
+struct record
+{
+	FILE *file;
+	struct record_header header;
+
+	/** Index of all frames written so far. */
+	struct record_frame *frames;
+	unsigned int capacity;
+
+	/** The frame being written and the end of the file written so far. */
+	struct record_frame current;
+	uint64_t offset;
+
+	/** Capture time of the first and of the last frame. */
+	uint64_t first_us;
+	uint64_t last_us;
+};
+
+/**
+ * A recording mapped for playback.
+ */
+struct record_map
+{
+	uint8_t *data;
+	size_t size;
+
+	const struct record_header *header;
+	const struct record_panel *panels;
+	const struct record_frame *frames;
+
+	/** Most packets in a frame and the largest payload of all packets. */
+	unsigned int max_packets;
+	size_t max_len;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Creates a recording for the panels of a layout.
+ * @param rec recording to initialize
+ * @param path file to write
+ * @param layout layout of the wall
+ * @return 0 on success, -1 on error
+ */
+int record_open(struct record *rec, const char *path, const struct layout *layout);
+
+/**
+ * Appends a packet to the current frame.
+ * @param rec recording
+ * @param panel index of the panel in the layout
+ * @param payload the payload after the ethernet header
+ * @param len length of the payload
+ * @return 0 on success, -1 on error
+ */
+int record_packet(struct record *rec, unsigned int panel, const uint8_t *payload, size_t len);
+
+/**
+ * Finishes the current frame, even without packets to keep the timing.
+ * @param rec recording
+ * @param time_us monotonic time in microseconds the frame was captured at
+ * @return 0 on success, -1 on error
+ */
+int record_commit(struct record *rec, uint64_t time_us);
+
+/**
+ * Writes the frame index and closes the file. Safe to call on a
+ * zeroed struct.
+ * @param rec recording
+ * @return 0 on success, -1 on error
+ */
+int record_close(struct record *rec);
+
+/**
+ * Maps a recording and checks its index.
+ * @param map mapping to initialize
+ * @param path recording to map
+ * @return 0 on success, -1 on error
+ */
+int record_map(struct record_map *map, const char *path);
+
+/**
+ * Returns the first packet of a frame of a mapped recording.
+ * @param map mapping
+ * @param frame index of the frame
+ */
+static inline const struct record_packet *record_first(const struct record_map *map, unsigned int frame)
+{
+	return (const struct record_packet *)(map->data + map->frames[frame].offset);
+}
+
+/**
+ * Returns the packet following a packet of a mapped recording.
+ * @param packet a packet
+ */
+static inline const struct record_packet *record_next(const struct record_packet *packet)
+{
+	return (const struct record_packet *)((const uint8_t *)(packet + 1) + RECORD_ALIGN(packet->len));
+}
+
+/**
+ * Unmaps a recording. Safe to call on a zeroed struct.
+ * @param map mapping
+ */
+void record_unmap(struct record_map *map);
+
+#endif
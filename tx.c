@@ -0,0 +1,785 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "tx.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Magic number of a pcap file with nanosecond timestamps. */
+#define TX_PCAP_MAGIC		0xa1b23c4d
+
+/** Link type of ethernet frames in a pcap file. */
+#define TX_PCAP_LINKTYPE	1
+
+/** Number of packets written to a pcap file with one writev() call. */
+#define TX_PCAP_BATCH		64
+
+/** Send buffer of the veth backend, holds the packets of several frames. */
+#define TX_VETH_SNDBUF		(4 * 1024 * 1024)
+
+/** Delay in microseconds and number of retries when the veth peer is congested. */
+#define TX_VETH_BACKOFF		50
+#define TX_VETH_RETRIES		200
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Private data of the sendto and sendmmsg backends.
+ */
+struct tx_sock
+{
+	/** Packet buffers, capacity * packet_size bytes. */
+	uint8_t *buffers;
+
+	/** Message headers handed to sendmmsg(). */
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_ll *addrs;
+};
+
+/**
+ * Header of a pcap file.
+ */
+struct tx_pcap_header
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+/**
+ * Header of a packet record in a pcap file.
+ */
+struct tx_pcap_record
+{
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local variables
+// ----------------------------------------------------------------------------------
+
+/** All backends selectable by name. */
+static const struct tx_ops *tx_backends[] =
+{
+	&tx_mmsg_ops,
+	&tx_sendto_ops,
+	&tx_ring_ops,
+	&tx_uring_ops,
+	&tx_null_ops,
+	&tx_pcap_ops,
+	&tx_unix_ops,
+	&tx_veth_ops,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Splits the interface argument of a sink backend into the path and the
+ * optional mtu, "path[:mtu]". Without mtu the packets are sized for
+ * standard ethernet frames.
+ */
+static int tx_parse_sink(struct tx *tx, const char *arg, char *path, size_t size)
+{
+	const char *colon = strrchr(arg, ':');
+	size_t len = strlen(arg);
+
+	tx->ifindex = 0;
+	memset(tx->hwaddr, 0, ETH_ALEN);
+	tx->mtu = ETH_DATA_LEN;
+
+	if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1))
+	{
+		long mtu = strtol(colon + 1, NULL, 10);
+
+		if (mtu < ETH_ZLEN || mtu > TX_MAX_MTU)
+		{
+			printf("tx: invalid mtu: %s\n", colon + 1);
+			return -1;
+		}
+
+		tx->mtu = (int)mtu;
+		len = (size_t)(colon - arg);
+	}
+
+	if (len == 0 || len >= size)
+	{
+		printf("tx: invalid path: %s\n", arg);
+		return -1;
+	}
+
+	memcpy(path, arg, len);
+	path[len] = '\0';
+
+	return 0;
+}
+
+/**
+ * Writes all buffers, continuing after short writes.
+ */
+static int tx_write_all(int fd, struct iovec *iovs, int count)
+{
+	while (count > 0)
+	{
+		ssize_t ret = writev(fd, iovs, count);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		// skip over everything written, the rest of a partial buffer remains
+		while (count > 0 && (size_t)ret >= iovs->iov_len)
+		{
+			ret -= iovs->iov_len;
+			iovs++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iovs->iov_base = (uint8_t *)iovs->iov_base + ret;
+			iovs->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Opens the raw socket and looks up the interface to send on.
+ */
+static int tx_open_iface(struct tx *tx, const char *iface)
+{
+	struct ifreq ifr;
+
+	// Open RAW socket to send on
+	if ((tx->fd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	// Get the index of the interface to send on
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+	if (ioctl(tx->fd, SIOCGIFINDEX, &ifr) < 0)
+	{
+		perror("SIOCGIFINDEX");
+		return -1;
+	}
+	tx->ifindex = ifr.ifr_ifindex;
+
+	// Get the MAC address of the interface to send on
+	if (ioctl(tx->fd, SIOCGIFHWADDR, &ifr) < 0)
+	{
+		perror("SIOCGIFHWADDR");
+		return -1;
+	}
+	memcpy(tx->hwaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	// get the mtu of the sending interface
+	if (ioctl(tx->fd, SIOCGIFMTU, &ifr) < 0)
+	{
+		perror("SIOCGIFMTU");
+		return -1;
+	}
+	tx->mtu = ifr.ifr_mtu;
+
+	return 0;
+}
+
+
+// ----------------------------------------------------------------------------------
+//  socket backends
+// ----------------------------------------------------------------------------------
+
+static void tx_sock_close(struct tx *tx)
+{
+	struct tx_sock *sock = tx->priv;
+
+	if (sock == NULL)
+		return;
+
+	free(sock->buffers);
+	free(sock->msgs);
+	free(sock->iovs);
+	free(sock->addrs);
+	free(sock);
+	tx->priv = NULL;
+}
+
+static int tx_sock_open(struct tx *tx)
+{
+	struct tx_sock *sock;
+
+	sock = calloc(1, sizeof(struct tx_sock));
+	if (sock == NULL)
+		return -1;
+	tx->priv = sock;
+
+	// one buffer and message header per packet of a batch
+	sock->buffers = malloc((size_t)tx->capacity * tx->packet_size);
+	sock->msgs = calloc(tx->capacity, sizeof(struct mmsghdr));
+	sock->iovs = calloc(tx->capacity, sizeof(struct iovec));
+	sock->addrs = calloc(tx->capacity, sizeof(struct sockaddr_ll));
+	if (!sock->buffers || !sock->msgs || !sock->iovs || !sock->addrs)
+	{
+		tx_sock_close(tx);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < tx->capacity; i++)
+	{
+		sock->addrs[i].sll_family = AF_PACKET;
+		sock->addrs[i].sll_ifindex = tx->ifindex;
+		sock->addrs[i].sll_halen = ETH_ALEN;
+
+		sock->iovs[i].iov_base = sock->buffers + (size_t)i * tx->packet_size;
+		sock->msgs[i].msg_hdr.msg_name = &sock->addrs[i];
+		sock->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+		sock->msgs[i].msg_hdr.msg_iov = &sock->iovs[i];
+		sock->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return 0;
+}
+
+static uint8_t *tx_sock_slot(struct tx *tx)
+{
+	struct tx_sock *sock = tx->priv;
+
+	return sock->buffers + (size_t)tx->count * tx->packet_size;
+}
+
+static int tx_sendto_flush(struct tx *tx)
+{
+	struct tx_sock *sock = tx->priv;
+	int failed = 0;
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		struct ether_header *eh = (struct ether_header *)tx->packets[i];
+
+		memcpy(sock->addrs[i].sll_addr, eh->ether_dhost, ETH_ALEN);
+
+		tx->status[i] = 0;
+		if (sendto(tx->fd, tx->packets[i], tx->lens[i], 0,
+			(struct sockaddr*)&sock->addrs[i], sizeof(struct sockaddr_ll)) < 0)
+		{
+			tx->status[i] = -errno;
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static int tx_mmsg_flush(struct tx *tx)
+{
+	struct tx_sock *sock = tx->priv;
+	unsigned int sent = 0;
+	int failed = 0;
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		struct ether_header *eh = (struct ether_header *)tx->packets[i];
+
+		memcpy(sock->addrs[i].sll_addr, eh->ether_dhost, ETH_ALEN);
+		sock->iovs[i].iov_len = tx->lens[i];
+	}
+
+	while (sent < tx->count)
+	{
+		int ret = sendmmsg(tx->fd, sock->msgs + sent, tx->count - sent, 0);
+
+		// sendmmsg() stops at the first failing message and reports
+		// its error on the next call, skip over it and continue
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			tx->status[sent++] = -errno;
+			failed++;
+			continue;
+		}
+
+		for (int i = 0; i < ret; i++)
+			tx->status[sent++] = 0;
+	}
+
+	return failed;
+}
+
+const struct tx_ops tx_sendto_ops =
+{
+	.name = "sendto",
+	.open = tx_sock_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_sendto_flush,
+};
+
+const struct tx_ops tx_mmsg_ops =
+{
+	.name = "mmsg",
+	.open = tx_sock_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_mmsg_flush,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  veth backend
+// ----------------------------------------------------------------------------------
+
+static int tx_veth_open(struct tx *tx)
+{
+	struct sockaddr_ll addr;
+	int sndbuf = TX_VETH_SNDBUF;
+
+	if (tx_sock_open(tx) < 0)
+		return -1;
+
+	// only send on the interface, a veth peer delivers everything it gets,
+	// the protocol of the socket is kept so no packets are received
+	memset(&addr, 0, sizeof(struct sockaddr_ll));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = tx->ifindex;
+	if (bind(tx->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_ll)) < 0)
+	{
+		perror("bind");
+		tx_sock_close(tx);
+		return -1;
+	}
+
+	// a whole burst has to fit, the default buffer runs full at high rates
+	if (setsockopt(tx->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+		perror("SO_SNDBUF");
+
+	return 0;
+}
+
+static int tx_veth_flush(struct tx *tx)
+{
+	struct tx_sock *sock = tx->priv;
+	const struct timespec backoff = {0, TX_VETH_BACKOFF * 1000};
+	unsigned int sent = 0, retries = 0;
+	int failed = 0;
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		struct ether_header *eh = (struct ether_header *)tx->packets[i];
+
+		memcpy(sock->addrs[i].sll_addr, eh->ether_dhost, ETH_ALEN);
+		sock->iovs[i].iov_len = tx->lens[i];
+	}
+
+	while (sent < tx->count)
+	{
+		int ret = sendmmsg(tx->fd, sock->msgs + sent, tx->count - sent, 0);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// veth has no queue, the packet is dropped when the backlog of
+			// the peer is full, give the receiver some time to catch up
+			if (errno == ENOBUFS && retries++ < TX_VETH_RETRIES)
+			{
+				nanosleep(&backoff, NULL);
+				continue;
+			}
+
+			tx->status[sent++] = -errno;
+			retries = 0;
+			failed++;
+			continue;
+		}
+
+		for (int i = 0; i < ret; i++)
+			tx->status[sent++] = 0;
+		retries = 0;
+	}
+
+	return failed;
+}
+
+const struct tx_ops tx_veth_ops =
+{
+	.name = "veth",
+	.open = tx_veth_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_veth_flush,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  null backend
+// ----------------------------------------------------------------------------------
+
+static int tx_null_resolve(struct tx *tx, const char *iface)
+{
+	char *end;
+	long mtu = strtol(iface, &end, 10);
+
+	if (*end != '\0' || mtu < ETH_ZLEN)
+	{
+		printf("tx: invalid mtu for the null backend: %s\n", iface);
+		return -1;
+	}
+
+	tx->ifindex = 0;
+	memset(tx->hwaddr, 0, ETH_ALEN);
+	tx->mtu = (int)mtu;
+
+	return 0;
+}
+
+static int tx_null_flush(struct tx *tx)
+{
+	for (unsigned int i = 0; i < tx->count; i++)
+		tx->status[i] = 0;
+
+	return 0;
+}
+
+const struct tx_ops tx_null_ops =
+{
+	.name = "null",
+	.resolve = tx_null_resolve,
+	.open = tx_sock_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_null_flush,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  pcap backend
+// ----------------------------------------------------------------------------------
+
+static int tx_pcap_resolve(struct tx *tx, const char *iface)
+{
+	char path[PATH_MAX];
+	struct tx_pcap_header header;
+
+	if (tx_parse_sink(tx, iface, path, sizeof(path)) < 0)
+		return -1;
+
+	if ((tx->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	{
+		perror(path);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(struct tx_pcap_header));
+	header.magic = TX_PCAP_MAGIC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.snaplen = ETH_HLEN + tx->mtu;
+	header.linktype = TX_PCAP_LINKTYPE;
+	if (write(tx->fd, &header, sizeof(header)) != sizeof(header))
+	{
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tx_pcap_flush(struct tx *tx)
+{
+	struct tx_pcap_record records[TX_PCAP_BATCH];
+	struct iovec iovs[2 * TX_PCAP_BATCH];
+	struct timespec now;
+	int failed = 0;
+
+	// all packets of a batch are stamped with the time they were handed over
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	for (unsigned int first = 0; first < tx->count; first += TX_PCAP_BATCH)
+	{
+		unsigned int n = tx->count - first;
+		int err = 0;
+
+		if (n > TX_PCAP_BATCH)
+			n = TX_PCAP_BATCH;
+
+		for (unsigned int i = 0; i < n; i++)
+		{
+			records[i].ts_sec = (uint32_t)now.tv_sec;
+			records[i].ts_nsec = (uint32_t)now.tv_nsec;
+			records[i].incl_len = (uint32_t)tx->lens[first + i];
+			records[i].orig_len = (uint32_t)tx->lens[first + i];
+
+			iovs[2 * i].iov_base = &records[i];
+			iovs[2 * i].iov_len = sizeof(struct tx_pcap_record);
+			iovs[2 * i + 1].iov_base = tx->packets[first + i];
+			iovs[2 * i + 1].iov_len = tx->lens[first + i];
+		}
+
+		if (tx_write_all(tx->fd, iovs, 2 * n) < 0)
+			err = -errno;
+
+		for (unsigned int i = 0; i < n; i++)
+			tx->status[first + i] = err;
+		if (err < 0)
+			failed += n;
+	}
+
+	return failed;
+}
+
+const struct tx_ops tx_pcap_ops =
+{
+	.name = "pcap",
+	.resolve = tx_pcap_resolve,
+	.open = tx_sock_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_pcap_flush,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  unix backend
+// ----------------------------------------------------------------------------------
+
+static int tx_unix_resolve(struct tx *tx, const char *iface)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	if (tx_parse_sink(tx, iface, addr.sun_path, sizeof(addr.sun_path)) < 0)
+		return -1;
+
+	if ((tx->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(tx->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0)
+	{
+		perror(addr.sun_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tx_unix_open(struct tx *tx)
+{
+	struct tx_sock *sock;
+
+	if (tx_sock_open(tx) < 0)
+		return -1;
+
+	// the socket is connected to the receiver
+	sock = tx->priv;
+	for (unsigned int i = 0; i < tx->capacity; i++)
+	{
+		sock->msgs[i].msg_hdr.msg_name = NULL;
+		sock->msgs[i].msg_hdr.msg_namelen = 0;
+	}
+
+	return 0;
+}
+
+const struct tx_ops tx_unix_ops =
+{
+	.name = "unix",
+	.resolve = tx_unix_resolve,
+	.open = tx_unix_open,
+	.close = tx_sock_close,
+	.slot = tx_sock_slot,
+	.flush = tx_mmsg_flush,
+};
+
+
+// ----------------------------------------------------------------------------------
+//  public functions
+// ----------------------------------------------------------------------------------
+
+const struct tx_ops *tx_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(tx_backends) / sizeof(tx_backends[0]); i++)
+		if (strcmp(tx_backends[i]->name, name) == 0)
+			return tx_backends[i];
+
+	return NULL;
+}
+
+int tx_open(struct tx *tx, const struct tx_ops *ops, const char *iface, unsigned int capacity)
+{
+	memset(tx, 0, sizeof(struct tx));
+	tx->fd = -1;
+	tx->capacity = capacity;
+
+	if (ops->resolve != NULL)
+	{
+		if (ops->resolve(tx, iface) < 0)
+			goto err;
+	}
+	else if (tx_open_iface(tx, iface) < 0)
+	{
+		goto err;
+	}
+
+	// packets are sized for the mtu, larger ones would be dropped anyway
+	tx->payload_size = (tx->mtu < TX_MAX_MTU) ? tx->mtu : TX_MAX_MTU;
+	tx->packet_size = ETH_HLEN + tx->payload_size;
+
+	tx->packets = calloc(capacity, sizeof(uint8_t *));
+	tx->lens = calloc(capacity, sizeof(size_t));
+	tx->status = calloc(capacity, sizeof(int));
+	if (!tx->packets || !tx->lens || !tx->status)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	// setup the backend, the ring and io_uring fall back to plain sockets
+	if (ops->open(tx) < 0)
+	{
+		if ((ops != &tx_ring_ops && ops != &tx_uring_ops) || tx_mmsg_ops.open(tx) < 0)
+		{
+			printf("tx: failed to setup %s backend\n", ops->name);
+			goto err;
+		}
+
+		printf("tx: %s backend not available, falling back to %s\n",
+			ops->name, tx_mmsg_ops.name);
+		ops = &tx_mmsg_ops;
+	}
+	tx->ops = ops;
+
+	return 0;
+
+err:
+	tx_close(tx);
+	return -1;
+}
+
+void tx_close(struct tx *tx)
+{
+	if (tx->ops)
+		tx->ops->close(tx);
+	tx->ops = NULL;
+
+	if (tx->fd > -1)
+		close(tx->fd);
+	tx->fd = -1;
+
+	free(tx->packets);
+	free(tx->lens);
+	free(tx->status);
+	tx->packets = NULL;
+	tx->lens = NULL;
+	tx->status = NULL;
+}
+
+uint8_t *tx_packet(struct tx *tx, const uint8_t dst[6])
+{
+	struct ether_header *eh;
+
+	if (tx->count >= tx->capacity)
+		return NULL;
+
+	eh = (struct ether_header *)tx->ops->slot(tx);
+	if (eh == NULL)
+		return NULL;
+
+	// ethernet header
+	memcpy(eh->ether_dhost, dst, ETH_ALEN);
+	memcpy(eh->ether_shost, tx->hwaddr, ETH_ALEN);
+	eh->ether_type = htons(TX_ETHERTYPE);
+
+	tx->packets[tx->count] = (uint8_t *)eh;
+	tx->lens[tx->count] = sizeof(struct ether_header);
+	tx->count++;
+
+	return (uint8_t *)(eh + 1);
+}
+
+void tx_commit(struct tx *tx, size_t len)
+{
+	tx->lens[tx->count - 1] = sizeof(struct ether_header) + len;
+}
+
+int tx_flush(struct tx *tx)
+{
+	int failed = 0;
+
+	if (tx->count > 0 || tx->ops->flush_empty)
+		failed = tx->ops->flush(tx);
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		if (tx->status[i] < 0)
+			continue;
+		tx->packets_sent++;
+		tx->bytes_sent += tx->lens[i];
+	}
+	tx->count = 0;
+
+	return failed;
+}
@@ -0,0 +1,210 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TX_H_
+#define _TX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Largest mtu packets are sized for, jumbo frames of common nics. */
+#define TX_MAX_MTU			9216
+
+/** Ethertype of the packet. */
+#define TX_ETHERTYPE		0x0801
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+struct tx;
+
+/**
+ * A transmit backend. The backend owns the packet buffers, the generic
+ * part in tx.c fills in the ethernet header and tracks the batch.
+ */
+struct tx_ops
+{
+	/** Name of the backend as selected on the command line. */
+	const char *name;
+
+	/**
+	 * Fills in the ifindex, hardware address and mtu from the interface
+	 * argument of tx_open(). NULL for backends sending on a raw socket,
+	 * for them the network interface of this name is looked up.
+	 */
+	int (*resolve)(struct tx *tx, const char *iface);
+
+	/** Sets up the backend after the socket has been opened. */
+	int (*open)(struct tx *tx);
+
+	/** Releases all resources of the backend. */
+	void (*close)(struct tx *tx);
+
+	/** Returns the buffer for the next packet of the batch. */
+	uint8_t *(*slot)(struct tx *tx);
+
+	/** Sends all packets of the batch and fills in their status. */
+	int (*flush)(struct tx *tx);
+
+	/** flush is called for empty batches too, to complete the previous one. */
+	bool flush_empty;
+};
+
+/**
+ * Batched transmitter for raw ethernet packets. All packets of a frame
+ * are composed into their own buffer and handed to the kernel at once.
+ */
+struct tx
+{
+	/** Backend sending the packets. */
+	const struct tx_ops *ops;
+
+	/** Socket or file the packets are sent to. */
+	int fd;
+
+	/** Index, hardware address and mtu of the sending interface. */
+	int ifindex;
+	uint8_t hwaddr[6];
+	int mtu;
+
+	/** Maximum payload of a packet, the mtu capped to TX_MAX_MTU. */
+	size_t payload_size;
+
+	/** Size of a packet buffer, ethernet header and payload. */
+	size_t packet_size;
+
+	/** Maximum number of packets in one batch. */
+	unsigned int capacity;
+
+	/** Number of packets in the current batch. */
+	unsigned int count;
+
+	/** Start and length of each ethernet frame in the current batch. */
+	uint8_t **packets;
+	size_t *lens;
+
+	/** Result of each packet of the last flush, 0 or -errno. */
+	int *status;
+
+	/** Packets and bytes sent successfully since the transmitter was opened. */
+	uint64_t packets_sent;
+	uint64_t bytes_sent;
+
+	/**
+	 * Packets an asynchronous backend accepted, but failed to send once
+	 * they completed after their flush. They are counted as sent as well.
+	 */
+	uint64_t packets_dropped;
+
+	/** Private data of the backend. */
+	void *priv;
+};
+
+/** Available backends. */
+extern const struct tx_ops tx_sendto_ops;
+extern const struct tx_ops tx_mmsg_ops;
+extern const struct tx_ops tx_ring_ops;
+
+/**
+ * Submits every batch to an io_uring without waiting for it, the sends
+ * complete while the next frame is composed. Falls back to mmsg if the
+ * kernel does not support sending through io_uring.
+ */
+extern const struct tx_ops tx_uring_ops;
+
+/**
+ * Discards all packets, for benchmarks. The interface argument of
+ * tx_open() is the mtu the packets are sized for.
+ */
+extern const struct tx_ops tx_null_ops;
+
+/**
+ * Sinks capturing the exact wire output without a nic. The interface
+ * argument of tx_open() is "path[:mtu]", the pcap backend writes the
+ * packets to a pcap file at path, the unix backend sends each packet
+ * as a datagram to the AF_UNIX socket bound to path.
+ */
+extern const struct tx_ops tx_pcap_ops;
+extern const struct tx_ops tx_unix_ops;
+
+/**
+ * Sends on a veth pair like mmsg, but waits for a congested peer
+ * instead of dropping packets, for soak tests at full rate.
+ */
+extern const struct tx_ops tx_veth_ops;
+
+
+// ----------------------------------------------------------------------------------
+//  functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Looks up a transmit backend by its name.
+ * @param name name of the backend
+ * @return the backend or NULL if there is none with this name
+ */
+const struct tx_ops *tx_find(const char *name);
+
+/**
+ * Opens a raw socket on the interface, or resolves the interface argument
+ * through the backend, and sets up the backend.
+ * @param tx transmitter to initialize
+ * @param ops backend to send with
+ * @param iface name of the interface to send on, see tx_ops.resolve
+ * @param capacity maximum number of packets in one batch
+ * @return 0 on success, -1 on error
+ */
+int tx_open(struct tx *tx, const struct tx_ops *ops, const char *iface, unsigned int capacity);
+
+/**
+ * Closes the socket and frees all packet buffers.
+ * @param tx transmitter
+ */
+void tx_close(struct tx *tx);
+
+/**
+ * Appends a packet to the current batch.
+ * @param tx transmitter
+ * @param dst destination mac address
+ * @return pointer to the payload of the packet, NULL if the batch is full
+ */
+uint8_t *tx_packet(struct tx *tx, const uint8_t dst[6]);
+
+/**
+ * Sets the payload length of the packet last returned by tx_packet().
+ * @param tx transmitter
+ * @param len payload length in bytes
+ */
+void tx_commit(struct tx *tx, size_t len);
+
+/**
+ * Sends all packets of the current batch with as few syscalls as possible
+ * and starts a new batch. The result of every packet is stored in status.
+ * @param tx transmitter
+ * @return number of packets which failed to send
+ */
+int tx_flush(struct tx *tx);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "tx.h"
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Size of a block in the ring, a multiple of the page size. */
+#define TX_RING_BLOCK_SIZE	(64 * 1024)
+
+/** Offset of the packet data in a ring frame. */
+#define TX_RING_DATA_OFFSET	TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+/** Time in milliseconds to wait for a free ring frame. */
+#define TX_RING_TIMEOUT		100
+
+_Static_assert(TX_RING_DATA_OFFSET + ETH_HLEN + TX_MAX_MTU <= TX_RING_BLOCK_SIZE,
+	"packet does not fit into a ring block");
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Private data of the PACKET_TX_RING backend.
+ */
+struct tx_ring
+{
+	/** The ring mapped from the kernel. */
+	uint8_t *map;
+	size_t map_size;
+	size_t frame_size;
+	unsigned int frame_nr;
+	unsigned int frames_per_block;
+
+	/** Next frame to fill and first frame of the current batch. */
+	unsigned int head;
+	unsigned int first;
+
+	/** Address of the interface to send on. */
+	struct sockaddr_ll addr;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+/**
+ * Returns frame i of the ring. Frames do not cross blocks and the end of
+ * a block may be unused, so they are located the way the kernel does.
+ */
+static struct tpacket2_hdr *tx_ring_frame(struct tx_ring *ring, unsigned int i)
+{
+	i %= ring->frame_nr;
+	return (struct tpacket2_hdr *)(ring->map + (size_t)(i / ring->frames_per_block) * TX_RING_BLOCK_SIZE +
+		(i % ring->frames_per_block) * ring->frame_size);
+}
+
+static uint32_t tx_ring_status(struct tpacket2_hdr *hdr)
+{
+	return __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+}
+
+static void tx_ring_set_status(struct tpacket2_hdr *hdr, uint32_t status)
+{
+	__atomic_store_n(&hdr->tp_status, status, __ATOMIC_RELEASE);
+}
+
+
+// ----------------------------------------------------------------------------------
+//  backend
+// ----------------------------------------------------------------------------------
+
+static void tx_ring_close(struct tx *tx)
+{
+	struct tx_ring *ring = tx->priv;
+	struct tpacket_req req;
+
+	if (ring == NULL)
+		return;
+
+	if (ring->map)
+		munmap(ring->map, ring->map_size);
+
+	// release the ring so the socket can be used with sendto() again
+	memset(&req, 0, sizeof(req));
+	setsockopt(tx->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req));
+
+	free(ring);
+	tx->priv = NULL;
+}
+
+static int tx_ring_open(struct tx *tx)
+{
+	int version = TPACKET_V2;
+	int loss = 1;
+	unsigned int frames_per_block;
+	struct tpacket_req req;
+	struct tx_ring *ring;
+
+	ring = calloc(1, sizeof(struct tx_ring));
+	if (ring == NULL)
+		return -1;
+	tx->priv = ring;
+
+	if (setsockopt(tx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+	{
+		perror("PACKET_VERSION");
+		goto err;
+	}
+
+	// skip malformed frames instead of stalling the ring
+	if (setsockopt(tx->fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0)
+	{
+		perror("PACKET_LOSS");
+		goto err;
+	}
+
+	// room for two batches, the next frame can be composed
+	// while the kernel still holds on to the current one
+	ring->frame_size = TPACKET_ALIGN(TX_RING_DATA_OFFSET + tx->packet_size);
+	frames_per_block = TX_RING_BLOCK_SIZE / ring->frame_size;
+	req.tp_frame_size = ring->frame_size;
+	req.tp_block_size = TX_RING_BLOCK_SIZE;
+	req.tp_block_nr = (2 * tx->capacity + frames_per_block - 1) / frames_per_block;
+	req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+	if (setsockopt(tx->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+	{
+		perror("PACKET_TX_RING");
+		goto err;
+	}
+
+	ring->frame_nr = req.tp_frame_nr;
+	ring->frames_per_block = frames_per_block;
+	ring->map_size = (size_t)req.tp_block_nr * req.tp_block_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, tx->fd, 0);
+	if (ring->map == MAP_FAILED)
+	{
+		ring->map = NULL;
+		perror("mmap");
+		goto err;
+	}
+
+	// the destination is taken from the ethernet header of each frame
+	ring->addr.sll_family = AF_PACKET;
+	ring->addr.sll_protocol = htons(TX_ETHERTYPE);
+	ring->addr.sll_ifindex = tx->ifindex;
+	ring->addr.sll_halen = ETH_ALEN;
+
+	return 0;
+
+err:
+	tx_ring_close(tx);
+	return -1;
+}
+
+static uint8_t *tx_ring_slot(struct tx *tx)
+{
+	struct tx_ring *ring = tx->priv;
+	struct tpacket2_hdr *hdr;
+	struct pollfd pfd = { .fd = tx->fd, .events = POLLOUT };
+
+	if (tx->count == 0)
+		ring->first = ring->head;
+
+	// wait for the kernel to hand the frame back
+	hdr = tx_ring_frame(ring, ring->head);
+	while (tx_ring_status(hdr) != TP_STATUS_AVAILABLE)
+		if (poll(&pfd, 1, TX_RING_TIMEOUT) <= 0)
+			return NULL;
+
+	ring->head = (ring->head + 1) % ring->frame_nr;
+
+	return (uint8_t *)hdr + TX_RING_DATA_OFFSET;
+}
+
+static int tx_ring_flush(struct tx *tx)
+{
+	struct tx_ring *ring = tx->priv;
+	int ret, failed = 0;
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		struct tpacket2_hdr *hdr = tx_ring_frame(ring, ring->first + i);
+
+		// oversized frames are dropped by the kernel, see PACKET_LOSS
+		tx->status[i] = (tx->lens[i] > (size_t)tx->mtu + ETH_HLEN) ? -EMSGSIZE : 0;
+		hdr->tp_len = tx->lens[i];
+		tx_ring_set_status(hdr, TP_STATUS_SEND_REQUEST);
+	}
+
+	// a single blocking send() transmits all requested frames
+	do
+	{
+		ret = sendto(tx->fd, NULL, 0, 0,
+			(struct sockaddr *)&ring->addr, sizeof(struct sockaddr_ll));
+	} while (ret < 0 && errno == EINTR);
+
+	// the kernel stopped at the first frame it did not send, take all
+	// remaining frames back and continue the next batch at that frame
+	if (ret < 0)
+	{
+		int err = -errno;
+		int rewind = -1;
+
+		for (unsigned int i = 0; i < tx->count; i++)
+		{
+			struct tpacket2_hdr *hdr = tx_ring_frame(ring, ring->first + i);
+
+			if (tx_ring_status(hdr) != TP_STATUS_SEND_REQUEST)
+				continue;
+
+			if (rewind < 0)
+				rewind = i;
+			tx->status[i] = err;
+			tx_ring_set_status(hdr, TP_STATUS_AVAILABLE);
+		}
+
+		if (rewind >= 0)
+			ring->head = (ring->first + rewind) % ring->frame_nr;
+	}
+
+	for (unsigned int i = 0; i < tx->count; i++)
+		if (tx->status[i] < 0)
+			failed++;
+
+	return failed;
+}
+
+const struct tx_ops tx_ring_ops =
+{
+	.name = "ring",
+	.open = tx_ring_open,
+	.close = tx_ring_close,
+	.slot = tx_ring_slot,
+	.flush = tx_ring_flush,
+};
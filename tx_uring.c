@@ -0,0 +1,414 @@
+/*
+ * ledfbd - constructs ethernet packets for ledmatrix from a framebuffer
+ * Copyright (C) 2016 Maximilian Pachl
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/if_packet.h>
+#include <netinet/ether.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "tx.h"
+
+#ifdef __NR_io_uring_setup
+
+// ----------------------------------------------------------------------------------
+//  constants
+// ----------------------------------------------------------------------------------
+
+/** Maximum number of entries of a submission queue. */
+#define TX_URING_MAX_ENTRIES	32768
+
+
+// ----------------------------------------------------------------------------------
+//  types
+// ----------------------------------------------------------------------------------
+
+/**
+ * Private data of the io_uring backend.
+ */
+struct tx_uring
+{
+	/** The io_uring instance and its mapped queues. */
+	int fd;
+	uint8_t *sq_map;
+	size_t sq_map_size;
+	uint8_t *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/** Submission queue, empty whenever a batch is submitted. */
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+
+	/** Completion queue, the kernel advances the tail. */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/**
+	 * Packet buffers of two batches, 2 * capacity * packet_size bytes.
+	 * A batch is composed into one half while the other is in flight.
+	 */
+	uint8_t *buffers;
+	unsigned int half;
+
+	/** Sends submitted but not completed yet. */
+	unsigned int inflight;
+};
+
+
+// ----------------------------------------------------------------------------------
+//  local helper functions
+// ----------------------------------------------------------------------------------
+
+static int tx_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int tx_uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+/**
+ * Checks whether the kernel knows the send opcode.
+ */
+static bool tx_uring_probe(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) + (IORING_OP_SEND + 1) * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe;
+	bool supported = false;
+
+	probe = calloc(1, size);
+	if (probe == NULL)
+		return false;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_SEND + 1) == 0)
+		supported = probe->last_op >= IORING_OP_SEND &&
+			(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return supported;
+}
+
+/**
+ * Waits for all sends in flight and counts the failed ones as dropped,
+ * their packets were already accounted as sent by tx_flush().
+ */
+static void tx_uring_reap(struct tx *tx)
+{
+	struct tx_uring *uring = tx->priv;
+	unsigned int dropped = 0;
+	int err = 0;
+
+	while (uring->inflight > 0)
+	{
+		unsigned int head = *uring->cq_head;
+		unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (tx_uring_enter(uring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			{
+				perror("io_uring_enter");
+				break;
+			}
+			continue;
+		}
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+			// the rest of a panel is canceled after its first failure
+			if (cqe->res < 0)
+			{
+				if (err == 0 || err == -ECANCELED)
+					err = cqe->res;
+				dropped++;
+			}
+			uring->inflight--;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (dropped > 0)
+	{
+		printf("tx: %u packets of the last batch failed: %s\n", dropped, strerror(-err));
+		tx->packets_dropped += dropped;
+	}
+}
+
+
+// ----------------------------------------------------------------------------------
+//  backend
+// ----------------------------------------------------------------------------------
+
+static void tx_uring_close(struct tx *tx)
+{
+	struct tx_uring *uring = tx->priv;
+
+	if (uring == NULL)
+		return;
+
+	// the kernel may still read from the buffers
+	if (uring->inflight > 0)
+		tx_uring_reap(tx);
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_map && uring->cq_map != uring->sq_map)
+		munmap(uring->cq_map, uring->cq_map_size);
+	if (uring->sq_map)
+		munmap(uring->sq_map, uring->sq_map_size);
+	if (uring->fd > -1)
+		close(uring->fd);
+
+	free(uring->buffers);
+	free(uring);
+	tx->priv = NULL;
+}
+
+static int tx_uring_open(struct tx *tx)
+{
+	struct io_uring_params params;
+	struct sockaddr_ll addr;
+	struct tx_uring *uring;
+
+	uring = calloc(1, sizeof(struct tx_uring));
+	if (uring == NULL)
+		return -1;
+	uring->fd = -1;
+	tx->priv = uring;
+
+	if (tx->capacity > TX_URING_MAX_ENTRIES)
+		goto err;
+
+	// the whole batch is submitted at once, the completion
+	// queue is twice as large and can never overflow
+	memset(&params, 0, sizeof(params));
+	uring->fd = tx_uring_setup(tx->capacity, &params);
+	if (uring->fd < 0)
+	{
+		perror("io_uring_setup");
+		goto err;
+	}
+
+	if (!tx_uring_probe(uring->fd))
+	{
+		printf("tx: the kernel cannot send through io_uring\n");
+		goto err;
+	}
+
+	uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (uring->cq_map_size > uring->sq_map_size)
+			uring->sq_map_size = uring->cq_map_size;
+		uring->cq_map_size = uring->sq_map_size;
+	}
+
+	uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_map == MAP_FAILED)
+	{
+		uring->sq_map = NULL;
+		perror("mmap");
+		goto err;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_map = uring->sq_map;
+	else
+	{
+		uring->cq_map = mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_map == MAP_FAILED)
+		{
+			uring->cq_map = NULL;
+			perror("mmap");
+			goto err;
+		}
+	}
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+	{
+		uring->sqes = NULL;
+		perror("mmap");
+		goto err;
+	}
+
+	uring->sq_tail = (unsigned int *)(uring->sq_map + params.sq_off.tail);
+	uring->sq_mask = *(unsigned int *)(uring->sq_map + params.sq_off.ring_mask);
+	uring->cq_head = (unsigned int *)(uring->cq_map + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(uring->cq_map + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(uring->cq_map + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(uring->cq_map + params.cq_off.cqes);
+
+	// every submission queue slot refers to the entry of the same index
+	for (unsigned int i = 0; i < params.sq_entries; i++)
+		((unsigned int *)(uring->sq_map + params.sq_off.array))[i] = i;
+
+	uring->buffers = malloc(2 * (size_t)tx->capacity * tx->packet_size);
+	if (uring->buffers == NULL)
+	{
+		perror("malloc");
+		goto err;
+	}
+
+	// the socket is bound to the interface, the destination is taken
+	// from the ethernet header and no addresses are needed per send
+	memset(&addr, 0, sizeof(struct sockaddr_ll));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = tx->ifindex;
+	if (bind(tx->fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_ll)) < 0)
+	{
+		perror("bind");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	tx_uring_close(tx);
+	return -1;
+}
+
+static uint8_t *tx_uring_slot(struct tx *tx)
+{
+	struct tx_uring *uring = tx->priv;
+
+	return uring->buffers + ((size_t)uring->half * tx->capacity + tx->count) * tx->packet_size;
+}
+
+/**
+ * Reaps the previous batch, which had a whole frame to complete, and
+ * submits the current one, if any, without waiting for it. The packets of a panel
+ * are linked to keep them in order, a failing one cancels the rest of
+ * its panel. The status of a packet only covers its submission.
+ */
+static int tx_uring_flush(struct tx *tx)
+{
+	struct tx_uring *uring = tx->priv;
+	unsigned int tail = *uring->sq_tail;
+	unsigned int submitted = 0;
+	int failed = 0;
+
+	tx_uring_reap(tx);
+	if (tx->count == 0)
+		return 0;
+
+	for (unsigned int i = 0; i < tx->count; i++)
+	{
+		struct io_uring_sqe *sqe = &uring->sqes[(tail + i) & uring->sq_mask];
+		bool linked = (i + 1 < tx->count) && memcmp(tx->packets[i], tx->packets[i + 1], ETH_ALEN) == 0;
+
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = tx->fd;
+		sqe->addr = (uintptr_t)tx->packets[i];
+		sqe->len = tx->lens[i];
+		sqe->flags = linked ? IOSQE_IO_LINK : 0;
+		sqe->user_data = i;
+	}
+	__atomic_store_n(uring->sq_tail, tail + tx->count, __ATOMIC_RELEASE);
+
+	while (submitted < tx->count)
+	{
+		int ret = tx_uring_enter(uring->fd, tx->count - submitted, 0, 0);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// take back what the kernel did not consume, it is
+			// sent again as part of the next frame
+			int err = -errno;
+
+			__atomic_store_n(uring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+			for (unsigned int i = submitted; i < tx->count; i++)
+			{
+				tx->status[i] = err;
+				failed++;
+			}
+			break;
+		}
+
+		for (int i = 0; i < ret; i++)
+			tx->status[submitted++] = 0;
+	}
+
+	uring->inflight = submitted;
+	uring->half ^= 1;
+
+	return failed;
+}
+
+#else
+
+static int tx_uring_open(struct tx *tx)
+{
+	printf("tx: built without io_uring support\n");
+	return -1;
+}
+
+static void tx_uring_close(struct tx *tx)
+{
+}
+
+static uint8_t *tx_uring_slot(struct tx *tx)
+{
+	return NULL;
+}
+
+static int tx_uring_flush(struct tx *tx)
+{
+	return tx->count;
+}
+
+#endif
+
+const struct tx_ops tx_uring_ops =
+{
+	.name = "uring",
+	.open = tx_uring_open,
+	.close = tx_uring_close,
+	.slot = tx_uring_slot,
+	.flush = tx_uring_flush,
+	.flush_empty = true,
+};
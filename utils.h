@@ -2,14 +2,51 @@
 #define _UTILS_H_
 
 #include <stdint.h>
-#include <sys/time.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 
-uint64_t clock_us(void)
+/**
+ * Returns the monotonic time in nanoseconds, unaffected by
+ * changes of the wall clock.
+ */
+static inline uint64_t clock_ns(void)
 {
-	struct timeval time;
-	gettimeofday(&time, NULL);
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
 
-	return (time.tv_sec * 1000 * 1000) + time.tv_usec;
+	return (uint64_t)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
 }
 
-#endif
\ No newline at end of file
+static inline uint64_t clock_us(void)
+{
+	return clock_ns() / 1000;
+}
+
+/**
+ * Feeds len bytes into a running 64 bit hash. The hash is only meant
+ * to detect changed pixel data, it is not cryptographically strong.
+ * @param h the current hash value
+ * @param data the bytes to hash
+ * @param len number of bytes
+ * @return the updated hash value
+ */
+static inline uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 29;
+	}
+
+	for (; len > 0; len--, p++)
+		h = (h ^ *p) * 0x100000001B3ULL;
+
+	return h;
+}
+
+#endif